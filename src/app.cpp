@@ -1,4 +1,5 @@
 #include "app.hpp"
+#include "nn/nn-shm.hpp"
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
@@ -26,7 +27,15 @@ static CollectiveType parseCollectiveType(char *val) {
     if (std::strcmp(val, "auto") == 0) return COLLECTIVE_AUTO;
     if (std::strcmp(val, "star") == 0) return COLLECTIVE_STAR;
     if (std::strcmp(val, "ring") == 0) return COLLECTIVE_RING;
-    throw std::runtime_error("Invalid collective type: " + std::string(val) + " (expected: auto, star, ring)");
+    if (std::strcmp(val, "halving-doubling") == 0) return COLLECTIVE_HALVING_DOUBLING;
+    if (std::strcmp(val, "tree") == 0) return COLLECTIVE_TREE;
+    throw std::runtime_error("Invalid collective type: " + std::string(val) + " (expected: auto, star, ring, halving-doubling, tree)");
+}
+
+static NnBatchSyncMode parseBatchSyncMode(char *val) {
+    if (std::strcmp(val, "fused") == 0) return BATCH_SYNC_FUSED;
+    if (std::strcmp(val, "rows") == 0) return BATCH_SYNC_ROWS;
+    throw std::runtime_error("Invalid batch sync mode: " + std::string(val) + " (expected: fused, rows)");
 }
 
 AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
@@ -37,9 +46,12 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
     args.nBatches = 32;
     args.nThreads = 1;
     args.modelPath = nullptr;
+    args.shardPath = nullptr;
     args.tokenizerPath = nullptr;
     args.prompt = nullptr;
     args.syncType = F_32;
+    args.kvCacheType = F_32;
+    args.ppTransferType = F_32;
     args.nWorkers = 0;
     args.workerHosts = nullptr;
     args.workerPorts = nullptr;
@@ -51,13 +63,21 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
     args.chatTemplateType = TEMPLATE_UNKNOWN;
     args.maxSeqLen = 0;
     args.netTurbo = true;
+    args.netZeroCopy = false;
     args.collectiveType = COLLECTIVE_AUTO;
+    args.batchSyncMode = BATCH_SYNC_FUSED;
+    args.nSyncChunks = 1;
+    args.nNetStreams = 1;
     args.ppSize = 1;
     args.prefillChunkSize = 0;
     args.prefillChunkThreshold = 128;
+    args.nKvSlots = 1;
+    args.kvBlockSize = 128;
+    args.nKvBlocks = 0;
     args.gpuIndex = -1;
     args.gpuSegmentFrom = -1;
     args.gpuSegmentTo = -1;
+    args.numa = false;
 
     int i = 1;
     if (requireMode && argc > 1) {
@@ -78,12 +98,18 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
         char *value = argv[i + 1];
         if (std::strcmp(name, "--model") == 0) {
             args.modelPath = value;
+        } else if (std::strcmp(name, "--shard") == 0) {
+            args.shardPath = value;
         } else if (std::strcmp(name, "--tokenizer") == 0) {
             args.tokenizerPath = value;
         } else if (std::strcmp(name, "--prompt") == 0) {
             args.prompt = value;
         } else if (std::strcmp(name, "--buffer-float-type") == 0) {
             args.syncType = parseFloatType(value);
+        } else if (std::strcmp(name, "--kv-cache-float-type") == 0) {
+            args.kvCacheType = parseFloatType(value);
+            if (args.kvCacheType == F_Q40)
+                throw std::runtime_error("KV cache supports only f32, f16 and q80 float types");
         } else if (std::strcmp(name, "--workers") == 0) {
             int j = i + 1;
             for (; j < argc && argv[j][0] != '-'; j++);
@@ -95,7 +121,8 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
 
             for (int s = 0; s < count; s++) {
                 char *v = argv[i + 1 + s];
-                char *separator = std::strstr(v, ":");
+                // The port separator is searched after the scheme of a shared memory address
+                char *separator = std::strstr((char *)stripSharedMemoryScheme(v), ":");
                 if (separator == NULL) {
                     throw std::runtime_error("Invalid worker address: " + std::string(v));
                 }
@@ -131,16 +158,36 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
                 throw std::runtime_error("GPU segments expected in the format <from>:<to>");
             args.gpuSegmentFrom = atoi(value);
             args.gpuSegmentTo = atoi(separator + 1);
+        } else if (std::strcmp(name, "--numa") == 0) {
+            args.numa = atoi(value) == 1;
         } else if (std::strcmp(name, "--net-turbo") == 0) {
             args.netTurbo = atoi(value) == 1;
+        } else if (std::strcmp(name, "--net-zerocopy") == 0) {
+            args.netZeroCopy = atoi(value) == 1;
         } else if (std::strcmp(name, "--collective") == 0) {
             args.collectiveType = parseCollectiveType(value);
+        } else if (std::strcmp(name, "--batch-sync") == 0) {
+            args.batchSyncMode = parseBatchSyncMode(value);
+        } else if (std::strcmp(name, "--sync-chunks") == 0) {
+            args.nSyncChunks = (unsigned int)atoi(value);
+        } else if (std::strcmp(name, "--net-streams") == 0) {
+            args.nNetStreams = (unsigned int)atoi(value);
         } else if (std::strcmp(name, "--pp-size") == 0) {
             args.ppSize = (unsigned int)atoi(value);
+        } else if (std::strcmp(name, "--pp-transfer-type") == 0) {
+            args.ppTransferType = parseFloatType(value);
+            if (args.ppTransferType == F_Q40)
+                throw std::runtime_error("Pipeline transfer supports only f32, f16 and q80 float types");
         } else if (std::strcmp(name, "--prefill-chunk-size") == 0) {
             args.prefillChunkSize = (unsigned int)atoi(value);
         } else if (std::strcmp(name, "--prefill-chunk-threshold") == 0) {
             args.prefillChunkThreshold = (unsigned int)atoi(value);
+        } else if (std::strcmp(name, "--kv-slots") == 0) {
+            args.nKvSlots = (unsigned int)atoi(value);
+        } else if (std::strcmp(name, "--kv-block-size") == 0) {
+            args.kvBlockSize = (unsigned int)atoi(value);
+        } else if (std::strcmp(name, "--kv-blocks") == 0) {
+            args.nKvBlocks = (unsigned int)atoi(value);
         } else {
             throw std::runtime_error("Unknown option: " + std::string(name));
         }
@@ -150,6 +197,12 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
         throw std::runtime_error("Number of threads must be at least 1");
     if (args.ppSize < 1)
         throw std::runtime_error("Pipeline size must be at least 1");
+    if (args.nKvSlots < 1)
+        throw std::runtime_error("Number of KV cache slots must be at least 1");
+    if (args.nSyncChunks < 1)
+        throw std::runtime_error("Number of sync chunks must be at least 1");
+    if (args.nNetStreams < 1)
+        throw std::runtime_error("Number of network streams must be at least 1");
     return args;
 }
 
@@ -160,12 +213,11 @@ NnUint resolvePrefillChunkBatchSize(const AppCliArgs *args, NnUint nPrefillToken
     if (args->ppSize <= 1)
         return args->nBatches;
 
-    if (nPrefillTokens < args->prefillChunkThreshold)
-        return args->nBatches;
-
     if (args->prefillChunkSize > 0)
         return std::min(args->nBatches, args->prefillChunkSize);
 
+    // Every prompt is split into micro-batches, the stages work on consecutive micro-batches at the same time.
+    // A long prompt gets smaller micro-batches, so the pipeline is full for most of the prefill.
     NnUint autoChunk = args->nBatches / args->ppSize;
     if (autoChunk < 1)
         autoChunk = 1;
@@ -209,15 +261,71 @@ static std::vector<NnExecutorDevice> resolveDevices(AppCliArgs *args, NnNetConfi
     }
 
     if (args->gpuIndex < 0 || (args->gpuSegmentFrom >= 0 && args->gpuSegmentTo >= 0)) {
-        devices.push_back(NnExecutorDevice(new NnCpuDevice(netConfig, nodeConfig, netExecution), -1, -1));
+        devices.push_back(NnExecutorDevice(new NnCpuDevice(netConfig, nodeConfig, netExecution, args->numa), -1, -1));
     }
     return devices;
 }
 
+KvBlockPool::KvBlockPool(NnUint nBlocks, NnUint blockSize) {
+    this->nBlocks = nBlocks;
+    this->blockSize = blockSize;
+    refs.resize(nBlocks, 0);
+    freeBlocks.reserve(nBlocks);
+    for (NnUint i = nBlocks; i > 0; i--)
+        freeBlocks.push_back(i - 1);
+}
+
+NnUint KvBlockPool::getNFreeBlocks() {
+    return freeBlocks.size();
+}
+
+bool KvBlockPool::tryReserve(std::vector<NnUint> &blocks, NnUint nPositions) {
+    const NnUint nRequired = (nPositions + blockSize - 1) / blockSize;
+    if (nRequired <= blocks.size())
+        return true;
+    const NnUint nMissing = nRequired - blocks.size();
+    if (nMissing > freeBlocks.size())
+        return false;
+    for (NnUint i = 0; i < nMissing; i++) {
+        const NnUint block = freeBlocks.back();
+        freeBlocks.pop_back();
+        refs[block] = 1;
+        blocks.push_back(block);
+    }
+    return true;
+}
+
+NnUint KvBlockPool::getRefs(NnUint block) {
+    return refs[block];
+}
+
+void KvBlockPool::retain(NnUint block) {
+    assert(refs[block] > 0);
+    refs[block]++;
+}
+
+void KvBlockPool::release(NnUint block) {
+    assert(refs[block] > 0);
+    refs[block]--;
+    if (refs[block] == 0)
+        freeBlocks.push_back(block);
+}
+
+void KvBlockPool::release(std::vector<NnUint> &blocks) {
+    for (auto it = blocks.rbegin(); it != blocks.rend(); it++)
+        release(*it);
+    blocks.clear();
+}
+
 RootLlmInference::RootLlmInference(LlmNet *net, NnNetExecution *execution, NnExecutor *executor, NnNetwork *network, const NnParallelTopology *topology, NnNodeConfig *nodeConfig) {
     this->header = net->header;
     this->tokenPipe = (float *)execution->pipes[net->tokenPipeIndex];
     this->positionPipe = (float *)execution->pipes[nodeConfig->positionPipeIndex];
+    this->kvIndexPipe = (float *)execution->pipes[nodeConfig->kvIndexPipeIndex];
+    this->kvBlockTablePipe = (float *)execution->pipes[nodeConfig->kvBlockTablePipeIndex];
+    this->kvBlockSize = net->kvBlockSize;
+    this->nKvBlocks = net->nKvBlocks;
+    this->nMaxKvBlocks = net->nMaxKvBlocks;
     this->logitsPipe = (float *)execution->pipes[net->logitsPipeIndex];
     this->execution = execution;
     this->executor = executor;
@@ -226,21 +334,62 @@ RootLlmInference::RootLlmInference(LlmNet *net, NnNetExecution *execution, NnExe
     this->xPipe = execution->pipes[nodeConfig->xPipeIndex];
     this->xPipeRowBytes = net->netConfig.pipes[nodeConfig->xPipeIndex].size.nBytes / net->netConfig.nBatches;
     if (network != nullptr && topology->ppSize > 1)
-        this->pipeline.reset(new NnPipelineCommunicator(network, topology, nodeConfig->nodeIndex));
+        this->pipeline.reset(new NnPipelineCommunicator(network, topology, nodeConfig->nodeIndex, nodeConfig->xTransferType));
+    this->lastStageLeaderIndex = topology->getGlobalRank(topology->ppSize - 1, 0);
+    const NnUint nBatches = net->netConfig.nBatches;
+    this->controlBuffer.resize(sizeof(LlmControlPacket) + (2 + nMaxKvBlocks) * nBatches * sizeof(float) + nBatches * sizeof(SamplerParams));
+    this->samplers.resize(nBatches, nullptr);
+    this->samplerParams.resize(nBatches);
+    this->sampledTokens.resize(nBatches, 0);
+    this->controlPacket.nSampledRows = 0;
 }
 
 void RootLlmInference::setBatchSize(NnUint batchSize) {
     execution->setBatchSize(batchSize);
     controlPacket.batchSize = batchSize;
+    controlPacket.nLogitsRows = batchSize;
+    controlPacket.logitsTopK = 0;
+}
+
+void RootLlmInference::setLogitsRows(NnUint nLogitsRows) {
+    execution->setOutputRows(nLogitsRows);
+    controlPacket.nLogitsRows = nLogitsRows;
+}
+
+void RootLlmInference::setLogitsTopK(NnUint topK) {
+    // Values outside of the candidates are -inf, this is exact only for the greedy sampling
+    execution->setOutputTopK(topK);
+    controlPacket.logitsTopK = topK;
 }
 
 void RootLlmInference::setPosition(NnUint position) {
     assert(position >= 0);
     assert(position + execution->batchSize - 1 < header->seqLen);
 
+    // A single sequence uses the first blocks of the pool in order
     controlPacket.position = position;
-    for (NnUint i = 0; i < execution->batchSize; i++)
+    for (NnUint i = 0; i < execution->batchSize; i++) {
         positionPipe[i] = (float)(position + i);
+        kvIndexPipe[i] = (float)(position + i);
+        float *blockTable = &kvBlockTablePipe[i * nMaxKvBlocks];
+        for (NnUint j = 0; j < nMaxKvBlocks; j++)
+            blockTable[j] = (float)j;
+    }
+}
+
+void RootLlmInference::setRowPosition(NnUint batchIndex, NnUint position, const std::vector<NnUint> &kvBlocks) {
+    assert(batchIndex < execution->batchSize);
+    assert(position < header->seqLen);
+    const NnUint nBlocks = position / kvBlockSize + 1;
+    assert(kvBlocks.size() >= nBlocks);
+
+    if (batchIndex == 0)
+        controlPacket.position = position;
+    positionPipe[batchIndex] = (float)position;
+    kvIndexPipe[batchIndex] = (float)(kvBlocks[position / kvBlockSize] * kvBlockSize + position % kvBlockSize);
+    float *blockTable = &kvBlockTablePipe[batchIndex * nMaxKvBlocks];
+    for (NnUint j = 0; j < nBlocks; j++)
+        blockTable[j] = (float)kvBlocks[j];
 }
 
 void RootLlmInference::setToken(NnUint batchIndex, NnUint token) {
@@ -248,9 +397,38 @@ void RootLlmInference::setToken(NnUint batchIndex, NnUint token) {
     tokenPipe[batchIndex] = (float)token;
 }
 
+void RootLlmInference::setSampler(NnUint logitsRow, Sampler *sampler) {
+    assert(logitsRow < controlPacket.nLogitsRows);
+    if (pipeline.get() == nullptr) {
+        samplers[logitsRow] = sampler;
+        return;
+    }
+    // The coin is drawn here, so the sequence of the sampler is the same as without pipeline parallelism
+    for (NnUint i = controlPacket.nSampledRows; i < logitsRow; i++)
+        samplerParams[i] = SamplerParams{0.0f, 0.0f, 0.0f, (int)header->vocabSize};
+    samplerParams[logitsRow] = sampler->nextParams();
+    controlPacket.nSampledRows = std::max(controlPacket.nSampledRows, logitsRow + 1);
+}
+
+int RootLlmInference::getToken(NnUint logitsRow) {
+    if (pipeline.get() != nullptr)
+        return (int)sampledTokens[logitsRow];
+    assert(samplers[logitsRow] != nullptr);
+    return samplers[logitsRow]->sample(&logitsPipe[logitsRow * header->vocabSize]);
+}
+
 void RootLlmInference::forward() {
-    if (network != nullptr) 
-        network->writeAll(&controlPacket, sizeof(LlmControlPacket));
+    if (network != nullptr) {
+        const NnSize rowsBytes = controlPacket.batchSize * sizeof(float);
+        const NnSize paramsBytes = controlPacket.nSampledRows * sizeof(SamplerParams);
+        NnByte *packet = controlBuffer.data();
+        std::memcpy(packet, &controlPacket, sizeof(LlmControlPacket));
+        std::memcpy(&packet[sizeof(LlmControlPacket)], positionPipe, rowsBytes);
+        std::memcpy(&packet[sizeof(LlmControlPacket) + rowsBytes], kvIndexPipe, rowsBytes);
+        std::memcpy(&packet[sizeof(LlmControlPacket) + 2 * rowsBytes], kvBlockTablePipe, rowsBytes * nMaxKvBlocks);
+        std::memcpy(&packet[sizeof(LlmControlPacket) + (2 + nMaxKvBlocks) * rowsBytes], samplerParams.data(), paramsBytes);
+        network->writeAll(packet, sizeof(LlmControlPacket) + (2 + nMaxKvBlocks) * rowsBytes + paramsBytes);
+    }
     executor->forward();
     if (pipeline.get() != nullptr && pipeline->shouldSendActivations()) {
         const NnSize payloadBytes = xPipeRowBytes * controlPacket.batchSize;
@@ -266,6 +444,12 @@ void RootLlmInference::forward() {
             throw std::runtime_error("Failed to send pipeline activation from root stage");
         }
     }
+    if (controlPacket.nSampledRows > 0) {
+        // The tokens come after the last stage has consumed all activations of this step
+        pipeline->drainCredits();
+        network->read(lastStageLeaderIndex - 1, sampledTokens.data(), controlPacket.nSampledRows * sizeof(NnUint));
+        controlPacket.nSampledRows = 0;
+    }
 }
 
 void RootLlmInference::finish() {
@@ -281,24 +465,51 @@ WorkerLlmInference::WorkerLlmInference(NnNetExecution *execution, NnNetwork *net
     this->network = network;
     this->nodeConfig = nodeConfig;
     this->positionPipe = (float *)execution->pipes[nodeConfig->positionPipeIndex];
+    this->kvIndexPipe = (float *)execution->pipes[nodeConfig->kvIndexPipeIndex];
+    this->kvBlockTablePipe = (float *)execution->pipes[nodeConfig->kvBlockTablePipeIndex];
+    this->nMaxKvBlocks = netConfig->pipes[nodeConfig->kvBlockTablePipeIndex].size.x;
     this->xPipe = execution->pipes[nodeConfig->xPipeIndex];
     this->xPipeRowBytes = netConfig->pipes[nodeConfig->xPipeIndex].size.nBytes / netConfig->nBatches;
     if (topology->ppSize > 1)
-        this->pipeline.reset(new NnPipelineCommunicator(network, topology, nodeConfig->nodeIndex));
+        this->pipeline.reset(new NnPipelineCommunicator(network, topology, nodeConfig->nodeIndex, nodeConfig->xTransferType));
+    this->isSampler = topology->ppSize > 1 && nodeConfig->ppRank == topology->ppSize - 1 && nodeConfig->tpRank == 0;
+    this->logitsPipe = nullptr;
+    this->logitsPipeRowSize = 0;
+    if (isSampler) {
+        this->logitsPipe = (float *)execution->pipes[nodeConfig->logitsPipeIndex];
+        this->logitsPipeRowSize = netConfig->pipes[nodeConfig->logitsPipeIndex].size.x;
+        // The root draws the coins, the seed of this sampler is not used
+        this->sampler.reset(new Sampler((int)logitsPipeRowSize, 0.0f, 0.0f, 0));
+        this->sampledTokens.resize(netConfig->nBatches);
+    }
+    // Other nodes read the params too, they follow the control packet
+    this->samplerParams.resize(netConfig->nBatches);
 }
 
 bool WorkerLlmInference::tryReadControlPacket() {
-    const unsigned long maxAttempts = 10000;
-    if (!network->tryReadWithMaxAttempts(ROOT_SOCKET_INDEX, &controlPacket, sizeof(LlmControlPacket), maxAttempts))
+    const unsigned long idleTimeoutMs = 1000;
+    if (!network->tryReadWithTimeout(ROOT_SOCKET_INDEX, &controlPacket, sizeof(LlmControlPacket), idleTimeoutMs))
         return false;
     if (controlPacket.batchSize == 0) {
         printf("🛑 Stop signal\n");
         isFinished = true;
         return true;
     }
-    for (NnUint i = 0; i < controlPacket.batchSize; i++)
-        positionPipe[i] = (float)(controlPacket.position + i);
+    if (controlPacket.batchSize > execution->nBatches)
+        throw NnExecutorException("Control packet batch size exceeds the number of batches");
+    if (controlPacket.nLogitsRows > controlPacket.batchSize)
+        throw NnExecutorException("Control packet logits rows exceed the batch size");
+    if (controlPacket.nSampledRows > controlPacket.nLogitsRows)
+        throw NnExecutorException("Control packet sampled rows exceed the logits rows");
+    const NnSize rowsBytes = controlPacket.batchSize * sizeof(float);
+    network->read(ROOT_SOCKET_INDEX, positionPipe, rowsBytes);
+    network->read(ROOT_SOCKET_INDEX, kvIndexPipe, rowsBytes);
+    network->read(ROOT_SOCKET_INDEX, kvBlockTablePipe, rowsBytes * nMaxKvBlocks);
+    if (controlPacket.nSampledRows > 0)
+        network->read(ROOT_SOCKET_INDEX, samplerParams.data(), controlPacket.nSampledRows * sizeof(SamplerParams));
     execution->setBatchSize(controlPacket.batchSize);
+    execution->setOutputRows(controlPacket.nLogitsRows);
+    execution->setOutputTopK(controlPacket.logitsTopK);
     return true;
 }
 
@@ -316,6 +527,11 @@ void WorkerLlmInference::beforeForward() {
 }
 
 void WorkerLlmInference::afterForward() {
+    if (isSampler && controlPacket.nSampledRows > 0) {
+        for (NnUint i = 0; i < controlPacket.nSampledRows; i++)
+            sampledTokens[i] = (NnUint)sampler->sample(&logitsPipe[i * logitsPipeRowSize], &samplerParams[i]);
+        network->write(ROOT_SOCKET_INDEX, sampledTokens.data(), controlPacket.nSampledRows * sizeof(NnUint));
+    }
     if (pipeline.get() == nullptr || !pipeline->shouldSendActivations())
         return;
 
@@ -333,12 +549,45 @@ void WorkerLlmInference::afterForward() {
     }
 }
 
+// Workers with a local copy of the same model file load their weights from it, the root sends them nothing
+static void skipWorkersWithLocalWeights(NnNetwork *network, LlmHeader *header, NnRootWeightLoader *loader) {
+    for (NnUint socketIndex = 0; socketIndex < network->nSockets; socketIndex++)
+        network->write(socketIndex, &header->checksum, sizeof(header->checksum));
+    for (NnUint socketIndex = 0; socketIndex < network->nSockets; socketIndex++) {
+        NnUint hasLocalWeights;
+        network->read(socketIndex, &hasLocalWeights, sizeof(hasLocalWeights));
+        if (hasLocalWeights == 1) {
+            loader->skipNode(socketIndex + 1);
+            printf("💿 Worker %u loads its weights locally\n", socketIndex + 1);
+        }
+    }
+}
+
+static bool readHasLocalWeights(NnNetwork *network, AppCliArgs *args, NnNodeConfig *nodeConfig, std::unique_ptr<NnWeightShard> *shard, LlmHeader *localHeader, bool *hasLocalModel) {
+    unsigned long long rootChecksum;
+    network->read(ROOT_SOCKET_INDEX, &rootChecksum, sizeof(rootChecksum));
+    *hasLocalModel = false;
+    if (args->shardPath != nullptr)
+        shard->reset(new NnWeightShard(args->shardPath, nodeConfig, rootChecksum));
+    const bool hasCompleteShard = shard->get() != nullptr && (*shard)->isComplete();
+    if (!hasCompleteShard && args->modelPath != nullptr) {
+        *localHeader = loadLlmHeader(args->modelPath, 0, F_32, F_32);
+        if (localHeader->checksum == rootChecksum)
+            *hasLocalModel = true;
+        else
+            printf("⚠️ The local model file does not match the model of the root, weights are received from the root\n");
+    }
+    NnUint hasLocalWeights = hasCompleteShard || *hasLocalModel ? 1 : 0;
+    network->write(ROOT_SOCKET_INDEX, &hasLocalWeights, sizeof(hasLocalWeights));
+    return hasLocalWeights == 1;
+}
+
 void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *context)) {
     NnUint nNodes = args->nWorkers + 1;
     NnParallelTopology topology = createPPxTPTopology(nNodes, args->ppSize);
 
-    LlmHeader header = loadLlmHeader(args->modelPath, args->maxSeqLen, args->syncType);
-    if (nNodes > header.nKvHeads)
+    LlmHeader header = loadLlmHeader(args->modelPath, args->maxSeqLen, args->syncType, args->kvCacheType);
+    if (topology.tpSize > header.nKvHeads)
         // TODO: https://github.com/b4rtaz/distributed-llama/issues/70
         throw std::runtime_error("This version does not support more nodes than the number of KV heads in the model");
     if (header.weightType == F_Q40 && header.syncType != F_Q80)
@@ -350,7 +599,7 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
 
     Sampler sampler(tokenizer.vocabSize, args->temperature, args->topp, args->seed);
 
-    LlmNet net = buildLlmNet(&header, topology, args->nBatches);
+    LlmNet net = buildLlmNet(&header, topology, args->nBatches, args->nKvSlots, args->kvBlockSize, args->nKvBlocks, args->nSyncChunks, args->ppTransferType);
     std::unique_ptr<LlmNet, void(*)(LlmNet *)> netPtr(&net, releaseLlmNet);
 
     NnNodeConfig *rootNodeConfig = &net.nodeConfigs[0];
@@ -370,19 +619,34 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
     if (nNodes == 1) {
         synchronizer.reset(new NnFakeNodeSynchronizer());
     } else {
-        networkPtr = NnNetwork::connect(args->nWorkers, args->workerHosts, args->workerPorts);
+        networkPtr = NnNetwork::connect(args->nWorkers, args->workerHosts, args->workerPorts, args->nNetStreams);
         network = networkPtr.get();
-        synchronizer.reset(new NnNetworkNodeSynchronizer(network, &execution, &net.netConfig, rootNodeConfig, args->collectiveType));
+        if (args->netZeroCopy)
+            network->setZeroCopy(true);
+        synchronizer.reset(new NnNetworkNodeSynchronizer(network, &execution, &net.netConfig, rootNodeConfig, args->collectiveType, args->batchSyncMode));
 
         NnRootConfigWriter configWriter(network);
         configWriter.writeToWorkers(&net.netConfig, net.nodeConfigs);
     }
 
+    std::unique_ptr<NnWeightShard> shard(nullptr);
+    if (args->shardPath != nullptr)
+        shard.reset(new NnWeightShard(args->shardPath, rootNodeConfig, header.checksum));
+
     std::vector<NnExecutorDevice> devices = resolveDevices(args, &net.netConfig, rootNodeConfig, &execution);
     NnExecutor executor(&net.netConfig, rootNodeConfig, &devices, &execution, synchronizer.get(), args->benchmark);
 
-    NnRootWeightLoader weightLoader(&executor, network, nNodes);
+    NnRootWeightLoader weightLoader(&executor, network, nNodes, net.nodeConfigs);
+    if (shard.get() != nullptr) {
+        shard->attach(&executor);
+        if (shard->isComplete())
+            weightLoader.skipNode(0);
+    }
+    if (network != nullptr)
+        skipWorkersWithLocalWeights(network, &header, &weightLoader);
     loadLlmNetWeight(args->modelPath, &net, &weightLoader);
+    if (shard.get() != nullptr)
+        shard->complete();
 
     RootLlmInference inference(&net, &execution, &executor, network, &topology, rootNodeConfig);
 
@@ -396,7 +660,10 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
         const char *collectiveName = "auto";
         if (args->collectiveType == COLLECTIVE_STAR) collectiveName = "star";
         else if (args->collectiveType == COLLECTIVE_RING) collectiveName = "ring";
-        printf("📡 Collective: %s (nNodes=%d)\n", collectiveName, nNodes);
+        else if (args->collectiveType == COLLECTIVE_HALVING_DOUBLING) collectiveName = "halving-doubling";
+        else if (args->collectiveType == COLLECTIVE_TREE) collectiveName = "tree";
+        printf("📡 Collective: %s (nNodes=%d, batchSync=%s, syncChunks=%u, netStreams=%u)\n", collectiveName, nNodes,
+            args->batchSyncMode == BATCH_SYNC_FUSED ? "fused" : "rows", args->nSyncChunks, network->nStreams);
         printf("🔀 Topology: pp=%u tp=%u\n", topology.ppSize, topology.tpSize);
 
         network->enablePerformanceMonitoring(true);
@@ -426,6 +693,8 @@ void runWorkerApp(AppCliArgs *args) {
     while (true) {
         std::unique_ptr<NnNetwork> networkPtr = NnNetwork::serve(args->port);
         NnNetwork *network = networkPtr.get();
+        if (args->netZeroCopy)
+            network->setZeroCopy(true);
 
         NnWorkerConfigReader configReader(network);
         NnNetConfig netConfig = configReader.readNet();
@@ -435,48 +704,52 @@ void runWorkerApp(AppCliArgs *args) {
 
         printNodeRequiredMemory(&netConfig, &nodeConfig);
 
+        LlmHeader localHeader;
+        bool hasLocalModel;
+        std::unique_ptr<NnWeightShard> shard(nullptr);
+        readHasLocalWeights(network, args, &nodeConfig, &shard, &localHeader, &hasLocalModel);
+
         NnNetExecution execution(args->nThreads, &netConfig);
 
         std::vector<NnExecutorDevice> devices = resolveDevices(args, &netConfig, &nodeConfig, &execution);
-        NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfig, args->collectiveType);
+        NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfig, args->collectiveType, args->batchSyncMode);
         NnExecutor executor(&netConfig, &nodeConfig, &devices, &execution, &synchronizer, false);
 
-        NnWorkerWeightReader weightReader(&executor, network);
-        weightReader.read();
-
         const NnUint inferredTpSize = nodeConfig.tpGroupEnd - nodeConfig.tpGroupStart;
         const NnUint inferredPpSize = inferredTpSize > 0 ? netConfig.nNodes / inferredTpSize : 1;
         NnParallelTopology topology = createPPxTPTopology(netConfig.nNodes, inferredPpSize);
+
+        if (shard.get() != nullptr)
+            shard->attach(&executor);
+        if (hasLocalModel) {
+            // The net is built only for the slices of weights, the loader of a single node fills the local executor
+            LlmNet net = buildLlmNet(&localHeader, topology, netConfig.nBatches);
+            std::unique_ptr<LlmNet, void(*)(LlmNet *)> netPtr(&net, releaseLlmNet);
+            NnRootWeightLoader localLoader(&executor, nullptr, 1u, &nodeConfig);
+            loadLlmNetWeight(args->modelPath, &net, &localLoader);
+        }
+
+        // Waits for the end of loading, with local weights the root sends nothing else
+        NnWorkerWeightReader weightReader(&executor, network);
+        weightReader.read();
+        if (shard.get() != nullptr)
+            shard->complete();
         WorkerLlmInference inference(&execution, network, &topology, &nodeConfig, &netConfig);
-        bool isFirstAttempt = true;
-        bool isTurboEnabled = false;
-        clock_t startTime;
+        // Waits on sockets block in poll, so the worker stays in the non-blocking mode while it is idle
+        if (args->netTurbo) {
+            network->setTurbo(true);
+            printf("🚁 Network is in non-blocking mode\n");
+        }
         while (true) {
             try {
-                if (isFirstAttempt)
-                    startTime = clock();
-
-                if (!inference.tryReadControlPacket()) {
-                    if (isTurboEnabled && !isFirstAttempt && clock() - startTime > CLOCKS_PER_SEC) {
-                        network->setTurbo(false);
-                        isTurboEnabled = false;
-                        printf("🚁 Network is in blocking mode\n");
-                    }
-                    isFirstAttempt = false;
+                if (!inference.tryReadControlPacket())
                     continue;
-                }
                 if (inference.isFinished)
                     break;
 
-                if (args->netTurbo && !isTurboEnabled) {
-                    network->setTurbo(true);
-                    isTurboEnabled = true;
-                    printf("🚁 Network is in non-blocking mode\n");
-                }
                 inference.beforeForward();
                 executor.forward();
                 inference.afterForward();
-                isFirstAttempt = true;
             } catch (const NnTransferSocketException &e) {
                 printf("🚨 Network error: %s\n", e.what());
                 break;
@@ -3,9 +3,11 @@
 
 #include <chrono>
 #include <memory>
+#include <vector>
 #include "nn/nn-core.hpp"
 #include "nn/nn-cpu.hpp"
 #include "nn/nn-pipeline.hpp"
+#include "nn/nn-shard.hpp"
 #include "nn/nn-topology.hpp"
 #include "tokenizer.hpp"
 #include "llm.hpp"
@@ -20,9 +22,12 @@ public:
 
     // inference
     char *modelPath;
+    char *shardPath;
     char *tokenizerPath;
     char *prompt;
     NnFloatType syncType;
+    NnFloatType kvCacheType;
+    NnFloatType ppTransferType;
     NnUint nWorkers;
     char **workerHosts;
     NnUint *workerPorts;
@@ -34,13 +39,21 @@ public:
     ChatTemplateType chatTemplateType;
     NnUint maxSeqLen;
     bool netTurbo;
+    bool netZeroCopy;
     CollectiveType collectiveType;
+    NnBatchSyncMode batchSyncMode;
+    NnUint nSyncChunks;
+    NnUint nNetStreams;
     NnUint ppSize;
     NnUint prefillChunkSize;
     NnUint prefillChunkThreshold;
+    NnUint nKvSlots;
+    NnUint kvBlockSize;
+    NnUint nKvBlocks;
     int gpuIndex;
     int gpuSegmentFrom;
     int gpuSegmentTo;
+    bool numa;
 
     // worker
     NnUint port;
@@ -50,16 +63,44 @@ public:
 };
 
 typedef struct {
-    NnUint position;
+    NnUint position; // position of the first row
     NnUint batchSize; // 0 = stop signal
+    NnUint nLogitsRows; // the first `nLogitsRows` rows produce logits
+    NnUint logitsTopK; // 0 = full logits, otherwise workers send only their top-k candidates
+    NnUint nSampledRows; // with pipeline parallelism the last stage samples the first `nSampledRows` logits rows
+    // followed by `batchSize` positions, `batchSize` KV cache indexes and `batchSize` KV block tables (floats, the POS, KVI and KVB pipes)
+    // and `nSampledRows` sampler params
 } LlmControlPacket;
 
+// Free list of the paged KV cache, the root assigns blocks to sequences.
+// A block may be shared by several sequences, it returns to the pool when the last reference is released.
+class KvBlockPool {
+private:
+    std::vector<NnUint> freeBlocks;
+    std::vector<NnUint> refs;
+public:
+    NnUint blockSize;
+    NnUint nBlocks;
+    KvBlockPool(NnUint nBlocks, NnUint blockSize);
+    NnUint getNFreeBlocks();
+    NnUint getRefs(NnUint block);
+    bool tryReserve(std::vector<NnUint> &blocks, NnUint nPositions);
+    void retain(NnUint block);
+    void release(NnUint block);
+    void release(std::vector<NnUint> &blocks);
+};
+
 class RootLlmInference {
 public:
     float *logitsPipe;
+    NnUint kvBlockSize;
+    NnUint nKvBlocks;
+    NnUint nMaxKvBlocks;
 private:
     float *tokenPipe;
     float *positionPipe;
+    float *kvIndexPipe;
+    float *kvBlockTablePipe;
     LlmHeader *header;
     NnNetExecution *execution;
     NnExecutor *executor;
@@ -69,11 +110,24 @@ private:
     NnByte *xPipe;
     NnSize xPipeRowBytes;
     LlmControlPacket controlPacket;
+    std::vector<NnByte> controlBuffer;
+    // Without pipeline parallelism the root samples its logits, otherwise the leader of the last stage
+    // samples them with these params and sends back only the tokens
+    std::vector<Sampler *> samplers;
+    std::vector<SamplerParams> samplerParams;
+    std::vector<NnUint> sampledTokens;
+    NnUint lastStageLeaderIndex;
 public:
     RootLlmInference(LlmNet *net, NnNetExecution *execution, NnExecutor *executor, NnNetwork *network, const NnParallelTopology *topology, NnNodeConfig *nodeConfig);
     void setBatchSize(NnUint batchSize);
+    void setLogitsRows(NnUint nLogitsRows);
+    void setLogitsTopK(NnUint topK);
     void setPosition(NnUint position);
+    void setRowPosition(NnUint batchIndex, NnUint position, const std::vector<NnUint> &kvBlocks);
     void setToken(NnUint batchIndex, NnUint token);
+    // Must be called before `forward`, the token of the row is then available by `getToken`
+    void setSampler(NnUint logitsRow, Sampler *sampler);
+    int getToken(NnUint logitsRow);
     void forward();
     void finish();
 };
@@ -83,6 +137,9 @@ public:
     bool isFinished;
 private:
     float *positionPipe;
+    float *kvIndexPipe;
+    float *kvBlockTablePipe;
+    NnUint nMaxKvBlocks;
     NnNetExecution *execution;
     NnNetwork *network;
     NnNodeConfig *nodeConfig;
@@ -90,6 +147,12 @@ private:
     NnByte *xPipe;
     NnSize xPipeRowBytes;
     LlmControlPacket controlPacket;
+    float *logitsPipe;
+    NnUint logitsPipeRowSize;
+    bool isSampler;
+    std::unique_ptr<Sampler> sampler;
+    std::vector<SamplerParams> samplerParams;
+    std::vector<NnUint> sampledTokens;
 public:
     WorkerLlmInference(NnNetExecution *execution, NnNetwork *network, const NnParallelTopology *topology, NnNodeConfig *nodeConfig, NnNetConfig *netConfig);
     bool tryReadControlPacket();
@@ -11,6 +11,13 @@
 #include <csignal>
 #include <thread>
 #include <chrono>
+#include <list>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -293,245 +300,513 @@ void writeChatCompletionChunk(HttpRequest &request, const std::string &delta, co
     }
 }
 
-class NaiveCacheItem {
+// Prefix index of the KV cache: a radix tree over token ids where every edge holds the tokens of one
+// KV cache block. Requests sharing a prefix (a system prompt, few-shot examples, the previous turns of a chat)
+// reuse the blocks of the prefix and skip its prefill. The tree holds a reference to each block it stores.
+class KvPrefixTree {
+private:
+    struct Node {
+        NnUint block;
+        unsigned long lastUse;
+        Node *parent;
+        std::map<std::vector<int>, std::unique_ptr<Node>> children;
+    };
+    KvBlockPool *pool;
+    Node root;
+    unsigned long clock;
+    NnUint nNodes;
+
 public:
-    pos_t endPos;
-    ChatMessage message;
-    NaiveCacheItem(pos_t endPos, ChatMessage message) {
-        this->endPos = endPos;
-        this->message = message;
+    KvPrefixTree(KvBlockPool *pool) {
+        this->pool = pool;
+        this->root.parent = nullptr;
+        this->root.lastUse = 0;
+        this->clock = 0;
+        this->nNodes = 0;
     }
-};
 
-class NaiveCache {
-private:
-    std::vector<NaiveCacheItem> cache;
-public:
-    void push(NaiveCacheItem item) {
-        cache.push_back(item);
+    // Appends blocks of the longest cached prefix of `tokens` to `blocks`, the caller owns a reference of each block
+    NnUint match(const int *tokens, NnUint nTokens, std::vector<NnUint> &blocks) {
+        const NnUint blockSize = pool->blockSize;
+        Node *node = &root;
+        clock++;
+        NnUint nMatched = 0;
+        for (NnUint offset = 0; offset + blockSize <= nTokens; offset += blockSize) {
+            std::vector<int> key(&tokens[offset], &tokens[offset + blockSize]);
+            auto it = node->children.find(key);
+            if (it == node->children.end())
+                break;
+            node = it->second.get();
+            node->lastUse = clock;
+            pool->retain(node->block);
+            blocks.push_back(node->block);
+            nMatched++;
+        }
+        return nMatched;
     }
 
-    void clear() {
-        cache.clear();
+    // Adds the full blocks of a sequence, `blocks` holds the KV cache of `tokens`
+    void insert(const int *tokens, NnUint nTokens, const std::vector<NnUint> &blocks) {
+        const NnUint blockSize = pool->blockSize;
+        Node *node = &root;
+        clock++;
+        for (NnUint i = 0; (i + 1) * blockSize <= nTokens && i < blocks.size(); i++) {
+            std::vector<int> key(&tokens[i * blockSize], &tokens[(i + 1) * blockSize]);
+            auto it = node->children.find(key);
+            if (it == node->children.end()) {
+                Node *child = new Node();
+                child->block = blocks[i];
+                child->parent = node;
+                pool->retain(child->block);
+                node->children[key].reset(child);
+                nNodes++;
+                node = child;
+            } else {
+                node = it->second.get();
+            }
+            node->lastUse = clock;
+        }
     }
 
-    bool resolveDeltaPrompt(std::vector<ChatMessage>& messages, pos_t& startPos) {
-        size_t cacheSize = cache.size();
-        if (cacheSize == 0)
+    // Drops the least recently used leaf which is not used by any sequence
+    bool evict() {
+        Node *victim = nullptr;
+        findEvictable(&root, &victim);
+        if (victim == nullptr)
             return false;
-        if (messages.size() > cacheSize) {
-            size_t i = 0;
-            while (i < cacheSize) {
-                if (
-                    cache[i].message.role != messages[i].role ||
-                    cache[i].message.content != messages[i].content
-                ) break;
-                i++;
-            }
-            if (i == cacheSize) {
-                startPos = cache[i - 1].endPos;
-                messages.erase(messages.begin(), messages.begin() + i);
-                printf("🐤 Found naive cache for %zu messages, pos=%d\n", i, startPos);
+        Node *parent = victim->parent;
+        for (auto it = parent->children.begin(); it != parent->children.end(); it++) {
+            if (it->second.get() == victim) {
+                pool->release(victim->block);
+                parent->children.erase(it);
+                nNodes--;
                 return true;
             }
         }
-        cache.clear();
         return false;
     }
+
+    NnUint getNBlocks() {
+        return nNodes;
+    }
+
+private:
+    void findEvictable(Node *node, Node **victim) {
+        for (auto it = node->children.begin(); it != node->children.end(); it++) {
+            Node *child = it->second.get();
+            if (!child->children.empty()) {
+                findEvictable(child, victim);
+            } else if (pool->getRefs(child->block) == 1 && (*victim == nullptr || child->lastUse < (*victim)->lastUse)) {
+                *victim = child;
+            }
+        }
+    }
+};
+
+// Incremental UTF-8 decoder, the tokenizer's decoder keeps a single state so it cannot be shared between sequences
+class ApiTokenDecoder {
+private:
+    Tokenizer *tokenizer;
+    std::string pending;
+    std::string output;
+public:
+    ApiTokenDecoder(Tokenizer *tokenizer) {
+        this->tokenizer = tokenizer;
+    }
+
+    const char *decode(int token) {
+        if (token == tokenizer->bosId)
+            return nullptr;
+        if (tokenizer->isEos(token)) {
+            if (pending.empty())
+                return nullptr;
+            output = pending;
+            pending.clear();
+            return output.c_str();
+        }
+        pending += tokenizer->vocab[token];
+
+        size_t end = 0;
+        size_t i = 0;
+        while (i < pending.size()) {
+            unsigned char c = (unsigned char)pending[i];
+            size_t length = c <= 0x7f ? 1 : (c >= 0xf0 ? 4 : (c >= 0xe0 ? 3 : (c >= 0xc0 ? 2 : 1)));
+            if (i + length > pending.size())
+                break;
+            i += length;
+            end = i;
+        }
+        if (end == 0)
+            return nullptr;
+        output = pending.substr(0, end);
+        pending.erase(0, end);
+        return output.c_str();
+    }
+};
+
+class ApiSequence {
+public:
+    HttpRequest request;
+    NnSocket socket;
+    InferenceParams params;
+    std::vector<int> tokens; // prompt and generated tokens, tokens before `pos` are in the KV cache
+    std::vector<NnUint> kvBlocks;
+    pos_t pos; // position of the next forwarded token
+    pos_t promptEndPos;
+    pos_t maxPredPos;
+    int nPromptTokens;
+    std::string buffer;
+    std::unique_ptr<Sampler> sampler;
+    std::unique_ptr<EosDetector> eosDetector;
+    std::unique_ptr<ApiTokenDecoder> decoder;
+    NnUint nPlannedRows; // rows of the current forward pass
+    NnUint logitsRow; // row with logits of the last forwarded token
+
+    ApiSequence(int clientSocket, HttpRequest &request)
+        : request(request), socket(clientSocket) {}
+};
+
+class ApiRequestQueue {
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::unique_ptr<ApiSequence>> items;
+public:
+    void push(std::unique_ptr<ApiSequence> item) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(std::move(item));
+        }
+        cv.notify_one();
+    }
+
+    std::unique_ptr<ApiSequence> tryPop(bool wait) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (wait)
+            cv.wait(lock, [this] { return !items.empty(); });
+        if (items.empty())
+            return std::unique_ptr<ApiSequence>();
+        std::unique_ptr<ApiSequence> item = std::move(items.front());
+        items.pop_front();
+        return item;
+    }
+};
+
+enum ApiStartResult {
+    START_ACTIVE,
+    START_FINISHED,
+    START_DEFERRED, // not enough free KV cache blocks
 };
 
+// Continuous batching: up to `--kv-slots` sequences are active, rows of all sequences are packed
+// into one forward pass. Decode rows go first, remaining rows are filled with prompt tokens.
+// Finished sequences leave their KV cache blocks in the prefix tree, cached blocks are dropped when the pool is empty.
 class ApiServer {
 private:
     RootLlmInference *inference;
     Tokenizer *tokenizer;
-    Sampler *sampler;
     AppCliArgs *args;
     LlmHeader *header;
-    EosDetector *eosDetector;
+    TokenizerChatStops *stops;
     ChatTemplateGenerator *templateGenerator;
-    NaiveCache naiveCache;
+    ApiRequestQueue *queue;
+    KvBlockPool kvPool;
+    KvPrefixTree prefixTree;
+    std::list<std::unique_ptr<ApiSequence>> sequences;
+    std::unique_ptr<ApiSequence> deferredSequence;
 
 public:
-    ApiServer(RootLlmInference *inference, Tokenizer *tokenizer, Sampler *sampler, AppCliArgs *args, LlmHeader *header, EosDetector *eosDetector, ChatTemplateGenerator *templateGenerator) {
+    ApiServer(RootLlmInference *inference, Tokenizer *tokenizer, AppCliArgs *args, LlmHeader *header, TokenizerChatStops *stops, ChatTemplateGenerator *templateGenerator, ApiRequestQueue *queue)
+        : kvPool(inference->nKvBlocks, inference->kvBlockSize), prefixTree(&kvPool) {
         this->inference = inference;
         this->tokenizer = tokenizer;
-        this->sampler = sampler;
         this->args = args;
         this->header = header;
-        this->eosDetector = eosDetector;
+        this->stops = stops;
         this->templateGenerator = templateGenerator;
+        this->queue = queue;
     }
 
-    void complete(HttpRequest& request) {
-        InferenceParams params = parseRequest(request);
+    void run() {
+        while (true) {
+            admit();
+            if (sequences.empty())
+                continue;
+            step();
+        }
+    }
+
+private:
+    void admit() {
+        while (sequences.size() < args->nKvSlots) {
+            std::unique_ptr<ApiSequence> sequence = deferredSequence
+                ? std::move(deferredSequence)
+                : queue->tryPop(sequences.empty());
+            if (!sequence)
+                return;
+            try {
+                ApiStartResult result = start(sequence.get());
+                if (result == START_ACTIVE) {
+                    sequences.push_back(std::move(sequence));
+                } else if (result == START_DEFERRED) {
+                    deferredSequence = std::move(sequence);
+                    return;
+                }
+            } catch (const NnTransferSocketException &e) {
+                printf("Socket error: %d %s\n", e.code, e.what());
+                kvPool.release(sequence->kvBlocks);
+            }
+        }
+    }
 
-        pos_t startPos = 0;
-        std::vector<ChatMessage> deltaPrompt = params.messages;
-        naiveCache.resolveDeltaPrompt(deltaPrompt, startPos);
+    bool reserveBlocks(ApiSequence *sequence, NnUint nPositions) {
+        while (!kvPool.tryReserve(sequence->kvBlocks, nPositions)) {
+            if (!prefixTree.evict())
+                return false;
+        }
+        return true;
+    }
 
-        size_t nInputItems = deltaPrompt.size();
+    ApiStartResult start(ApiSequence *sequence) {
+        size_t nInputItems = sequence->params.messages.size();
         std::unique_ptr<ChatItem[]> inputItemsPtr(new ChatItem[nInputItems]);
         ChatItem *inputItems = inputItemsPtr.get();
         for (size_t i = 0; i < nInputItems; i++) {
-            inputItems[i].role = deltaPrompt[i].role;
-            inputItems[i].message = deltaPrompt[i].content;
+            inputItems[i].role = sequence->params.messages[i].role;
+            inputItems[i].message = sequence->params.messages[i].content;
         }
 
         GeneratedChat inputPrompt = templateGenerator->generate(nInputItems, inputItems, true);
-        printf("🔹%s🔸", inputPrompt.content);
 
         int nPromptTokens;
         std::unique_ptr<int[]> promptTokensPtr(new int[inputPrompt.length + 2]);
         int *promptTokens = promptTokensPtr.get();
-        bool isStart = startPos == 0;
-        tokenizer->encode((char*)inputPrompt.content, promptTokens, &nPromptTokens, isStart, true);
-
-        pos_t promptEndPos = startPos + nPromptTokens - 1;
-        if (promptEndPos > header->seqLen)
-            promptEndPos = header->seqLen;
-
-        pos_t maxPredPos = params.max_tokens > 0 ? (promptEndPos + params.max_tokens) : header->seqLen;
-        if (maxPredPos > header->seqLen)
-            maxPredPos = header->seqLen;
-
-        for (size_t j = 0; j < deltaPrompt.size(); j++) {
-            naiveCache.push(NaiveCacheItem(promptEndPos, deltaPrompt[j]));
+        tokenizer->encode((char*)inputPrompt.content, promptTokens, &nPromptTokens, true, true);
+
+        if (nPromptTokens > (int)header->seqLen)
+            nPromptTokens = header->seqLen;
+        if (nPromptTokens <= 0) {
+            sequence->nPromptTokens = 0;
+            sequence->pos = 0;
+            sequence->promptEndPos = 0;
+            if (sequence->params.stream)
+                sequence->request.writeStreamStartChunk();
+            finish(sequence);
+            return START_FINISHED;
         }
 
-        std::string buffer;
-
-        if (params.stream)
-            request.writeStreamStartChunk();
-        if (inputPrompt.publicPrompt != nullptr) {
-            if (params.stream)
-                writeChatCompletionChunk(request, inputPrompt.publicPrompt, false);
-            buffer += inputPrompt.publicPrompt;
-        }
-
-        NnUint pos = startPos;
-        int token;
-        NnUint promptPrefillTokens = promptEndPos > pos ? (promptEndPos - pos) : 0;
-        NnUint prefillBatchCap = resolvePrefillChunkBatchSize(args, promptPrefillTokens);
-        NnUint prefillChunkCount = 0;
-        if (prefillBatchCap < args->nBatches) {
-            printf("🔀 API prefill chunking enabled: chunk=%u (maxBatch=%u, threshold=%u)\n",
-                prefillBatchCap,
-                args->nBatches,
-                args->prefillChunkThreshold);
-        }
-        for (NnUint i = 0; ;) {
-            long remainingTokens = promptEndPos - pos;
-            if (remainingTokens <= 0)
-                break;
+        // The last prompt token is always forwarded to get logits
+        NnUint nCachedBlocks = prefixTree.match(promptTokens, nPromptTokens - 1, sequence->kvBlocks);
+        pos_t startPos = nCachedBlocks * kvPool.blockSize;
+        if (!reserveBlocks(sequence, nPromptTokens)) {
+            kvPool.release(sequence->kvBlocks);
+            return START_DEFERRED;
+        }
 
-            NnUint batchSize = remainingTokens < prefillBatchCap
-                ? remainingTokens
-                : prefillBatchCap;
+        sequence->nPromptTokens = nPromptTokens;
+        sequence->tokens.assign(promptTokens, promptTokens + nPromptTokens);
+        sequence->pos = startPos;
+        sequence->promptEndPos = nPromptTokens - 1;
+        sequence->maxPredPos = sequence->params.max_tokens > 0 ? (sequence->promptEndPos + sequence->params.max_tokens) : header->seqLen;
+        if (sequence->maxPredPos > header->seqLen)
+            sequence->maxPredPos = header->seqLen;
 
-            inference->setBatchSize(batchSize);
-            inference->setPosition(pos);
-            for (NnUint j = 0; j < batchSize; j++)
-                inference->setToken(j, promptTokens[i + j]);
+        sequence->sampler.reset(new Sampler(tokenizer->vocabSize, sequence->params.temperature, sequence->params.top_p, sequence->params.seed));
+        sequence->eosDetector.reset(new EosDetector(stops->nStops, tokenizer->eosTokenIds.data(), stops->stops, stops->maxStopLength, stops->maxStopLength));
+        sequence->decoder.reset(new ApiTokenDecoder(tokenizer));
 
-            inference->forward();
-            prefillChunkCount++;
+        printf("🔹 promptTokens=%d cachedTokens=%u\n", nPromptTokens, startPos);
 
-            i += batchSize;
-            pos += batchSize;
-            token = promptTokens[i + 1];
+        if (sequence->params.stream)
+            sequence->request.writeStreamStartChunk();
+        if (inputPrompt.publicPrompt != nullptr) {
+            if (sequence->params.stream)
+                writeChatCompletionChunk(sequence->request, inputPrompt.publicPrompt, false);
+            sequence->buffer += inputPrompt.publicPrompt;
         }
-        if (prefillChunkCount > 0)
-            printf("🔷️ API prefill chunks: %u\n", prefillChunkCount);
-
-        inference->setBatchSize(1);
-        tokenizer->resetDecoder();
-        eosDetector->reset();
-
-        for (; pos < maxPredPos;) {
-            inference->setPosition(pos);
-            inference->setToken(0, token);
-            inference->forward();
-
-            token = sampler->sample(inference->logitsPipe);
+        return START_ACTIVE;
+    }
 
-            char *piece = tokenizer->decode(token);
-            EosDetectorType eosType = eosDetector->append(token, piece);
+    void step() {
+        const NnUint nBatches = args->nBatches;
+        NnUint batchSize = 0;
+        for (auto it = sequences.begin(); it != sequences.end();) {
+            ApiSequence *sequence = it->get();
+            sequence->nPlannedRows = 0;
+            // Prompt blocks are reserved on start, a generating sequence may need a new block
+            if (reserveBlocks(sequence, sequence->pos + 1)) {
+                it++;
+                continue;
+            }
+            printf("🚧 KV cache is full, the sequence is stopped at pos=%u\n", sequence->pos);
+            try {
+                finish(sequence);
+            } catch (const NnTransferSocketException &e) {
+                printf("Socket error: %d %s\n", e.code, e.what());
+                kvPool.release(sequence->kvBlocks);
+            }
+            it = sequences.erase(it);
+        }
+        if (sequences.empty())
+            return;
 
-            if (piece != nullptr) {
-                printf("%s", piece);
-                fflush(stdout);
+        // Decode rows go first, a generating sequence needs only one row per step
+        for (auto it = sequences.begin(); it != sequences.end() && batchSize < nBatches; it++) {
+            ApiSequence *sequence = it->get();
+            if (sequence->tokens.size() - sequence->pos != 1)
+                continue;
+            sequence->nPlannedRows = 1;
+            batchSize++;
+        }
+        // Remaining rows are filled with prompt chunks
+        for (auto it = sequences.begin(); it != sequences.end() && batchSize < nBatches; it++) {
+            ApiSequence *sequence = it->get();
+            NnUint nRemaining = sequence->tokens.size() - sequence->pos;
+            if (nRemaining <= 1)
+                continue;
+            NnUint nRows = std::min(nBatches - batchSize, resolvePrefillChunkBatchSize(args, nRemaining));
+            nRows = std::min(nRows, nRemaining);
+            sequence->nPlannedRows = nRows;
+            batchSize += nRows;
+        }
+        assert(batchSize > 0);
+
+        // Only the last token of a sequence is sampled, these rows go to the beginning of the batch
+        // so the final segment computes logits just for them. Rows are independent, the order does not matter.
+        NnUint nLogitsRows = 0;
+        bool isGreedy = true;
+        for (auto it = sequences.begin(); it != sequences.end(); it++) {
+            ApiSequence *sequence = it->get();
+            if (sequence->nPlannedRows > 0 && sequence->pos + sequence->nPlannedRows == sequence->tokens.size()) {
+                nLogitsRows++;
+                isGreedy = isGreedy && sequence->params.temperature == 0.0f;
             }
+        }
 
-            if (eosType == NOT_EOS || eosType == EOS) {
-                char *delta = eosDetector->getDelta();
-                if (delta != nullptr) {
-                    std::string deltaStr(delta);
-                    if (params.stream)
-                        writeChatCompletionChunk(request, deltaStr, false);
-                    buffer += deltaStr;
+        inference->setBatchSize(batchSize);
+        inference->setLogitsRows(nLogitsRows);
+        // The greedy sampling needs only the argmax, workers send their best candidate
+        if (isGreedy)
+            inference->setLogitsTopK(1);
+        NnUint logitsRow = 0;
+        NnUint row = nLogitsRows;
+        for (auto it = sequences.begin(); it != sequences.end(); it++) {
+            ApiSequence *sequence = it->get();
+            for (NnUint i = 0; i < sequence->nPlannedRows; i++) {
+                const bool isLast = sequence->pos + 1 == sequence->tokens.size();
+                if (isLast) {
+                    sequence->logitsRow = logitsRow;
+                    inference->setSampler(logitsRow, sequence->sampler.get());
                 }
-                eosDetector->reset();
+                const NnUint batchIndex = isLast ? logitsRow++ : row++;
+                inference->setRowPosition(batchIndex, sequence->pos, sequence->kvBlocks);
+                inference->setToken(batchIndex, sequence->tokens[sequence->pos]);
+                sequence->pos++;
+            }
+        }
+        assert(logitsRow == nLogitsRows);
+        assert(row == batchSize);
+        inference->forward();
+
+        for (auto it = sequences.begin(); it != sequences.end();) {
+            ApiSequence *sequence = it->get();
+            bool isFinished = false;
+            try {
+                if (sequence->nPlannedRows > 0 && sequence->pos == sequence->tokens.size())
+                    isFinished = predict(sequence);
+            } catch (const NnTransferSocketException &e) {
+                printf("Socket error: %d %s\n", e.code, e.what());
+                kvPool.release(sequence->kvBlocks);
+                it = sequences.erase(it);
+                continue;
+            }
+            if (isFinished) {
+                it = sequences.erase(it);
+            } else {
+                it++;
             }
-            pos++;
-            if (eosType == EOS) break;
         }
 
-        ChatMessage chatMessage("assistant", buffer);
-        if (pos == header->seqLen) {
-            naiveCache.clear();
-        } else {
-            naiveCache.push(NaiveCacheItem(pos, chatMessage));
+        // Rotate sequences so rows are shared fairly when there are more sequences than batches
+        if (sequences.size() > 1) {
+            sequences.push_back(std::move(sequences.front()));
+            sequences.pop_front();
+        }
+    }
+
+    bool predict(ApiSequence *sequence) {
+        int token = inference->getToken(sequence->logitsRow);
+
+        const char *piece = sequence->decoder->decode(token);
+        EosDetectorType eosType = sequence->eosDetector->append(token, piece);
+        if (eosType == NOT_EOS || eosType == EOS) {
+            char *delta = sequence->eosDetector->getDelta();
+            if (delta != nullptr) {
+                std::string deltaStr(delta);
+                if (sequence->params.stream)
+                    writeChatCompletionChunk(sequence->request, deltaStr, false);
+                sequence->buffer += deltaStr;
+            }
+            sequence->eosDetector->reset();
+        }
+
+        if (eosType == EOS || sequence->pos >= sequence->maxPredPos) {
+            finish(sequence);
+            return true;
         }
+        sequence->tokens.push_back(token);
+        return false;
+    }
 
-        if (params.stream) {
-            writeChatCompletionChunk(request, "", true);
+    void finish(ApiSequence *sequence) {
+        prefixTree.insert(sequence->tokens.data(), sequence->pos, sequence->kvBlocks);
+        kvPool.release(sequence->kvBlocks);
+
+        if (sequence->params.stream) {
+            writeChatCompletionChunk(sequence->request, "", true);
         } else {
-            int nCompletionTokens = pos - promptEndPos;
-            ChatUsage usage(nPromptTokens, nCompletionTokens, nPromptTokens + nCompletionTokens);
+            int nCompletionTokens = sequence->pos - sequence->promptEndPos;
+            ChatUsage usage(sequence->nPromptTokens, nCompletionTokens, sequence->nPromptTokens + nCompletionTokens);
+            ChatMessage chatMessage("assistant", sequence->buffer);
             Choice choice(chatMessage);
             ChatCompletion completion(choice, usage);
             std::string chatJson = ((json)completion).dump();
-            request.writeJson(chatJson);
+            sequence->request.writeJson(chatJson);
         }
-        printf("🔶\n");
+        printf("🔶 pos=%u completionTokens=%d cachedBlocks=%u\n",
+            sequence->pos, (int)(sequence->pos - sequence->promptEndPos), prefixTree.getNBlocks());
         fflush(stdout);
     }
-
-private:
-    InferenceParams parseRequest(HttpRequest& request) {
-        InferenceParams params;
-        params.temperature = args->temperature;
-        params.top_p = args->topp;
-        params.seed = args->seed;
-        params.stream = false;
-        params.messages = parseChatMessages(request.parsedJson["messages"]);
-        params.max_tokens = -1;
-
-        if (request.parsedJson.contains("stream")) {
-            params.stream = request.parsedJson["stream"].get<bool>();
-        }
-        if (request.parsedJson.contains("temperature")) {
-            params.temperature = request.parsedJson["temperature"].template get<float>();
-        }
-        if (request.parsedJson.contains("seed")) {
-            params.seed = request.parsedJson["seed"].template get<unsigned long long>();
-            sampler->setSeed(params.seed);
-        }
-        if (request.parsedJson.contains("max_tokens")) {
-            params.max_tokens = request.parsedJson["max_tokens"].template get<int>();
-        }
-        if (request.parsedJson.contains("stop")) {
-            params.stop = request.parsedJson["stop"].template get<std::vector<std::string>>();
-        } else {
-            const std::string defaultStop = "<|eot_id|>";
-            params.stop = std::vector<std::string>{defaultStop};
-        }
-        return params;
-    }
 };
 
-void handleCompletionsRequest(HttpRequest& request, ApiServer *api) {
-    api->complete(request);
+static InferenceParams parseRequest(HttpRequest& request, AppCliArgs *args) {
+    InferenceParams params;
+    params.temperature = args->temperature;
+    params.top_p = args->topp;
+    params.seed = args->seed;
+    params.stream = false;
+    params.messages = parseChatMessages(request.parsedJson["messages"]);
+    params.max_tokens = -1;
+
+    if (request.parsedJson.contains("stream")) {
+        params.stream = request.parsedJson["stream"].get<bool>();
+    }
+    if (request.parsedJson.contains("temperature")) {
+        params.temperature = request.parsedJson["temperature"].template get<float>();
+    }
+    if (request.parsedJson.contains("seed")) {
+        params.seed = request.parsedJson["seed"].template get<unsigned long long>();
+    }
+    if (request.parsedJson.contains("max_tokens")) {
+        params.max_tokens = request.parsedJson["max_tokens"].template get<int>();
+    }
+    if (request.parsedJson.contains("stop")) {
+        params.stop = request.parsedJson["stop"].template get<std::vector<std::string>>();
+    } else {
+        const std::string defaultStop = "<|eot_id|>";
+        params.stop = std::vector<std::string>{defaultStop};
+    }
+    return params;
 }
 
 void handleModelsRequest(HttpRequest& request, const char* modelPath) {
@@ -545,43 +820,61 @@ void handleModelsRequest(HttpRequest& request, const char* modelPath) {
     request.writeJson(response);
 }
 
-static void server(AppInferenceContext *context) {
-    NnSocket serverSocket(createServerSocket(context->args->port));
-
-    TokenizerChatStops stops(context->tokenizer);
-    ChatTemplateGenerator templateGenerator(context->args->chatTemplateType, context->tokenizer->chatTemplate, stops.stops[0]);
-    EosDetector eosDetector(stops.nStops, context->tokenizer->eosTokenIds.data(), stops.stops, stops.maxStopLength, stops.maxStopLength);
-    ApiServer api(context->inference, context->tokenizer, context->sampler, context->args, context->header, &eosDetector, &templateGenerator);
-
-    printf("Server URL: http://127.0.0.1:%d/v1/\n", context->args->port);
-
-    std::vector<Route> routes = {
-        {
-            "/v1/chat/completions",
-            HttpMethod::METHOD_POST,
-            std::bind(&handleCompletionsRequest, std::placeholders::_1, &api)
-        },
-        {
-            "/v1/models",
-            HttpMethod::METHOD_GET,
-            std::bind(&handleModelsRequest, std::placeholders::_1, context->args->modelPath)
-        }
-    };
-
-    while (true) {
+static void acceptLoop(int serverSocket, AppCliArgs *args, ApiRequestQueue *queue, std::atomic<bool> *isRunning) {
+    while (isRunning->load()) {
         try {
-            NnSocket clientSocket(acceptSocket(serverSocket.fd));
+            NnSocket clientSocket(acceptSocket(serverSocket));
             HttpRequest request = HttpRequest::read(clientSocket.fd);
             printf("🔷 %s %s\n", request.getMethod().c_str(), request.path.c_str());
+
+            if (request.method == HttpMethod::METHOD_POST && request.path == "/v1/chat/completions") {
+                std::unique_ptr<ApiSequence> sequence(new ApiSequence(clientSocket.release(), request));
+                sequence->params = parseRequest(request, args);
+                queue->push(std::move(sequence));
+                continue;
+            }
+
+            std::vector<Route> routes = {
+                {
+                    "/v1/models",
+                    HttpMethod::METHOD_GET,
+                    std::bind(&handleModelsRequest, std::placeholders::_1, args->modelPath)
+                }
+            };
             Router::resolve(request, routes);
         } catch (const NnTransferSocketException& e) {
             printf("Socket error: %d %s\n", e.code, e.what());
-        } catch (const NnExecutorException &e) {
-            throw;
+        } catch (const std::exception &e) {
+            if (isRunning->load())
+                printf("Request error: %s\n", e.what());
         }
     }
 }
 
+static void server(AppInferenceContext *context) {
+    NnSocket serverSocket(createServerSocket(context->args->port));
+
+    TokenizerChatStops stops(context->tokenizer);
+    ChatTemplateGenerator templateGenerator(context->args->chatTemplateType, context->tokenizer->chatTemplate, stops.stops[0]);
+    ApiRequestQueue queue;
+    ApiServer api(context->inference, context->tokenizer, context->args, context->header, &stops, &templateGenerator, &queue);
+
+    printf("Server URL: http://127.0.0.1:%d/v1/\n", context->args->port);
+    printf("🔀 KV cache slots: %u, blocks: %u x %u tokens, batch: %u\n",
+        context->args->nKvSlots, context->inference->nKvBlocks, context->inference->kvBlockSize, context->args->nBatches);
+
+    std::atomic<bool> isRunning(true);
+    std::thread acceptThread(acceptLoop, serverSocket.fd, context->args, &queue, &isRunning);
+    try {
+        api.run();
+    } catch (...) {
+        isRunning.store(false);
+        shutdown(serverSocket.fd, 2);
+        acceptThread.join();
+        throw;
+    }
+}
+
 #ifdef _WIN32
     #define EXECUTABLE_NAME "dllama-api.exe"
 #else
@@ -591,13 +884,23 @@ static void server(AppInferenceContext *context) {
 void usage() {
     fprintf(stderr, "Usage: %s {--model <path>} {--tokenizer <path>} [--port <p>]\n", EXECUTABLE_NAME);
     fprintf(stderr, "        [--buffer-float-type {f32|f16|q40|q80}]\n");
+    fprintf(stderr, "        [--pp-transfer-type {f32|f16|q80}]\n");
     fprintf(stderr, "        [--weights-float-type {f32|f16|q40|q80}]\n");
+    fprintf(stderr, "        [--kv-cache-float-type {f32|f16|q80}]\n");
     fprintf(stderr, "        [--max-seq-len <max>]\n");
     fprintf(stderr, "        [--nthreads <n>]\n");
-    fprintf(stderr, "        [--workers <ip:port> ...]\n");
+    fprintf(stderr, "        [--numa <0|1>]\n");
+    fprintf(stderr, "        [--workers <[shm://]ip:port> ...]\n");
     fprintf(stderr, "        [--temperature <temp>]\n");
     fprintf(stderr, "        [--topp <t>]\n");
     fprintf(stderr, "        [--seed <s>]\n");
+    fprintf(stderr, "        [--kv-slots <n>]\n");
+    fprintf(stderr, "        [--kv-block-size <n>]\n");
+    fprintf(stderr, "        [--kv-blocks <n>]\n");
+    fprintf(stderr, "        [--sync-chunks <n>]\n");
+    fprintf(stderr, "        [--net-streams <n>]\n");
+    fprintf(stderr, "        [--net-zerocopy <0|1>]\n");
+    fprintf(stderr, "        [--shard <path>]\n");
     fprintf(stderr, "Example:\n");
     fprintf(stderr, "  sudo nice -n -20 ./dllama-api --port 9990 --nthreads 4 \\\n");
     fprintf(stderr, "    --model dllama_model_llama3_2_3b_instruct_q40.m \\\n");
@@ -0,0 +1,95 @@
+#include "nn/nn-core.hpp"
+#include "nn/nn-cpu.hpp"
+#include "nn/nn-executor.hpp"
+#include "nn/nn-network.hpp"
+#include "nn/nn-shard.hpp"
+#include "nn/nn-topology.hpp"
+#include "llm.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static void printUsage() {
+    printf("Usage:\n");
+    printf("  ./dllama-shard --model <path> --nnodes <n> --output <prefix> [--pp-size <n>]\n");
+    printf("\n");
+    printf("Writes the weights of every node to <prefix>.<nodeIndex>.shard, the node uses its file with --shard <path>.\n");
+}
+
+static void exportShards(const char *modelPath, NnUint nNodes, NnUint ppSize, const char *outputPrefix) {
+    NnParallelTopology topology = createPPxTPTopology(nNodes, ppSize);
+
+    // The slices of weights do not depend on the context length, the shortest one keeps the KV cache small
+    LlmHeader header = loadLlmHeader(modelPath, 1u, F_32, F_32);
+    header.syncType = header.weightType == F_Q40 ? F_Q80 : F_32;
+    if (topology.tpSize > header.nKvHeads)
+        throw std::runtime_error("This version does not support more nodes than the number of KV heads in the model");
+    printLlmHeader(&header);
+
+    LlmNet net = buildLlmNet(&header, topology, 1u);
+    std::unique_ptr<LlmNet, void(*)(LlmNet *)> netPtr(&net, releaseLlmNet);
+
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        NnNodeConfig *nodeConfig = &net.nodeConfigs[nodeIndex];
+        const std::string path = std::string(outputPrefix) + "." + std::to_string(nodeIndex) + ".shard";
+        NnWeightShard shard(path.c_str(), nodeConfig, header.checksum);
+        if (shard.isComplete())
+            continue;
+
+        NnNetExecution execution(1u, &net.netConfig);
+        std::vector<NnExecutorDevice> devices;
+        devices.push_back(NnExecutorDevice(new NnCpuDevice(&net.netConfig, nodeConfig, &execution), -1, -1));
+        NnFakeNodeSynchronizer synchronizer;
+        NnExecutor executor(&net.netConfig, nodeConfig, &devices, &execution, &synchronizer, false);
+
+        // The loader of a single node writes through the executor into the mapped shard
+        shard.attach(&executor);
+        NnRootWeightLoader loader(&executor, nullptr, 1u, nodeConfig);
+        loadLlmNetWeight(modelPath, &net, &loader);
+        shard.complete();
+    }
+}
+
+int main(int argc, char **argv) {
+    initQuants();
+
+    const char *modelPath = nullptr;
+    const char *outputPrefix = nullptr;
+    NnUint nNodes = 0;
+    NnUint ppSize = 1;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0) {
+                printUsage();
+                return EXIT_SUCCESS;
+            }
+        }
+        for (int i = 1; i + 1 < argc; i += 2) {
+            const char *name = argv[i];
+            const char *value = argv[i + 1];
+            if (std::strcmp(name, "--model") == 0)
+                modelPath = value;
+            else if (std::strcmp(name, "--nnodes") == 0)
+                nNodes = (NnUint)std::atoi(value);
+            else if (std::strcmp(name, "--pp-size") == 0)
+                ppSize = (NnUint)std::atoi(value);
+            else if (std::strcmp(name, "--output") == 0)
+                outputPrefix = value;
+            else
+                throw std::runtime_error("Unknown option: " + std::string(name));
+        }
+        if (modelPath == nullptr || outputPrefix == nullptr || nNodes == 0) {
+            printUsage();
+            throw std::runtime_error("Model, number of nodes and output prefix are required");
+        }
+        exportShards(modelPath, nNodes, ppSize, outputPrefix);
+    } catch (const std::exception &e) {
+        printf("🚨 Critical error: %s\n", e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -59,6 +59,7 @@ static void inference(AppInferenceContext *context) {
             : prefillBatchCap;
 
         context->inference->setBatchSize(batchSize);
+        context->inference->setLogitsRows(0);
         context->inference->setPosition(pos);
         for (NnUint i = 0; i < batchSize; i++)
             context->inference->setToken(i, inputTokens[pos + i]);
@@ -89,15 +90,18 @@ static void inference(AppInferenceContext *context) {
     fflush(stdout);
 
     context->inference->setBatchSize(1);
+    if (context->args->temperature == 0.0f)
+        context->inference->setLogitsTopK(1);
     context->tokenizer->resetDecoder();
 
     const NnUint maxPos = std::min(context->header->seqLen, context->args->steps);
     for (; pos < maxPos; pos++) {
         context->inference->setPosition(pos);
         context->inference->setToken(0, token);
+        context->inference->setSampler(0, context->sampler);
         context->inference->forward();
 
-        token = context->sampler->sample(context->inference->logitsPipe);
+        token = context->inference->getToken(0);
 
         char *piece = context->tokenizer->decode(token);
         if (!hasFirstPredToken) {
@@ -167,6 +171,8 @@ static NnUint readStdin(const char *guide, char *buffer, NnUint size) {
 static void perplexity(AppInferenceContext *context) {
     if (context->args->prompt == nullptr)
         throw std::runtime_error("Prompt is required");
+    if (context->args->ppSize > 1)
+        throw std::runtime_error("Perplexity needs the logits on the root node, pipeline parallelism is not supported");
 
     std::vector<int> inputTokensVec(std::strlen(context->args->prompt) + 3);
     int *inputTokens = inputTokensVec.data();
@@ -256,6 +262,7 @@ static void chat(AppInferenceContext *context) {
                 : prefillBatchCap;
 
             context->inference->setBatchSize(batchSize);
+            context->inference->setLogitsRows(0);
             context->inference->setPosition(pos);
             for (NnUint j = 0; j < batchSize; j++)
                 context->inference->setToken(j, inputTokens[i + j]);
@@ -271,6 +278,8 @@ static void chat(AppInferenceContext *context) {
             printf("🔷️ Chat prefill chunks: %u\n", chatPrefillChunkCount);
 
         context->inference->setBatchSize(1);
+        if (context->args->temperature == 0.0f)
+            context->inference->setLogitsTopK(1);
         context->tokenizer->resetDecoder();
 
         printf("\n🤖 Assistant\n");
@@ -280,9 +289,10 @@ static void chat(AppInferenceContext *context) {
         while (pos < seqLen) {
             context->inference->setPosition(pos);
             context->inference->setToken(0, token);
+            context->inference->setSampler(0, context->sampler);
             context->inference->forward();
 
-            token = context->sampler->sample(context->inference->logitsPipe);
+            token = context->inference->getToken(0);
 
             char *piece = context->tokenizer->decode(token);
             EosDetectorType eosType = eosDetector.append(token, piece);
@@ -309,16 +319,27 @@ static void printUsage() {
     printf("  ./dllama inference --model <path> --tokenizer <path> --prompt <text> --steps <n> [options]\n");
     printf("  ./dllama chat --model <path> --tokenizer <path> [options]\n");
     printf("  ./dllama perplexity --model <path> --tokenizer <path> --prompt <text> [options]\n");
-    printf("  ./dllama worker --port <port> [options]\n");
+    printf("  ./dllama worker --port <port> [--model <path>] [options]\n");
     printf("\n");
     printf("Common options:\n");
     printf("  --nthreads <n>\n");
+    printf("  --numa <0|1>\n");
     printf("  --buffer-float-type <f32|f16|q40|q80>\n");
-    printf("  --workers <host:port> [host:port ...]\n");
-    printf("  --collective <auto|star|ring>\n");
+    printf("  --pp-transfer-type <f32|f16|q80>\n");
+    printf("  --kv-cache-float-type <f32|f16|q80>\n");
+    printf("  --workers <[shm://]host:port> [[shm://]host:port ...]\n");
+    printf("  --collective <auto|star|ring|halving-doubling|tree>\n");
+    printf("  --batch-sync <fused|rows>\n");
+    printf("  --sync-chunks <n>\n");
+    printf("  --net-streams <n>\n");
+    printf("  --net-zerocopy <0|1>\n");
     printf("  --pp-size <n>\n");
     printf("  --prefill-chunk-size <n>\n");
     printf("  --prefill-chunk-threshold <n>\n");
+    printf("  --kv-slots <n>\n");
+    printf("  --kv-block-size <n>\n");
+    printf("  --kv-blocks <n>\n");
+    printf("  --shard <path>\n");
     printf("  --help\n");
 }
 
@@ -5,8 +5,11 @@
 #include "nn/nn-pipeline.hpp"
 #include "mmap.hpp"
 #include "llm.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <stdexcept>
+#include <thread>
 
 static const char *hiddenActToString(LlmHiddenAct act) {
     if (act == HIDDEN_ACT_GELU) return "Gelu";
@@ -28,13 +31,51 @@ static const char *archTypeToString(LlmArchType type) {
     throw std::runtime_error("Unsupported architecture");
 }
 
+// The weights are hashed in fixed chunks on all cores, the checksum of the region hashes the checksums of the chunks,
+// so it does not depend on the number of threads
+static unsigned long long readWeightsChecksum(const char *path, NnSize headerSize, NnSize fileSize, unsigned long long checksum) {
+    const NnSize chunkSize = 64 * 1024 * 1024;
+    const NnSize weightsSize = fileSize - headerSize;
+    const NnSize nChunks = (weightsSize + chunkSize - 1) / chunkSize;
+    const NnUint nThreads = (NnUint)std::max(1ull, std::min((unsigned long long)std::thread::hardware_concurrency(), (unsigned long long)nChunks));
+    std::vector<unsigned long long> chunkChecksums(nChunks);
+    std::atomic_bool hasFailed(false);
+
+    std::vector<std::thread> threads;
+    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+        threads.push_back(std::thread([&, threadIndex]() {
+            FILE *fd = fopen(path, "rb");
+            if (fd == nullptr) {
+                hasFailed = true;
+                return;
+            }
+            std::vector<NnByte> chunk(std::min(chunkSize, weightsSize));
+            for (NnSize chunkIndex = threadIndex; chunkIndex < nChunks && !hasFailed; chunkIndex += nThreads) {
+                const NnSize offset = chunkIndex * chunkSize;
+                const NnSize nBytes = std::min(chunkSize, weightsSize - offset);
+                if (seekTo(fd, headerSize + offset) != 0 || fread(chunk.data(), nBytes, 1, fd) != 1) {
+                    hasFailed = true;
+                    break;
+                }
+                chunkChecksums[chunkIndex] = updateChecksum(CHECKSUM_INIT, chunk.data(), nBytes);
+            }
+            fclose(fd);
+        }));
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    if (hasFailed)
+        throw std::runtime_error("Cannot read weights");
+    return updateChecksum(checksum, chunkChecksums.data(), nChunks * sizeof(unsigned long long));
+}
+
 static float convertNormEpsilon(int value) {
     if (value == 5) return 1e-05f;
     if (value == 6) return 1e-06f;
     throw std::runtime_error("Unsupported norm epsilon");
 }
 
-LlmHeader loadLlmHeader(const char *path, const NnUint maxSeqLen, NnFloatType syncType) {
+LlmHeader loadLlmHeader(const char *path, const NnUint maxSeqLen, NnFloatType syncType, NnFloatType kvCacheType) {
     LlmHeader header;
     std::memset(&header, 0, sizeof(LlmHeader));
     header.weightType = F_UNK;
@@ -109,7 +150,11 @@ LlmHeader loadLlmHeader(const char *path, const NnUint maxSeqLen, NnFloatType sy
     header.qDim = header.headDim * header.nHeads;
     header.kvDim = header.headDim * header.nKvHeads;
     header.syncType = syncType;
+    header.kvCacheType = kvCacheType;
     header.fileSize = (NnSize)seekToEnd(fd);
+    header.checksum = updateChecksum(CHECKSUM_INIT, buffer, header.headerSize);
+    header.checksum = updateChecksum(header.checksum, &header.fileSize, sizeof(header.fileSize));
+    header.checksum = readWeightsChecksum(path, header.headerSize, header.fileSize, header.checksum);
 
     if (header.archType == QWEN3 || header.archType == QWEN3_MOE)
         header.ropeType = ROPE_FALCON;
@@ -137,6 +182,8 @@ void printLlmHeader(LlmHeader *header) {
         printf("💡 MoeHiddenDim: %u\n", header->moeHiddenDim);
     }
     printf("💡 SeqLen: %u\n", header->seqLen);
+    if (header->kvCacheType != F_32)
+        printf("💡 KvCacheType: %s\n", floatTypeToString(header->kvCacheType));
     printf("💡 NormEpsilon: %f\n", header->normEpsilon);
     printf("💡 RopeType: %s\n", ropeTypeToString(header->ropeType));
     printf("💡 RopeTheta: %.0f\n", header->ropeTheta);
@@ -149,8 +196,10 @@ void printLlmHeader(LlmHeader *header) {
     }
 }
 
-LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBatches) {
+LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBatches, NnUint nKvSlots, NnUint kvBlockSize, NnUint nKvBlocks, NnUint nSyncChunks, NnFloatType ppTransferType) {
     NnUint nNodes = topology.nNodes;
+    // weights and the KV cache are split between the nodes of a pipeline stage
+    NnUint tpSize = topology.tpSize;
     NnUint nExpertsOr1 = std::max(h->nExperts, 1u);
     NnUint nActiveExpertsOr1 = std::max(h->nActiveExperts, 1u);
     NnUint ffDim = h->hiddenDim;
@@ -158,24 +207,50 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
     if (h->archType == QWEN3_MOE)
         ffDim = h->moeHiddenDim;
 
+    if (nKvSlots < 1)
+        throw std::invalid_argument("Number of KV cache slots must be at least 1");
+    if (ppTransferType != F_32 && ppTransferType != F_16 && ppTransferType != F_Q80)
+        throw std::invalid_argument("Pipeline transfer supports only f32, f16 and q80 float types");
+    if (ppTransferType == F_Q80 && h->dim % Q80_BLOCK_SIZE != 0)
+        throw std::invalid_argument("Pipeline transfer in q80 requires the dimension divisible by " + std::to_string(Q80_BLOCK_SIZE));
+
+    // The KV cache is a pool of fixed-size blocks, every sequence has a table of its blocks.
+    // By default the pool has enough blocks for every slot at the maximum sequence length.
+    if (kvBlockSize == 0 || kvBlockSize > h->seqLen)
+        kvBlockSize = h->seqLen;
+    const NnUint nMaxKvBlocks = (h->seqLen + kvBlockSize - 1) / kvBlockSize;
+    if (nKvBlocks == 0)
+        nKvBlocks = nKvSlots * nMaxKvBlocks;
+    if (nKvBlocks < nMaxKvBlocks)
+        throw std::invalid_argument("KV cache pool must hold at least one sequence of " + std::to_string(h->seqLen) + " tokens");
+
     LlmNet n;
+    n.kvBlockSize = kvBlockSize;
+    n.nKvBlocks = nKvBlocks;
+    n.nMaxKvBlocks = nMaxKvBlocks;
     n.tokenEmbeddingSize = size2D(F_32, h->vocabSize, h->dim);
     n.rmsNormSize = size1D(F_32, h->dim);
     n.qkRmsNormSize = size1D(F_32, h->headDim);
     n.moeGateSize = size2D(F_32, h->dim, h->nExperts);
 
-    NnKvCacheSlice kvCacheSlice = sliceKvCache(h->kvDim, h->seqLen, nNodes);
-    NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(h->nHeads, h->seqLen, nNodes, nBatches);
-
-    n.qSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->qDim);
-    n.kSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->kvDim);
-    n.vSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->kvDim);
-    n.woSlice = sliceColMatmul(h->weightType, nNodes, h->qDim, h->dim);
-
-    n.w1Slice = sliceRowMatmul(h->weightType, nNodes, h->dim, ffDim);
-    n.w2Slice = sliceColMatmul(h->weightType, nNodes, ffDim, h->dim);
-    n.w3Slice = sliceRowMatmul(h->weightType, nNodes, h->dim, ffDim);
-    n.wclsSlice = sliceColMatmul(h->weightType, nNodes, h->dim, h->vocabSize);
+    NnKvCacheSlice kvCacheSlice = sliceKvCache(h->kvDim, nKvBlocks * kvBlockSize, tpSize, h->kvCacheType);
+    NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(h->nHeads, h->seqLen, tpSize, nBatches);
+
+    n.qSlice = sliceRowMatmul(h->weightType, tpSize, h->dim, h->qDim);
+    n.kSlice = sliceRowMatmul(h->weightType, tpSize, h->dim, h->kvDim);
+    n.vSlice = sliceRowMatmul(h->weightType, tpSize, h->dim, h->kvDim);
+    n.woSlice = sliceColMatmul(h->weightType, tpSize, h->qDim, h->dim);
+
+    n.w1Slice = sliceRowMatmul(h->weightType, tpSize, h->dim, ffDim);
+    n.w2Slice = sliceColMatmul(h->weightType, tpSize, ffDim, h->dim);
+    n.w3Slice = sliceRowMatmul(h->weightType, tpSize, h->dim, ffDim);
+    // Only root samples, so each node computes logits for its part of the vocabulary and sends it to root.
+    // Pipeline stages and vocabularies that do not split evenly keep the all-reduced logits.
+    n.isLogitsGathered = topology.ppSize == 1 && h->vocabSize % tpSize == 0;
+    if (n.isLogitsGathered)
+        n.wclsVocabSlice = sliceRowMatmul(h->weightType, tpSize, h->dim, h->vocabSize);
+    else
+        n.wclsSlice = sliceColMatmul(h->weightType, tpSize, h->dim, h->vocabSize);
  
     NnUint nQNormColumns = 1;
     NnUint nKNormColumns = 1;
@@ -191,12 +266,16 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
     NnNetConfigBuilder netBuilder(nNodes, nBatches);
 
     n.positionPipeIndex = netBuilder.addPipe("POS", size2D(F_32, nBatches, 1));
+    n.kvIndexPipeIndex = netBuilder.addPipe("KVI", size2D(F_32, nBatches, 1));
+    n.kvBlockTablePipeIndex = netBuilder.addPipe("KVB", size2D(F_32, nBatches, nMaxKvBlocks));
     n.tokenPipeIndex = netBuilder.addPipe("TOK", size2D(F_32, nBatches, 1));
     n.xPipeIndex = netBuilder.addPipe("X", size2D(F_32, nBatches, h->dim));
     n.logitsPipeIndex = netBuilder.addPipe("LG", size2D(F_32, nBatches, h->vocabSize));
     const NnUint zqPipeIndex = netBuilder.addPipe("ZQ", size2D(F_32, nBatches, h->dim));
 
     netBuilder.addPreSync(n.positionPipeIndex);
+    netBuilder.addPreSync(n.kvIndexPipeIndex);
+    netBuilder.addPreSync(n.kvBlockTablePipeIndex);
 
     n.header = h;
     n.netConfig = netBuilder.build();
@@ -204,7 +283,7 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
 
     for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
         NnNodePlacement nodePlacement = topology.getPlacement(nodeIndex);
-        NnRopeSlice ropeSlice = sliceRope(h->ropeType, h->qDim, h->kvDim, h->nKvHeads, nNodes, h->seqLen, h->headDim, h->ropeTheta, nodeIndex);
+        NnRopeSlice ropeSlice = sliceRope(h->ropeType, h->qDim, h->kvDim, h->nKvHeads, tpSize, h->seqLen, h->headDim, h->ropeTheta, nodePlacement.tpRank);
 
         // Calculate layer range for this PP stage
         NnUint layersPerStage = h->nLayers / topology.ppSize;
@@ -223,7 +302,7 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
             : nodeBuilder.addBuffer("q_y", size2D(h->syncType, nBatches, h->dim));
 
         const NnUint zBufferIndex = nodeBuilder.addBuffer("z", size2D(F_32, nBatches, h->qDim));
-        const NnUint zqSliceBufferIndex = nodeBuilder.addBuffer("q_z_slice", size2D(h->syncType, nBatches, h->qDim / nNodes));
+        const NnUint zqSliceBufferIndex = nodeBuilder.addBuffer("q_z_slice", size2D(h->syncType, nBatches, h->qDim / tpSize));
 
         const NnUint qBufferIndex = nodeBuilder.addBuffer("q", size2D(F_32, nBatches, n.qSlice.d0));
         const NnUint kTempBufferIndex = nodeBuilder.addBuffer("k_temp", size2D(F_32, nBatches, n.kSlice.d0));
@@ -233,7 +312,9 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
 
         const NnUint ropeCacheBufferIndex = nodeBuilder.addBuffer("rope_cache", ropeSlice.cacheSize);
         const NnUint attBufferIndex = nodeBuilder.addBuffer("att", multiHeadAttSlice.attSize);
-        const NnUint logitsSliceBufferIndex = nodeBuilder.addBuffer("lg", size2D(F_32, nBatches, h->vocabSize));
+        const NnUint logitsSliceBufferIndex = n.isLogitsGathered
+            ? nodeBuilder.addBuffer("lg", size2D(F_32, nBatches, n.wclsVocabSlice.d0))
+            : nodeBuilder.addBuffer("lg", size2D(F_32, nBatches, h->vocabSize));
 
         // not moe
         const NnUint dBufferIndex = nodeBuilder.addBuffer("d", size2D(F_32, nBatches, n.w1Slice.d0));
@@ -266,8 +347,7 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
                     n.tokenEmbeddingSize,
                     NnEmbeddingOpConfig{});
             }
-            if (topology.ppSize == 1)
-                start.addSync(n.xPipeIndex, SYNC_WITH_ROOT);
+            start.addSync(n.xPipeIndex, SYNC_WITH_ROOT);
         }
         nodeBuilder.addSegment(start.build());
 
@@ -381,13 +461,13 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
                 pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
                 pointerRawConfig(SRC_BUFFER, kBufferIndex),
                 size0(),
-                NnShiftOpCodeConfig{n.positionPipeIndex});
+                NnShiftOpCodeConfig{n.kvIndexPipeIndex});
             att.addOp(
                 OP_SHIFT, "block_shift_v", layerIndex,
                 pointerBatchConfig(SRC_BUFFER, vTempBufferIndex),
                 pointerRawConfig(SRC_BUFFER, vBufferIndex),
                 size0(),
-                NnShiftOpCodeConfig{n.positionPipeIndex});
+                NnShiftOpCodeConfig{n.kvIndexPipeIndex});
             att.addOp(
                 OP_MULTIHEAD_ATT, "block_multihead_att", layerIndex,
                 pointerBatchedSliceConfig(SRC_BUFFER, zBufferIndex),
@@ -396,7 +476,8 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
                 NnMultiHeadAttOpConfig{
                     multiHeadAttSlice.nHeads, multiHeadAttSlice.nHeads0,
                     h->nKvHeads, h->headDim, h->seqLen, n.qSlice.d0, kvCacheSlice.kvDim0,
-                    n.positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex});
+                    n.positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex,
+                    n.kvBlockTablePipeIndex, kvBlockSize, nMaxKvBlocks});
             att.addOp(
                 OP_CAST, "block_cast_y2", layerIndex,
                 pointerBatchedSliceConfig(SRC_BUFFER, zBufferIndex),
@@ -415,7 +496,8 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
                 pointerBatchConfig(SRC_PIPE, zqPipeIndex),
                 size0(),
                 NnCastOpCodeConfig{});
-            att.addSync(zqPipeIndex, SYNC_NODE_SLICES);
+            // the all-reduce of the first columns overlaps the matmul of the next ones
+            att.addSync(zqPipeIndex, SYNC_NODE_SLICES, nSyncChunks);
 
             // ff
             ff.addOp(
@@ -566,7 +648,7 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
                 pointerBatchConfig(SRC_PIPE, zqPipeIndex),
                 size0(),
                 NnCastOpCodeConfig{});
-            ff.addSync(zqPipeIndex, SYNC_NODE_SLICES);
+            ff.addSync(zqPipeIndex, SYNC_NODE_SLICES, h->nExperts == 0 ? nSyncChunks : 1u);
 
             nodeBuilder.addSegment(att.build());
             nodeBuilder.addSegment(ff.build());
@@ -589,9 +671,11 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
             nodeBuilder.addSegment(bridge.build());
         }
 
-        // Final segment: only for the last PP stage
+        // Final segment: only for the last PP stage. It runs only for the rows that need logits,
+        // the root places these rows at the beginning of the batch.
         if (nodePlacement.ppRank == topology.ppSize - 1) {
             NnSegmentConfigBuilder end;
+            end.setOnlyOutputRows();
             end.addOp(
                 OP_MERGE_ADD, "final_merge_add", 0,
                 pointerBatchConfig(SRC_PIPE, zqPipeIndex),
@@ -618,19 +702,35 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
                     size0(),
                     NnCastOpCodeConfig{});
             }
-            end.addOp(
-                OP_MATMUL, "final_matmul_logits", 0,
-                pointerBatchedSliceConfig(SRC_BUFFER, yqBufferIndex),
-                pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
-                size2D(h->weightType, n.wclsSlice.n0, n.wclsSlice.d),
-                NnMatmulOpConfig{});
-            end.addOp(
-                OP_CAST, "final_cast_logits", 0,
-                pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
-                pointerBatchConfig(SRC_PIPE, n.logitsPipeIndex),
-                size0(),
-                NnCastOpCodeConfig{});
-            end.addSync(n.logitsPipeIndex, SYNC_NODE_SLICES);
+            if (n.isLogitsGathered) {
+                end.addOp(
+                    OP_MATMUL, "final_matmul_logits", 0,
+                    pointerBatchConfig(SRC_BUFFER, yqBufferIndex),
+                    pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
+                    size2D(h->weightType, n.wclsVocabSlice.n, n.wclsVocabSlice.d0),
+                    NnMatmulOpConfig{});
+                end.addOp(
+                    OP_CAST, "final_cast_logits", 0,
+                    pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
+                    pointerBatchedSliceConfig(SRC_PIPE, n.logitsPipeIndex),
+                    size0(),
+                    NnCastOpCodeConfig{});
+                end.addSync(n.logitsPipeIndex, SYNC_GATHER_TO_ROOT);
+            } else {
+                end.addOp(
+                    OP_MATMUL, "final_matmul_logits", 0,
+                    pointerBatchedSliceConfig(SRC_BUFFER, yqBufferIndex),
+                    pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
+                    size2D(h->weightType, n.wclsSlice.n0, n.wclsSlice.d),
+                    NnMatmulOpConfig{});
+                end.addOp(
+                    OP_CAST, "final_cast_logits", 0,
+                    pointerBatchConfig(SRC_BUFFER, logitsSliceBufferIndex),
+                    pointerBatchConfig(SRC_PIPE, n.logitsPipeIndex),
+                    size0(),
+                    NnCastOpCodeConfig{});
+                end.addSync(n.logitsPipeIndex, SYNC_NODE_SLICES);
+            }
 
             nodeBuilder.addSegment(end.build());
         }
@@ -640,8 +740,11 @@ LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBat
         nodeConfig.tpGroupStart = nodePlacement.tpGroupStart;
         nodeConfig.tpGroupEnd = nodePlacement.tpGroupEnd;
         nodeConfig.positionPipeIndex = n.positionPipeIndex;
+        nodeConfig.kvIndexPipeIndex = n.kvIndexPipeIndex;
+        nodeConfig.kvBlockTablePipeIndex = n.kvBlockTablePipeIndex;
         nodeConfig.tokenPipeIndex = n.tokenPipeIndex;
         nodeConfig.xPipeIndex = n.xPipeIndex;
+        nodeConfig.xTransferType = ppTransferType;
         nodeConfig.logitsPipeIndex = n.logitsPipeIndex;
         n.nodeConfigs[nodeIndex] = nodeConfig;
     }
@@ -658,12 +761,8 @@ void releaseLlmNet(LlmNet *net) {
 void loadLlmNetWeight(const char *path, LlmNet *net, NnRootWeightLoader *loader) {
     MmapFile file;
     openMmapFile(&file, path, net->header->fileSize);
-#if DEBUG_USE_MMAP_FOR_WEIGHTS
-    assert(net->netConfig.nNodes == 1u);
-#else
     std::unique_ptr<MmapFile, void(*)(MmapFile *)> fdPtr(&file, closeMmapFile);
     printf("💿 Loading weights...\n");
-#endif
 
     Timer timer;
     NnByte *data = (NnByte *)file.data;
@@ -702,7 +801,10 @@ void loadLlmNetWeight(const char *path, LlmNet *net, NnRootWeightLoader *loader)
     }
 
     b += loader->loadAll("final_norm", 0u, net->rmsNormSize.nBytes, b);
-    b += loader->loadColMatmulSlices("final_matmul_logits", 0u, 0u, &net->wclsSlice, b);
+    if (net->isLogitsGathered)
+        b += loader->loadRowMatmulSlices("final_matmul_logits", 0u, 0u, &net->wclsVocabSlice, b);
+    else
+        b += loader->loadColMatmulSlices("final_matmul_logits", 0u, 0u, &net->wclsSlice, b);
 
     long long missingBytes = (long long)(b - data) - net->header->fileSize;
     if (missingBytes != 0u)
@@ -45,6 +45,7 @@ enum LlmArchType {
 typedef struct {
     NnSize headerSize;
     NnSize fileSize;
+    unsigned long long checksum; // header values, file size and all weights, identifies the model file
     int version;
     LlmArchType archType;
     NnUint dim;
@@ -72,6 +73,7 @@ typedef struct {
 
     NnFloatType weightType;
     NnFloatType syncType;
+    NnFloatType kvCacheType;
 } LlmHeader;
 
 typedef struct {
@@ -86,7 +88,14 @@ typedef struct {
     NnColMatmulSlice w2Slice;
     NnRowMatmulSlice w3Slice;
     NnColMatmulSlice wclsSlice;
+    NnRowMatmulSlice wclsVocabSlice;
+    bool isLogitsGathered; // logits are split by the vocabulary and gathered to root, otherwise all-reduced
+    NnUint kvBlockSize;
+    NnUint nKvBlocks;
+    NnUint nMaxKvBlocks;
     NnUint positionPipeIndex;
+    NnUint kvIndexPipeIndex;
+    NnUint kvBlockTablePipeIndex;
     NnUint tokenPipeIndex;
     NnUint xPipeIndex;
     NnUint logitsPipeIndex;
@@ -96,9 +105,9 @@ typedef struct {
     NnSize3D moeGateSize;
 } LlmNet;
 
-LlmHeader loadLlmHeader(const char* path, const unsigned int maxSeqLen, NnFloatType syncType);
+LlmHeader loadLlmHeader(const char* path, const unsigned int maxSeqLen, NnFloatType syncType, NnFloatType kvCacheType);
 void printLlmHeader(LlmHeader *header);
-LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBatches);
+LlmNet buildLlmNet(LlmHeader *h, const NnParallelTopology &topology, NnUint nBatches, NnUint nKvSlots = 1, NnUint kvBlockSize = 0, NnUint nKvBlocks = 0, NnUint nSyncChunks = 1, NnFloatType ppTransferType = F_32);
 void releaseLlmNet(LlmNet *net);
 void loadLlmNetWeight(const char* path, LlmNet *net, NnRootWeightLoader *loader);
 
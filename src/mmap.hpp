@@ -32,6 +32,14 @@ long seekToEnd(FILE* file) {
 #endif
 }
 
+int seekTo(FILE* file, size_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
 void openMmapFile(MmapFile *file, const char *path, size_t size) {
     file->size = size;
 #ifdef _WIN32
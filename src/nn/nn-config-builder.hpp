@@ -78,10 +78,13 @@ public:
         config.ppRank = 0;
         config.tpRank = nodeIndex;
         config.tpGroupStart = 0;
-        config.tpGroupEnd = 1;
+        config.tpGroupEnd = 0; // no topology, the node is in the group of all nodes
         config.positionPipeIndex = 0;
+        config.kvIndexPipeIndex = 0;
+        config.kvBlockTablePipeIndex = 0;
         config.tokenPipeIndex = 0;
         config.xPipeIndex = 0;
+        config.xTransferType = F_32;
         config.logitsPipeIndex = 0;
         config.nBuffers = buffers.size();
         if (config.nBuffers > 0) {
@@ -103,8 +106,13 @@ class NnSegmentConfigBuilder {
 private:
     std::list<NnOpConfig> ops;
     std::list<NnSyncConfig> syncs;
+    bool onlyOutputRows;
 
 public:
+    NnSegmentConfigBuilder() {
+        onlyOutputRows = false;
+    }
+
     template <typename T>
     void addOp(NnOpCode code, const char *name, NnUint index, NnPointerConfig input, NnPointerConfig output, NnSize3D weightSize, T config) {
         NnUint configSize = sizeof(T);
@@ -122,8 +130,12 @@ public:
         });
     };
 
-    void addSync(NnUint pipeIndex, NnSyncType syncType) {
-        syncs.push_back({ pipeIndex, syncType });
+    void addSync(NnUint pipeIndex, NnSyncType syncType, NnUint nChunks = 1) {
+        syncs.push_back({ pipeIndex, syncType, nChunks });
+    }
+
+    void setOnlyOutputRows() {
+        onlyOutputRows = true;
     }
 
     NnSegmentConfig build() {
@@ -138,6 +150,7 @@ public:
             segment.syncs = new NnSyncConfig[segment.nSyncs];
             std::copy(syncs.begin(), syncs.end(), segment.syncs);
         }
+        segment.onlyOutputRows = onlyOutputRows;
         return segment;
     }
 };
@@ -64,6 +64,10 @@ NnOpQuantType getOpQuantType(NnFloatType input, NnFloatType weight, NnFloatType
         if (weight == F_UNK || weight == F_Q80)
             return Q80_Q80_Q80;
     }
+    if (input == F_32 && output == F_16) {
+        if (weight == F_UNK || weight == F_32)
+            return F32_F32_F16;
+    }
     throw std::invalid_argument("Unsupported op quant: " + 
         std::string(floatTypeToString(input)) + "/" +
         std::string(floatTypeToString(weight)) + "/" +
@@ -100,6 +104,7 @@ const char *opQuantTypeToString(NnOpQuantType type) {
     if (type == Q80_Q80_F32) return "Q80_Q80_F32";
     if (type == Q80_Q40_F32) return "Q80_Q40_F32";
     if (type == Q80_F32_F32) return "Q80_F32_F32";
+    if (type == F32_F32_F16) return "F32_F32_F16";
     throw std::invalid_argument("Unknown op quant type");
 }
 
@@ -133,16 +138,58 @@ NnPointerConfig pointerRawConfig(NnPointerSource source, NnUint index) {
     return { source, index, PNTR_RAW };
 }
 
-bool hasPointerContinuousMemory(NnPointerConfig *config) {
+bool hasPointerContinuousMemory(NnPointerConfig *config, NnUint nNodes) {
     if (config->type == PNTR_RAW)
         return true;
     if (config->type == PNTR_BATCH)
         return true;
     if (config->type == PNTR_BATCHED_SLICE)
-        return true;
+        return nNodes == 1; // rows of slices are strided by the full row
     return false;
 }
 
+unsigned long long updateChecksum(unsigned long long checksum, const void *data, NnSize nBytes) {
+    // FNV-1a
+    const NnByte *bytes = (const NnByte *)data;
+    for (NnSize i = 0; i < nBytes; i++) {
+        checksum ^= bytes[i];
+        checksum *= 0x100000001b3ULL;
+    }
+    return checksum;
+}
+
+void resolveTpGroup(const NnNetConfig *netConfig, const NnNodeConfig *nodeConfig, NnUint *tpGroupStart, NnUint *tpGroupEnd) {
+    if (nodeConfig->tpGroupEnd <= nodeConfig->tpGroupStart ||
+        nodeConfig->tpGroupEnd > netConfig->nNodes ||
+        nodeConfig->nodeIndex < nodeConfig->tpGroupStart ||
+        nodeConfig->nodeIndex >= nodeConfig->tpGroupEnd) {
+        *tpGroupStart = 0;
+        *tpGroupEnd = netConfig->nNodes;
+        return;
+    }
+    *tpGroupStart = nodeConfig->tpGroupStart;
+    *tpGroupEnd = nodeConfig->tpGroupEnd;
+}
+
+void splitSyncChunk(NnUint x, NnUint nChunks, NnUint chunkIndex, NnUint *xStart, NnUint *xEnd) {
+    assert(chunkIndex < nChunks);
+    SPLIT_THREADS(start, end, x / SYNC_CHUNK_ALIGNMENT, nChunks, chunkIndex);
+    *xStart = start * SYNC_CHUNK_ALIGNMENT;
+    *xEnd = chunkIndex == nChunks - 1 ? x : end * SYNC_CHUNK_ALIGNMENT;
+}
+
+NnSyncConfig *getChunkedSync(const NnNetConfig *netConfig, NnSegmentConfig *segmentConfig) {
+    for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
+        NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
+        if (syncConfig->nChunks < 2 || syncConfig->syncType != SYNC_NODE_SLICES)
+            continue;
+        const NnSize3D *pipeSize = &netConfig->pipes[syncConfig->pipeIndex].size;
+        if (pipeSize->floatType == F_32 && pipeSize->x >= syncConfig->nChunks * SYNC_CHUNK_ALIGNMENT)
+            return syncConfig;
+    }
+    return nullptr;
+}
+
 void releaseNetConfig(NnNetConfig *netConfig) {
     for (NnUint pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
         delete[] netConfig->pipes[pipeIndex].name;
@@ -210,12 +257,14 @@ NnUint Timer::elapsedMicroseconds() {
 
 // slicers
 
-NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes) {
+NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes, NnFloatType cacheType) {
     NnKvCacheSlice s;
     assert(kvDim % nNodes == 0);
+    if (cacheType != F_32 && cacheType != F_16 && cacheType != F_Q80)
+        throw std::invalid_argument("Unsupported KV cache float type: " + std::string(floatTypeToString(cacheType)));
     s.kvDim0 = kvDim / nNodes;
-    s.keySize = size2D(F_32, seqLen, s.kvDim0);
-    s.valueSize = size2D(F_32, seqLen, s.kvDim0);
+    s.keySize = size2D(cacheType, seqLen, s.kvDim0);
+    s.valueSize = size2D(cacheType, seqLen, s.kvDim0);
     return s;
 }
 
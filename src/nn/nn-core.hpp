@@ -100,10 +100,11 @@ enum NnOpQuantType {
     Q80_Q80_F32,
     Q80_Q40_F32,
     Q80_F32_F32,
+    F32_F32_F16,
 };
 
 #define N_OP_CODES (OP_SHIFT + 1)
-#define N_OP_QUANTS (Q80_F32_F32 + 1)
+#define N_OP_QUANTS (F32_F32_F16 + 1)
 
 enum NnPointerSource {
     SRC_PIPE,
@@ -120,6 +121,7 @@ enum NnSyncType {
     SYNC_WITH_ROOT, // whole pipe to all nodes
     SYNC_NODE_SLICES, // all-reduce (sum) over full pipe buffer
     SYNC_NODE_SLICES_EXCEPT_ROOT, // only workers send slices to root, root does not send
+    SYNC_GATHER_TO_ROOT, // every worker sends its column slice of each row to root
 };
 
 enum NnRopeType {
@@ -164,6 +166,7 @@ typedef struct {
 typedef struct {
     NnUint pipeIndex;
     NnSyncType syncType;
+    NnUint nChunks; // > 1: the all-reduce of a chunk of columns starts while the next chunks are computed
 } NnSyncConfig;
 
 typedef struct  {
@@ -171,6 +174,7 @@ typedef struct  {
     NnOpConfig *ops;
     NnUint nSyncs;
     NnSyncConfig *syncs;
+    bool onlyOutputRows; // the segment processes only the first `nOutputRows` rows of the batch
 } NnSegmentConfig;
 
 typedef struct {
@@ -189,8 +193,11 @@ typedef struct {
     NnUint tpGroupStart;
     NnUint tpGroupEnd;
     NnUint positionPipeIndex;
+    NnUint kvIndexPipeIndex;
+    NnUint kvBlockTablePipeIndex;
     NnUint tokenPipeIndex;
     NnUint xPipeIndex;
+    NnFloatType xTransferType; // float type of the X pipe sent to the next pipeline stage
     NnUint logitsPipeIndex;
     NnUint nBuffers;
     NnBufferConfig *buffers;
@@ -245,6 +252,9 @@ typedef struct {
     NnUint keyCacheBufferIndex;
     NnUint valueCacheBufferIndex;
     NnUint attBufferIndex;
+    NnUint kvBlockTablePipeIndex; // KV cache blocks of the sequence of each batch row
+    NnUint kvBlockSize; // rows per KV cache block
+    NnUint nMaxKvBlocks; // blocks per sequence, the row length of the block table
 } NnMultiHeadAttOpConfig;
 
 typedef struct {
@@ -304,7 +314,18 @@ NnSize3D size3D(NnFloatType floatType, NnUint z, NnUint y, NnUint x);
 NnPointerConfig pointerBatchConfig(NnPointerSource source, NnUint index);
 NnPointerConfig pointerBatchedSliceConfig(NnPointerSource source, NnUint index);
 NnPointerConfig pointerRawConfig(NnPointerSource source, NnUint index);
-bool hasPointerContinuousMemory(NnPointerConfig *config);
+bool hasPointerContinuousMemory(NnPointerConfig *config, NnUint nNodes);
+// Tensor parallel group of the node, configs without a topology use all nodes
+void resolveTpGroup(const NnNetConfig *netConfig, const NnNodeConfig *nodeConfig, NnUint *tpGroupStart, NnUint *tpGroupEnd);
+
+// Columns of a chunked sync, the boundaries are aligned to cache lines of F32 values
+#define SYNC_CHUNK_ALIGNMENT 16
+void splitSyncChunk(NnUint x, NnUint nChunks, NnUint chunkIndex, NnUint *xStart, NnUint *xEnd);
+// The first all-reduce of the segment that may be split into chunks, nullptr if the segment has none
+NnSyncConfig *getChunkedSync(const NnNetConfig *netConfig, NnSegmentConfig *segmentConfig);
+
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+unsigned long long updateChecksum(unsigned long long checksum, const void *data, NnSize nBytes);
 
 void releaseNetConfig(NnNetConfig *netConfig);
 void releaseNodeConfig(NnNodeConfig *nodeConfig);
@@ -323,7 +344,7 @@ public:
 
 // slicers
 
-NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes);
+NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes, NnFloatType cacheType = F_32);
 NnRowMatmulSlice sliceRowMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUint d);
 NnColMatmulSlice sliceColMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUint d);
 NnRopeSlice sliceRope(NnRopeType type, NnUint qDim, NnUint kvDim, NnUint nKvHeads, NnUint nNodes, NnUint seqLen, NnUint headDim, float ropeTheta, NnUint nodeIndex);
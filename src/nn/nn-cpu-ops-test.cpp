@@ -29,6 +29,79 @@ void compare_F32(const char *name, const float *a, const float *b, const NnUint
     printPassed(name);
 }
 
+// rows of a batch stored one after another in `data`
+std::vector<NnByte *> batchRows(void *data, const NnSize3D size) {
+    std::vector<NnByte *> rows(size.y);
+    const NnSize rowBytes = getBytes(size.floatType, size.x);
+    for (NnUint y = 0; y < size.y; y++)
+        rows[y] = &((NnByte *)data)[y * rowBytes];
+    return rows;
+}
+
+void initTestContext(NnCpuOpContext *context, const NnUint nBatches,
+    NnByte **input, const NnSize3D inputSize, NnByte **output, const NnSize3D outputSize) {
+    std::memset(context, 0, sizeof(NnCpuOpContext));
+    context->nBatches = nBatches;
+    context->input = input;
+    context->inputSize = inputSize;
+    context->output = output;
+    context->outputSize = outputSize;
+    context->weightSize = size0();
+}
+
+void forwardAllThreads(NnCpuOpForward forward, NnUint nThreads, NnUint batchSize, NnCpuOpContext *context) {
+    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+        forward(nThreads, threadIndex, batchSize, context);
+}
+
+// memory read or written by the ops of a test
+typedef struct {
+    void *data;
+    NnSize nBytes;
+} TestMemory;
+
+std::vector<NnByte> readMemory(const std::vector<TestMemory> &memory) {
+    std::vector<NnByte> bytes;
+    for (const TestMemory &m : memory)
+        bytes.insert(bytes.end(), (NnByte *)m.data, (NnByte *)m.data + m.nBytes);
+    return bytes;
+}
+
+void writeMemory(const std::vector<TestMemory> &memory, const std::vector<NnByte> &bytes) {
+    NnSize offset = 0;
+    for (const TestMemory &m : memory) {
+        std::memcpy(m.data, &bytes[offset], m.nBytes);
+        offset += m.nBytes;
+    }
+}
+
+// Fusing must keep the results bit-exact: the separate ops and the fused op start from the same `memory`
+// and must leave the same bytes in it. The separate ops run on one thread, because their split by floats
+// moves the scalar tails of the vector loops with the number of threads.
+void assertFusedBitExact(const char *name, const NnOpCode *codes, const NnOpQuantType *quantTypes, const NnCpuOpForward *forwards,
+    const NnUint nOps, const NnUint nThreads, const NnUint batchSize, NnCpuOpContext *contexts, const std::vector<TestMemory> &memory) {
+    std::vector<NnCpuOpForward> fusedForwards(nOps);
+    const NnUint nSteps = getCpuFusedOpForwards(codes, quantTypes, nOps, fusedForwards.data());
+    if (nSteps == 0) {
+        printf("❌ %s failed, the ops are not fused\n", name);
+        exit(1);
+    }
+
+    const std::vector<NnByte> initial = readMemory(memory);
+    for (NnUint opIndex = 0; opIndex < nOps; opIndex++)
+        forwardAllThreads(forwards[opIndex], 1, batchSize, &contexts[opIndex]);
+    const std::vector<NnByte> expected = readMemory(memory);
+
+    writeMemory(memory, initial);
+    for (NnUint stepIndex = 0; stepIndex < nSteps; stepIndex++)
+        forwardAllThreads(fusedForwards[stepIndex], nThreads, batchSize, &contexts[stepIndex]);
+    if (readMemory(memory) != expected) {
+        printf("❌ %s failed\n", name);
+        exit(1);
+    }
+    printPassed(name);
+}
+
 // tests
 
 void testSplitThreads() {
@@ -327,6 +400,54 @@ void testLlamafileSgemm() {
 #endif
 }
 
+void testMatmulColumns() {
+    // the output computed in chunks of columns is the same as the output computed at once
+    const NnUint nBatches = 3;
+    const NnUint n = 64;
+    const NnUint d = 48;
+    const NnUint nChunks = 3;
+
+    std::vector<float> x(n * nBatches);
+    std::vector<float> w(n * d);
+    std::vector<float> o(d * nBatches);
+    std::vector<float> oChunked(d * nBatches);
+    for (NnUint i = 0; i < x.size(); i++)
+        x[i] = sinf(i * 0.11f);
+    for (NnUint i = 0; i < w.size(); i++)
+        w[i] = cosf(i * 0.07f);
+
+    NnMatmulOpConfig config = { 0, 0, 0 };
+    NnByte *buffers[1] = { nullptr };
+    const NnSize3D inputSize = size2D(F_32, nBatches, n);
+    const NnSize3D outputSize = size2D(F_32, nBatches, d);
+    std::vector<NnByte *> input = batchRows(x.data(), inputSize);
+    std::vector<NnByte *> output = batchRows(o.data(), outputSize);
+    std::vector<NnByte *> outputChunked = batchRows(oChunked.data(), outputSize);
+
+    NnCpuOpContext context;
+    initTestContext(&context, nBatches, input.data(), inputSize, output.data(), outputSize);
+    context.name = "matmul";
+    context.buffers = buffers;
+    context.opConfig = &config;
+    context.weight = (NnByte *)w.data();
+    context.weightSize = size2D(F_32, n, d);
+
+    for (int hasContinuousMemory = 0; hasContinuousMemory < 2; hasContinuousMemory++) {
+        context.hasInputContinuousMemory = hasContinuousMemory == 1;
+        context.hasOutputContinuousMemory = hasContinuousMemory == 1;
+        context.output = output.data();
+        matmulForward_F32_F32_F32(1, 0, nBatches, &context);
+        context.output = outputChunked.data();
+        for (NnUint chunkIndex = 0; chunkIndex < nChunks; chunkIndex++) {
+            NnUint xStart;
+            NnUint xEnd;
+            splitSyncChunk(d, nChunks, chunkIndex, &xStart, &xEnd);
+            matmulColumnsForward_F32_F32_F32(1, 0, nBatches, xStart, xEnd, &context);
+        }
+        compare_F32(hasContinuousMemory ? "matmulColumns_sgemm" : "matmulColumns", o.data(), oChunked.data(), o.size(), 0.00001f);
+    }
+}
+
 void testScale() {
     float i[] = {1.0f, 2.0f, 3.0f, 4.0f};
     float o[4];
@@ -344,6 +465,291 @@ void testTopk() {
     printPassed("testTopk");
 }
 
+void testMultiheadAtt_KV() {
+    const NnUint nHeads = 4;
+    const NnUint nKvHeads = 2;
+    const NnUint headDim = 64;
+    const NnUint kvDim = nKvHeads * headDim;
+    const NnUint seqLen = 8;
+    const NnUint pos = seqLen - 1;
+
+    std::vector<float> q(nHeads * headDim);
+    std::vector<float> keyCache(seqLen * kvDim);
+    std::vector<float> valueCache(seqLen * kvDim);
+    for (NnUint i = 0; i < q.size(); i++)
+        q[i] = sinf(i * 0.37f);
+    for (NnUint i = 0; i < keyCache.size(); i++) {
+        keyCache[i] = cosf(i * 0.11f);
+        valueCache[i] = sinf(i * 0.23f);
+    }
+
+    std::vector<NnFp16> keyCacheF16(keyCache.size());
+    std::vector<NnFp16> valueCacheF16(valueCache.size());
+    for (NnUint i = 0; i < keyCache.size(); i++) {
+        keyCacheF16[i] = CONVERT_F32_TO_F16(keyCache[i]);
+        valueCacheF16[i] = CONVERT_F32_TO_F16(valueCache[i]);
+    }
+    std::vector<NnBlockQ80> keyCacheQ80(keyCache.size() / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ80> valueCacheQ80(valueCache.size() / Q80_BLOCK_SIZE);
+    quantizeF32toQ80(keyCache.data(), keyCacheQ80.data(), keyCache.size(), 1, 0);
+    quantizeF32toQ80(valueCache.data(), valueCacheQ80.data(), valueCache.size(), 1, 0);
+
+    std::vector<float> att(nHeads * seqLen);
+    std::vector<float> expectedY(nHeads * headDim);
+    std::vector<float> y(nHeads * headDim);
+    const float blockTable[1] = { 0.0f };
+
+    multiheadAtt_F32(expectedY.data(), q.data(), att.data(), keyCache.data(), valueCache.data(),
+        blockTable, seqLen, pos, nHeads, nHeads, nKvHeads, kvDim, headDim, seqLen, 1, 0);
+
+    multiheadAtt_F32_KV(y.data(), q.data(), att.data(), keyCacheF16.data(), valueCacheF16.data(),
+        blockTable, seqLen, pos, nHeads, nHeads, nKvHeads, kvDim, headDim, seqLen, 1, 0);
+    compare_F32("multiheadAtt_F32_F16", y.data(), expectedY.data(), y.size(), 0.01f);
+
+    multiheadAtt_F32_KV(y.data(), q.data(), att.data(), keyCacheQ80.data(), valueCacheQ80.data(),
+        blockTable, seqLen, pos, nHeads, nHeads, nKvHeads, kvDim, headDim, seqLen, 1, 0);
+    compare_F32("multiheadAtt_F32_Q80", y.data(), expectedY.data(), y.size(), 0.05f);
+}
+
+void testMultiheadAttRows() {
+    // two sequences in one batch, their blocks are interleaved in the pool:
+    // row 0 is at position 5 of blocks {3, 1}, row 1 at position 2 of blocks {2}
+    const NnUint nBatches = 2;
+    const NnUint nHeads = 4;
+    const NnUint nKvHeads = 2;
+    const NnUint headDim = 8;
+    const NnUint qDim = nHeads * headDim;
+    const NnUint kvDim = nKvHeads * headDim;
+    const NnUint seqLen = 8;
+    const NnUint kvBlockSize = 4;
+    const NnUint nMaxKvBlocks = seqLen / kvBlockSize;
+    const NnUint nKvBlocks = 4;
+
+    std::vector<float> query(nBatches * qDim);
+    std::vector<float> keyCache(nKvBlocks * kvBlockSize * kvDim);
+    std::vector<float> valueCache(nKvBlocks * kvBlockSize * kvDim);
+    std::vector<float> att(nBatches * nHeads * seqLen);
+    std::vector<float> y(nBatches * qDim);
+    for (NnUint i = 0; i < query.size(); i++)
+        query[i] = sinf(i * 0.19f);
+    for (NnUint i = 0; i < keyCache.size(); i++) {
+        keyCache[i] = cosf(i * 0.07f);
+        valueCache[i] = sinf(i * 0.13f);
+    }
+
+    float positions[nBatches] = { 5.0f, 2.0f };
+    float blockTables[nBatches * nMaxKvBlocks] = { 3.0f, 1.0f, 2.0f, 0.0f };
+
+    NnMultiHeadAttOpConfig config = {
+        nHeads, nHeads, nKvHeads, headDim, seqLen, qDim, kvDim,
+        0, 0, 1, 2, 3,
+        1, kvBlockSize, nMaxKvBlocks};
+    NnBufferConfig bufferConfigs[4] = {
+        { (char *)"q", size2D(F_32, nBatches, qDim) },
+        { (char *)"k", size2D(F_32, nKvBlocks * kvBlockSize, kvDim) },
+        { (char *)"v", size2D(F_32, nKvBlocks * kvBlockSize, kvDim) },
+        { (char *)"att", size2D(F_32, nBatches, nHeads * seqLen) },
+    };
+    NnByte *buffers[4] = { (NnByte *)query.data(), (NnByte *)keyCache.data(), (NnByte *)valueCache.data(), (NnByte *)att.data() };
+    NnPipeConfig pipeConfigs[2] = {
+        { (char *)"POS", size2D(F_32, nBatches, 1) },
+        { (char *)"KVB", size2D(F_32, nBatches, nMaxKvBlocks) },
+    };
+    NnByte *pipes[2] = { (NnByte *)positions, (NnByte *)blockTables };
+    const NnSize3D outputSize = size2D(F_32, nBatches, qDim);
+    std::vector<NnByte *> output = batchRows(y.data(), outputSize);
+
+    NnCpuOpContext context;
+    initTestContext(&context, nBatches, nullptr, size0(), output.data(), outputSize);
+    context.name = "multihead_att";
+    context.buffers = buffers;
+    context.bufferConfigs = bufferConfigs;
+    context.pipes = pipes;
+    context.pipeConfigs = pipeConfigs;
+    context.opConfig = &config;
+
+    initMultiHeadAttForward(&context);
+    multiHeadAttForward_F32_F32(1, 0, nBatches, &context);
+
+    // reference: gather the blocks of each sequence into a contiguous cache
+    std::vector<float> expectedY(nBatches * qDim);
+    std::vector<float> seqKeyCache(seqLen * kvDim);
+    std::vector<float> seqValueCache(seqLen * kvDim);
+    const float identityTable[1] = { 0.0f };
+    for (NnUint b = 0; b < nBatches; b++) {
+        const NnUint pos = (NnUint)positions[b];
+        for (NnUint t = 0; t <= pos; t++) {
+            const NnUint row = (NnUint)blockTables[b * nMaxKvBlocks + t / kvBlockSize] * kvBlockSize + t % kvBlockSize;
+            std::memcpy(&seqKeyCache[t * kvDim], &keyCache[row * kvDim], kvDim * sizeof(float));
+            std::memcpy(&seqValueCache[t * kvDim], &valueCache[row * kvDim], kvDim * sizeof(float));
+        }
+        multiheadAtt_F32(&expectedY[b * qDim], &query[b * qDim], att.data(),
+            seqKeyCache.data(), seqValueCache.data(), identityTable, seqLen,
+            pos, nHeads, nHeads, nKvHeads, kvDim, headDim, seqLen, 1, 0);
+    }
+    compare_F32("multiheadAttRows", y.data(), expectedY.data(), y.size(), 0.00001f);
+}
+
+void testFusedRmsNormCast(const NnUint batchSize) {
+    const NnUint nThreads = 3;
+    const NnUint nBatches = 4;
+    const NnUint dim = 4 * Q80_BLOCK_SIZE;
+
+    std::vector<float> x(nBatches * dim);
+    for (NnUint i = 0; i < x.size(); i++)
+        x[i] = cosf(i * 0.23f);
+    std::vector<float> weight(dim);
+    for (NnUint i = 0; i < dim; i++)
+        weight[i] = 0.5f + cosf(i * 0.11f);
+    std::vector<float> invRms(nBatches, 0.0f);
+    std::vector<float> y(nBatches * dim, 0.0f);
+    std::vector<NnBlockQ80> yq(nBatches * dim / Q80_BLOCK_SIZE);
+    std::memset(yq.data(), 0, yq.size() * sizeof(NnBlockQ80));
+
+    const NnSize3D xSize = size2D(F_32, nBatches, dim);
+    const NnSize3D invRmsSize = size2D(F_32, nBatches, 1);
+    const NnSize3D yqSize = size2D(F_Q80, nBatches, dim);
+    std::vector<NnByte *> xRows = batchRows(x.data(), xSize);
+    std::vector<NnByte *> invRmsRows = batchRows(invRms.data(), invRmsSize);
+    std::vector<NnByte *> yRows = batchRows(y.data(), xSize);
+    std::vector<NnByte *> yqRows = batchRows(yq.data(), yqSize);
+    NnBufferConfig bufferConfigs[1] = {{ (char *)"inv_rms", invRmsSize }};
+    NnByte *buffers[1] = { (NnByte *)invRms.data() };
+    NnInvRmsOpConfig invRmsConfig = { 1e-5f, 1 };
+    NnRmsNormOpConfig rmsNormConfig = { 0, 1 };
+
+    NnCpuOpContext contexts[3];
+    initTestContext(&contexts[0], nBatches, xRows.data(), xSize, invRmsRows.data(), invRmsSize);
+    initTestContext(&contexts[1], nBatches, xRows.data(), xSize, yRows.data(), xSize);
+    initTestContext(&contexts[2], nBatches, yRows.data(), xSize, yqRows.data(), yqSize);
+    for (NnUint i = 0; i < 3; i++) {
+        contexts[i].buffers = buffers;
+        contexts[i].bufferConfigs = bufferConfigs;
+    }
+    contexts[0].opConfig = &invRmsConfig;
+    contexts[1].opConfig = &rmsNormConfig;
+    contexts[1].weight = (NnByte *)weight.data();
+    contexts[1].weightSize = size2D(F_32, 1, dim);
+
+    const NnOpCode codes[3] = { OP_INV_RMS, OP_RMS_NORM, OP_CAST };
+    const NnOpQuantType quantTypes[3] = { F32_F32_F32, F32_F32_F32, F32_F32_Q80 };
+    const NnCpuOpForward forwards[3] = { invRmsForward_F32_F32, rmsNormForward_F32_F32_F32, castForward_F32_Q80 };
+    char name[32];
+    snprintf(name, sizeof(name), "fusedRmsNormCast_batch%u", batchSize);
+    assertFusedBitExact(name, codes, quantTypes, forwards, 3, nThreads, batchSize, contexts, {
+        { invRms.data(), invRms.size() * sizeof(float) },
+        { y.data(), y.size() * sizeof(float) },
+        { yq.data(), yq.size() * sizeof(NnBlockQ80) }});
+}
+
+void testFusedSiluMulCast() {
+    const NnUint nThreads = 3;
+    const NnUint nBatches = 2;
+    const NnUint dim = 4 * Q80_BLOCK_SIZE;
+
+    std::vector<float> d(nBatches * dim);
+    std::vector<float> l(nBatches * dim);
+    for (NnUint i = 0; i < d.size(); i++) {
+        d[i] = 3.0f * sinf(i * 0.17f);
+        l[i] = cosf(i * 0.29f);
+    }
+    std::vector<NnBlockQ80> dq(nBatches * dim / Q80_BLOCK_SIZE);
+    std::memset(dq.data(), 0, dq.size() * sizeof(NnBlockQ80));
+
+    const NnSize3D dSize = size2D(F_32, nBatches, dim);
+    const NnSize3D dqSize = size2D(F_Q80, nBatches, dim);
+    std::vector<NnByte *> dRows = batchRows(d.data(), dSize);
+    std::vector<NnByte *> dqRows = batchRows(dq.data(), dqSize);
+    NnBufferConfig bufferConfigs[1] = {{ (char *)"l", dSize }};
+    NnByte *buffers[1] = { (NnByte *)l.data() };
+    NnMulOpCodeConfig mulConfig = { 0 };
+
+    NnCpuOpContext contexts[3];
+    initTestContext(&contexts[0], nBatches, dRows.data(), dSize, dRows.data(), dSize);
+    initTestContext(&contexts[1], nBatches, dRows.data(), dSize, dRows.data(), dSize);
+    initTestContext(&contexts[2], nBatches, dRows.data(), dSize, dqRows.data(), dqSize);
+    for (NnUint i = 0; i < 3; i++) {
+        contexts[i].buffers = buffers;
+        contexts[i].bufferConfigs = bufferConfigs;
+    }
+    contexts[1].opConfig = &mulConfig;
+
+    const NnOpCode codes[3] = { OP_SILU, OP_MUL, OP_CAST };
+    const NnOpQuantType quantTypes[3] = { F32_F32_F32, F32_F32_F32, F32_F32_Q80 };
+    const NnCpuOpForward forwards[3] = { siluForward_F32_F32, mulForward_F32_F32, castForward_F32_Q80 };
+    assertFusedBitExact("fusedSiluMulCast", codes, quantTypes, forwards, 3, nThreads, nBatches, contexts, {
+        { d.data(), d.size() * sizeof(float) },
+        { dq.data(), dq.size() * sizeof(NnBlockQ80) }});
+}
+
+void testFusedMatmuls(const NnOpQuantType quantType, const NnUint nOps, const bool hasContinuousMemory) {
+    // the matmuls of the same input with the weights concatenated by rows, as the q/k/v (Q80_Q40_F32) or the w1/w3
+    // projections, run as one matmul: one sgemm with continuous memory, otherwise the rows of all ops split between the threads
+    assert(quantType == F32_F32_F32 || quantType == Q80_Q40_F32);
+    assert(nOps <= 3);
+    const NnUint nThreads = 3;
+    const NnUint nBatches = 4;
+    const NnUint n = 2 * Q80_BLOCK_SIZE;
+    const NnUint d[3] = { 48, 16, 32 };
+    const NnFloatType inputType = quantType == F32_F32_F32 ? F_32 : F_Q80;
+    const NnFloatType weightType = quantType == F32_F32_F32 ? F_32 : F_Q40;
+
+    std::vector<float> x(nBatches * n);
+    for (NnUint i = 0; i < x.size(); i++)
+        x[i] = sinf(i * 0.11f);
+    std::vector<NnBlockQ80> xq(x.size() / Q80_BLOCK_SIZE);
+    quantizeF32toQ80(x.data(), xq.data(), x.size(), 1, 0);
+    const NnSize3D inputSize = size2D(inputType, nBatches, n);
+    std::vector<NnByte *> inputRows = batchRows(inputType == F_32 ? (void *)x.data() : (void *)xq.data(), inputSize);
+
+    NnUint dSum = 0;
+    for (NnUint i = 0; i < nOps; i++)
+        dSum += d[i];
+    std::vector<float> weight(n * dSum);
+    for (NnUint j = 0; j < weight.size(); j++)
+        weight[j] = cosf(j * 0.07f);
+    std::vector<NnBlockQ40> weightQ40(weight.size() / Q40_BLOCK_SIZE);
+    quantizeF32toQ40(weight.data(), weightQ40.data(), weight.size(), 1, 0);
+    NnByte *concatenatedWeight = weightType == F_32 ? (NnByte *)weight.data() : (NnByte *)weightQ40.data();
+
+    NnMatmulOpConfig config = { 0, 0, 0 };
+    NnByte *buffers[1] = { nullptr };
+    std::vector<float> fusedOutputData(nBatches * dSum);
+    NnCpuFusedOutput fusedOutput = { fusedOutputData.data(), fusedOutputData.size(), false };
+    std::vector<float> outputs[3];
+    std::vector<NnByte *> outputRows[3];
+    std::vector<TestMemory> memory;
+    NnCpuOpContext contexts[3];
+    NnOpCode codes[3];
+    NnOpQuantType quantTypes[3];
+    NnCpuOpForward forwards[3];
+    NnSize weightOffset = 0;
+    for (NnUint i = 0; i < nOps; i++) {
+        outputs[i].resize(nBatches * d[i], 0.0f);
+        const NnSize3D outputSize = size2D(F_32, nBatches, d[i]);
+        outputRows[i] = batchRows(outputs[i].data(), outputSize);
+        initTestContext(&contexts[i], nBatches, inputRows.data(), inputSize, outputRows[i].data(), outputSize);
+        contexts[i].name = "matmul";
+        contexts[i].buffers = buffers;
+        contexts[i].opConfig = &config;
+        contexts[i].hasInputContinuousMemory = hasContinuousMemory;
+        contexts[i].hasOutputContinuousMemory = hasContinuousMemory;
+        contexts[i].weight = &concatenatedWeight[weightOffset];
+        contexts[i].weightSize = size2D(weightType, n, d[i]);
+        weightOffset += contexts[i].weightSize.nBytes;
+
+        codes[i] = OP_MATMUL;
+        quantTypes[i] = quantType;
+        forwards[i] = quantType == F32_F32_F32 ? matmulForward_F32_F32_F32 : matmulForward_Q80_Q40_F32;
+        memory.push_back({ outputs[i].data(), outputs[i].size() * sizeof(float) });
+    }
+    contexts[0].fusedOutput = &fusedOutput;
+
+    char name[48];
+    snprintf(name, sizeof(name), "fusedMatmuls_%s%s", opQuantTypeToString(quantType), hasContinuousMemory ? "_sgemm" : "");
+    assertFusedBitExact(name, codes, quantTypes, forwards, nOps, nThreads, nBatches, contexts, memory);
+}
+
 int main() {
     initQuants();
 
@@ -368,7 +774,17 @@ int main() {
     testMatmul_F32_Q40_F32(2);
     testMatmul_F32_Q40_F32(1);
     testLlamafileSgemm();
+    testMatmulColumns();
     testScale();
     testTopk();
+    testMultiheadAtt_KV();
+    testMultiheadAttRows();
+    testFusedRmsNormCast(1);
+    testFusedRmsNormCast(4);
+    testFusedSiluMulCast();
+    testFusedMatmuls(F32_F32_F32, 2, false);
+    testFusedMatmuls(F32_F32_F32, 2, true);
+    testFusedMatmuls(Q80_Q40_F32, 3, false);
+    testFusedMatmuls(Q80_Q40_F32, 3, true);
     return 0;
 }
@@ -750,9 +750,14 @@ static float dotProduct_F32(const float *a, const float *b, const unsigned int s
 #endif
 }
 
+// Maps a position of the sequence to a row of the paged KV cache
+static inline NnSize kvCacheRow(const float *blockTable, const NnUint kvBlockSize, const NnUint pos) {
+    return (NnSize)blockTable[pos / kvBlockSize] * kvBlockSize + pos % kvBlockSize;
+}
+
 static void multiheadAtt_F32(
     float *y, const float *q, float *att, float *keyCache, float *valueCache,
-    const NnUint pos, const NnUint nHeads, const NnUint nHeads0, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headDim, const NnUint seqLen,
+    const float *blockTable, const NnUint kvBlockSize, const NnUint pos, const NnUint nHeads, const NnUint nHeads0, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headDim, const NnUint seqLen,
     const NnUint nThreads, const NnUint threadIndex) 
 {
     SPLIT_THREADS(h0Start, h0End, nHeads0, nThreads, threadIndex);
@@ -767,7 +772,7 @@ static void multiheadAtt_F32(
         float *hAtt = &att[h0 * seqLen];
 
         for (NnUint t = 0; t <= pos; t++) {
-            const float *posK = &hKc[t * kvDim0];
+            const float *posK = &hKc[kvCacheRow(blockTable, kvBlockSize, t) * kvDim0];
             const float score = dotProduct_F32(hQ, posK, headDim) / headDimRoot;
             hAtt[t] = score;
         }
@@ -778,7 +783,7 @@ static void multiheadAtt_F32(
         std::memset(hY, 0, headDim * sizeof(float));
 
         for (NnUint t = 0; t <= pos; t++) {
-            const float *posV = &hVc[t * kvDim0];
+            const float *posV = &hVc[kvCacheRow(blockTable, kvBlockSize, t) * kvDim0];
             const float posA = hAtt[t];
             for (int i = 0; i < headDim; i++) {
                 hY[i] += posA * posV[i];
@@ -787,6 +792,156 @@ static void multiheadAtt_F32(
     }
 }
 
+static float dotProduct_F32_F16(const float *a, const NnFp16 *b, const NnUint size) {
+#if defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    assert(size % 4 == 0);
+    float32x4_t fs = vmovq_n_f32(0);
+    for (NnUint i = 0; i < size; i += 4) {
+        const float32x4_t fa = vld1q_f32(&a[i]);
+        const float32x4_t fb = vcvt_f32_f16(vld1_f16((const __fp16 *)&b[i]));
+        fs = vmlaq_f32(fs, fa, fb);
+    }
+    return vaddvq_f32(fs);
+#elif defined(__AVX2__) && defined(__F16C__)
+    assert(size % 8 == 0);
+    __m256 u = _mm256_set1_ps(0.0f);
+    for (NnUint i = 0; i < size; i += 8) {
+        const __m256 a0 = _mm256_loadu_ps(&a[i]);
+        const __m256 b0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&b[i]));
+        u = _mm256_fmadd_ps(a0, b0, u);
+    }
+    return horizontalSum_avx2(u);
+#else
+    float sum = 0.0f;
+    for (NnUint i = 0; i < size; i++)
+        sum += a[i] * CONVERT_F16_TO_F32(b[i]);
+    return sum;
+#endif
+}
+
+static void addScaled_F32_F16(float *y, const NnFp16 *x, const float s, const NnUint size) {
+    NnUint i = 0;
+#if defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    const float32x4_t fs = vdupq_n_f32(s);
+    for (; i + 4 <= size; i += 4) {
+        const float32x4_t fx = vcvt_f32_f16(vld1_f16((const __fp16 *)&x[i]));
+        vst1q_f32(&y[i], vmlaq_f32(vld1q_f32(&y[i]), fx, fs));
+    }
+#elif defined(__AVX2__) && defined(__F16C__)
+    const __m256 fs = _mm256_set1_ps(s);
+    for (; i + 8 <= size; i += 8) {
+        const __m256 fx = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&x[i]));
+        _mm256_storeu_ps(&y[i], _mm256_fmadd_ps(fx, fs, _mm256_loadu_ps(&y[i])));
+    }
+#endif
+    for (; i < size; i++)
+        y[i] += s * CONVERT_F16_TO_F32(x[i]);
+}
+
+static float dotProduct_F32_Q80(const float *a, const NnBlockQ80 *b, const NnUint size) {
+    assert(size % Q80_BLOCK_SIZE == 0);
+    const NnUint nBlocks = size / Q80_BLOCK_SIZE;
+    float sum = 0.0f;
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const float *ja = &a[j * Q80_BLOCK_SIZE];
+        const std::int8_t *qs = b[j].qs;
+#if defined(__ARM_NEON)
+        float32x4_t fs = vmovq_n_f32(0);
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i += 8) {
+            const int16x8_t q16 = vmovl_s8(vld1_s8(&qs[i]));
+            const float32x4_t q0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(q16)));
+            const float32x4_t q1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16)));
+            fs = vmlaq_f32(fs, vld1q_f32(&ja[i]), q0);
+            fs = vmlaq_f32(fs, vld1q_f32(&ja[i + 4]), q1);
+        }
+        const float blockSum = vaddvq_f32(fs);
+#elif defined(__AVX2__)
+        __m256 u = _mm256_set1_ps(0.0f);
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i += 8) {
+            const __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)&qs[i])));
+            u = _mm256_fmadd_ps(_mm256_loadu_ps(&ja[i]), q, u);
+        }
+        const float blockSum = horizontalSum_avx2(u);
+#else
+        float blockSum = 0.0f;
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i++)
+            blockSum += ja[i] * qs[i];
+#endif
+        sum += blockSum * CONVERT_F16_TO_F32(b[j].d);
+    }
+    return sum;
+}
+
+static void addScaled_F32_Q80(float *y, const NnBlockQ80 *x, const float s, const NnUint size) {
+    assert(size % Q80_BLOCK_SIZE == 0);
+    const NnUint nBlocks = size / Q80_BLOCK_SIZE;
+    for (NnUint j = 0; j < nBlocks; j++) {
+        float *jy = &y[j * Q80_BLOCK_SIZE];
+        const std::int8_t *qs = x[j].qs;
+        const float ds = s * CONVERT_F16_TO_F32(x[j].d);
+#if defined(__ARM_NEON)
+        const float32x4_t fds = vdupq_n_f32(ds);
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i += 8) {
+            const int16x8_t q16 = vmovl_s8(vld1_s8(&qs[i]));
+            const float32x4_t q0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(q16)));
+            const float32x4_t q1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16)));
+            vst1q_f32(&jy[i], vmlaq_f32(vld1q_f32(&jy[i]), q0, fds));
+            vst1q_f32(&jy[i + 4], vmlaq_f32(vld1q_f32(&jy[i + 4]), q1, fds));
+        }
+#elif defined(__AVX2__)
+        const __m256 fds = _mm256_set1_ps(ds);
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i += 8) {
+            const __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)&qs[i])));
+            _mm256_storeu_ps(&jy[i], _mm256_fmadd_ps(q, fds, _mm256_loadu_ps(&jy[i])));
+        }
+#else
+        for (NnUint i = 0; i < Q80_BLOCK_SIZE; i++)
+            jy[i] += ds * qs[i];
+#endif
+    }
+}
+
+static inline float dotProduct_KV(const float *a, const NnFp16 *b, const NnUint size) { return dotProduct_F32_F16(a, b, size); }
+static inline float dotProduct_KV(const float *a, const NnBlockQ80 *b, const NnUint size) { return dotProduct_F32_Q80(a, b, size); }
+static inline void addScaled_KV(float *y, const NnFp16 *x, const float s, const NnUint size) { addScaled_F32_F16(y, x, s, size); }
+static inline void addScaled_KV(float *y, const NnBlockQ80 *x, const float s, const NnUint size) { addScaled_F32_Q80(y, x, s, size); }
+static inline const NnFp16 *kvRow(const NnFp16 *cache, const NnSize offset) { return &cache[offset]; }
+static inline const NnBlockQ80 *kvRow(const NnBlockQ80 *cache, const NnSize offset) { return &cache[offset / Q80_BLOCK_SIZE]; }
+
+// Same as multiheadAtt_F32, but the key/value cache is stored in a compressed form (F16 or Q80 blocks),
+// rows are dequantized on the fly while computing the scores and the weighted sum.
+template <typename T>
+static void multiheadAtt_F32_KV(
+    float *y, const float *q, float *att, const T *keyCache, const T *valueCache,
+    const float *blockTable, const NnUint kvBlockSize, const NnUint pos, const NnUint nHeads, const NnUint nHeads0, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headDim, const NnUint seqLen,
+    const NnUint nThreads, const NnUint threadIndex)
+{
+    SPLIT_THREADS(h0Start, h0End, nHeads0, nThreads, threadIndex);
+    const NnUint kvMul = nHeads / nKvHeads;
+    const float headDimRoot = sqrtf(headDim);
+
+    for (NnUint h0 = h0Start; h0 < h0End; h0++) {
+        const float *hQ = &q[h0 * headDim];
+        const NnUint headOffset = (h0 / kvMul) * headDim;
+        float *hAtt = &att[h0 * seqLen];
+
+        for (NnUint t = 0; t <= pos; t++) {
+            const T *posK = kvRow(keyCache, kvCacheRow(blockTable, kvBlockSize, t) * kvDim0 + headOffset);
+            hAtt[t] = dotProduct_KV(hQ, posK, headDim) / headDimRoot;
+        }
+
+        softmax_F32(hAtt, pos + 1);
+
+        float *hY = &y[h0 * headDim];
+        std::memset(hY, 0, headDim * sizeof(float));
+
+        for (NnUint t = 0; t <= pos; t++) {
+            const T *posV = kvRow(valueCache, kvCacheRow(blockTable, kvBlockSize, t) * kvDim0 + headOffset);
+            addScaled_KV(hY, posV, hAtt[t], headDim);
+        }
+    }
+}
+
 static void mul_F32(float *y, const float *x, const float *m, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
     SPLIT_THREADS(start, end, n, nThreads, threadIndex);
     unsigned int i = start;
@@ -1117,17 +1272,17 @@ static void initMatmulForward(NnCpuOpContext *context) {
 
 }
 
-static bool matmulForward_llamafile(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+static bool matmulForward_llamafile(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnUint xStart, NnUint xEnd, NnCpuOpContext *context) {
     if (!context->hasInputContinuousMemory || !context->hasOutputContinuousMemory || context->inputSize.z != 1u)
         return false;
 
     const NnUint n = context->weightSize.y / getBlockSize(context->inputSize.floatType);
     const NnUint d = context->weightSize.x;
     return llamafile_sgemm(
-        d, batchSize, n,
-        context->weight, n,
+        xEnd - xStart, batchSize, n,
+        &context->weight[getBytes(context->weightSize.floatType, (NnSize)xStart * context->weightSize.y)], n,
         context->input[0], n,
-        context->output[0], d,
+        &((float *)context->output[0])[xStart], d,
         threadIndex, nThreads, 0,
         context->weightSize.floatType,
         context->inputSize.floatType,
@@ -1135,8 +1290,8 @@ static bool matmulForward_llamafile(NnUint nThreads, NnUint threadIndex, NnUint
     );
 }
 
-static void matmulForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
-    if (matmulForward_llamafile(nThreads, threadIndex, batchSize, context))
+static void matmulColumnsForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnUint xStart, NnUint xEnd, NnCpuOpContext *context) {
+    if (matmulForward_llamafile(nThreads, threadIndex, batchSize, xStart, xEnd, context))
         return;
 
     const NnMatmulOpConfig *config = (NnMatmulOpConfig *)context->opConfig;
@@ -1151,11 +1306,11 @@ static void matmulForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUin
 
             float *output = (float *)context->output[e * context->outputSize.y + y];
             matmul_F32_F32_F32(
-                output,
+                &output[xStart],
                 (float *)context->input[e * context->inputSize.y + y],
-                (float *)&context->weight[activeExpertIndex * context->weightSize.nBytesXY],
+                &((float *)&context->weight[activeExpertIndex * context->weightSize.nBytesXY])[(NnSize)xStart * context->weightSize.y],
                 context->weightSize.y,
-                context->weightSize.x,
+                xEnd - xStart,
                 nThreads,
                 threadIndex);
             DEBUG_VECTOR(context, "output", output);
@@ -1163,13 +1318,18 @@ static void matmulForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUin
     }
 }
 
-static void matmulForward_Q80_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
-    if (matmulForward_llamafile(nThreads, threadIndex, batchSize, context))
+static void matmulForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    matmulColumnsForward_F32_F32_F32(nThreads, threadIndex, batchSize, 0u, context->weightSize.x, context);
+}
+
+static void matmulColumnsForward_Q80_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnUint xStart, NnUint xEnd, NnCpuOpContext *context) {
+    if (matmulForward_llamafile(nThreads, threadIndex, batchSize, xStart, xEnd, context))
         return;
 
     const NnMatmulOpConfig *config = (NnMatmulOpConfig *)context->opConfig;
     const NnUint nActiveExpertsOr1 = std::max(config->nActiveExperts, 1u);
     const float *activeExpertIndexes = (const float *)context->buffers[config->activeExpertIndexesBufferIndex];
+    const NnSize rowBlocks = context->weightSize.y / Q40_BLOCK_SIZE;
 
     for (NnUint y = 0; y < batchSize; y++) {
         for (NnUint e = 0; e < nActiveExpertsOr1; e++) {
@@ -1179,11 +1339,11 @@ static void matmulForward_Q80_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUin
 
             float *output = (float *)context->output[e * context->outputSize.y + y];
             matmul_Q80_Q40_F32(
-                output,
+                &output[xStart],
                 (NnBlockQ80 *)context->input[e * context->inputSize.y + y],
-                (NnBlockQ40 *)&context->weight[activeExpertIndex * context->weightSize.nBytesXY],
+                &((NnBlockQ40 *)&context->weight[activeExpertIndex * context->weightSize.nBytesXY])[xStart * rowBlocks],
                 context->weightSize.y,
-                context->weightSize.x,
+                xEnd - xStart,
                 nThreads,
                 threadIndex);
             DEBUG_VECTOR(context, "output", output);
@@ -1191,6 +1351,10 @@ static void matmulForward_Q80_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUin
     }
 }
 
+static void matmulForward_Q80_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    matmulColumnsForward_Q80_Q40_F32(nThreads, threadIndex, batchSize, 0u, context->weightSize.x, context);
+}
+
 static void siluForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     assert(context->weightSize.nBytes == 0);
     ASSERT_EQ(context->inputSize.x, context->outputSize.x);
@@ -1255,31 +1419,60 @@ static void initMultiHeadAttForward(NnCpuOpContext *context) {
     NnSize3D *posSize = &context->pipeConfigs[config->positionPipeIndex].size;
     ASSERT_EQ(posSize->x, 1);
     ASSERT_EQ(posSize->y, context->nBatches);
+    NnSize3D *blockTableSize = &context->pipeConfigs[config->kvBlockTablePipeIndex].size;
+    ASSERT_EQ(blockTableSize->x, config->nMaxKvBlocks);
+    ASSERT_EQ(blockTableSize->y, context->nBatches);
+    NnSize3D *keyCacheSize = &context->bufferConfigs[config->keyCacheBufferIndex].size;
+    NnSize3D *valueCacheSize = &context->bufferConfigs[config->valueCacheBufferIndex].size;
+    ASSERT_EQ(keyCacheSize->floatType, valueCacheSize->floatType);
+    if (config->kvBlockSize == 0 || config->kvBlockSize * config->nMaxKvBlocks < config->seqLen)
+        throw std::invalid_argument("KV cache block table does not cover the sequence length");
+    if (keyCacheSize->y % config->kvBlockSize != 0)
+        throw std::invalid_argument("KV cache size is not a multiple of the block size");
+    if (keyCacheSize->floatType != F_32 && keyCacheSize->floatType != F_16 && keyCacheSize->floatType != F_Q80)
+        throw std::invalid_argument("Unsupported KV cache float type");
+    if (keyCacheSize->floatType == F_Q80 && config->headDim % Q80_BLOCK_SIZE != 0)
+        throw std::invalid_argument("Q80 KV cache requires headDim to be a multiple of the block size");
 }
 
 static void multiHeadAttForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     const NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)context->opConfig;
 
     float *query = (float *)context->buffers[config->queryBufferIndex];
-    float *keyCache = (float *)context->buffers[config->keyCacheBufferIndex];
-    float *valueCache = (float *)context->buffers[config->valueCacheBufferIndex];
+    NnByte *keyCache = context->buffers[config->keyCacheBufferIndex];
+    NnByte *valueCache = context->buffers[config->valueCacheBufferIndex];
+    const NnFloatType cacheType = context->bufferConfigs[config->keyCacheBufferIndex].size.floatType;
     float *att = (float *)context->buffers[config->attBufferIndex];
     const float *positions = (float *)context->pipes[config->positionPipeIndex];
+    const float *blockTables = (float *)context->pipes[config->kvBlockTablePipeIndex];
 
     for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
         float *y = (float *)context->output[batchIndex];
         float *q = &query[batchIndex * config->qSliceD0];
         NnUint pos = (NnUint)positions[batchIndex];
+        const float *blockTable = &blockTables[batchIndex * config->nMaxKvBlocks];
         assert(pos < config->seqLen);
 
         DEBUG_VECTOR(context, "input", y);
         DEBUG_VECTOR(context, "q", q);
 
-        multiheadAtt_F32(y, q, 
-            &att[batchIndex * config->nHeads0 * config->seqLen],
-            keyCache, valueCache, pos,
-            config->nHeads, config->nHeads0,
-            config->nKvHeads, config->kvDim0, config->headDim, config->seqLen, nThreads, threadIndex);
+        float *batchAtt = &att[batchIndex * config->nHeads0 * config->seqLen];
+        if (cacheType == F_16) {
+            multiheadAtt_F32_KV(y, q, batchAtt,
+                (const NnFp16 *)keyCache, (const NnFp16 *)valueCache, blockTable, config->kvBlockSize, pos,
+                config->nHeads, config->nHeads0,
+                config->nKvHeads, config->kvDim0, config->headDim, config->seqLen, nThreads, threadIndex);
+        } else if (cacheType == F_Q80) {
+            multiheadAtt_F32_KV(y, q, batchAtt,
+                (const NnBlockQ80 *)keyCache, (const NnBlockQ80 *)valueCache, blockTable, config->kvBlockSize, pos,
+                config->nHeads, config->nHeads0,
+                config->nKvHeads, config->kvDim0, config->headDim, config->seqLen, nThreads, threadIndex);
+        } else {
+            multiheadAtt_F32(y, q, batchAtt,
+                (float *)keyCache, (float *)valueCache, blockTable, config->kvBlockSize, pos,
+                config->nHeads, config->nHeads0,
+                config->nKvHeads, config->kvDim0, config->headDim, config->seqLen, nThreads, threadIndex);
+        }
 
         DEBUG_VECTOR(context, "output", y);
     }
@@ -1347,6 +1540,20 @@ static void castForward_ANY(NnUint nThreads, NnUint threadIndex, NnUint batchSiz
     }
 }
 
+static void castColumnsForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnUint xStart, NnUint xEnd, NnCpuOpContext *context) {
+    for (NnUint z = 0u; z < context->inputSize.z; z++) {
+        const NnUint zOffset = z * context->inputSize.y;
+        for (NnUint y = 0u; y < batchSize; y++) {
+            copy_UNK(
+                (NnByte *)&((float *)context->output[zOffset + y])[xStart],
+                (NnByte *)&((float *)context->input[zOffset + y])[xStart],
+                (xEnd - xStart) * sizeof(float),
+                nThreads,
+                threadIndex);
+        }
+    }
+}
+
 static void castForward_F32_Q80(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     ASSERT_EQ(context->inputSize.floatType, F_32);
     ASSERT_EQ(context->outputSize.floatType, F_Q80);
@@ -1440,6 +1647,54 @@ static void shiftForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint bat
     }
 }
 
+static void shiftForward_F32_F16(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    ASSERT_EQ(context->hasInputContinuousMemory, true);
+    ASSERT_EQ(context->hasOutputContinuousMemory, true);
+    ASSERT_EQ(context->inputSize.floatType, F_32);
+    ASSERT_EQ(context->outputSize.floatType, F_16);
+    ASSERT_EQ(context->outputSize.y, 1);
+
+    const NnShiftOpCodeConfig *config = (NnShiftOpCodeConfig *)context->opConfig;
+    const float *indexes = (float *)context->pipes[config->indexPipeIndex];
+    const NnUint dim = context->inputSize.x;
+    NnFp16 *output = (NnFp16 *)context->output[0];
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        const NnSize index = (NnSize)indexes[batchIndex];
+        assert((index + 1) * dim <= context->outputSize.x);
+        const float *x = (float *)context->input[batchIndex];
+        NnFp16 *y = &output[index * dim];
+        SPLIT_THREADS(start, end, dim, nThreads, threadIndex);
+        for (NnUint i = start; i < end; i++)
+            y[i] = CONVERT_F32_TO_F16(x[i]);
+    }
+}
+
+static void shiftForward_F32_Q80(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    ASSERT_EQ(context->hasInputContinuousMemory, true);
+    ASSERT_EQ(context->hasOutputContinuousMemory, true);
+    ASSERT_EQ(context->inputSize.floatType, F_32);
+    ASSERT_EQ(context->outputSize.floatType, F_Q80);
+    ASSERT_EQ(context->outputSize.y, 1);
+
+    const NnShiftOpCodeConfig *config = (NnShiftOpCodeConfig *)context->opConfig;
+    const float *indexes = (float *)context->pipes[config->indexPipeIndex];
+    const NnUint dim = context->inputSize.x;
+    const NnUint dimBlocks = dim / Q80_BLOCK_SIZE;
+    NnBlockQ80 *output = (NnBlockQ80 *)context->output[0];
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        const NnSize index = (NnSize)indexes[batchIndex];
+        assert((index + 1) * dim <= context->outputSize.x);
+        quantizeF32toQ80(
+            (float *)context->input[batchIndex],
+            &output[index * dimBlocks],
+            dim,
+            nThreads,
+            threadIndex);
+    }
+}
+
 static void softmaxForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     assert(*context->input == *context->output);
 
@@ -1493,6 +1748,71 @@ static void moeGateForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint b
 
 // device
 
+// fused ops
+
+// INV_RMS -> RMS_NORM -> CAST (Q80). With enough rows every thread computes whole rows, otherwise every thread
+// computes the inverse RMS of the row and normalizes only its range of blocks. The results are the same as of the separate ops.
+static void rmsNormCastForward_F32_Q80(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    NnCpuOpContext *invRms = &context[0];
+    NnCpuOpContext *rmsNorm = &context[1];
+    NnCpuOpContext *cast = &context[2];
+    const NnInvRmsOpConfig *invRmsConfig = (NnInvRmsOpConfig *)invRms->opConfig;
+    const float *weight = (float *)rmsNorm->weight;
+    const NnUint dim = rmsNorm->inputSize.x;
+    const NnUint nBlocks = dim / Q80_BLOCK_SIZE;
+    assert(dim % Q80_BLOCK_SIZE == 0);
+
+    const bool isRowPerThread = batchSize >= nThreads;
+    NnUint blockStart = 0;
+    NnUint blockEnd = nBlocks;
+    if (!isRowPerThread) {
+        SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+        blockStart = start;
+        blockEnd = end;
+    }
+    const NnUint offset = blockStart * Q80_BLOCK_SIZE;
+    const NnUint size = (blockEnd - blockStart) * Q80_BLOCK_SIZE;
+
+    for (NnUint batchIndex = isRowPerThread ? threadIndex : 0; batchIndex < batchSize; batchIndex += isRowPerThread ? nThreads : 1) {
+        const float *x = (float *)rmsNorm->input[batchIndex];
+        const float rms = invRms_F32(x, dim, invRmsConfig->epsilon);
+        if (isRowPerThread || threadIndex == 0)
+            ((float *)invRms->output[batchIndex])[0] = rms;
+
+        float *y = (float *)rmsNorm->output[batchIndex];
+        rmsNorm_F32(&y[offset], &x[offset], rms, &weight[offset], size, 1, 0);
+        quantizeF32toQ80(&y[offset], &((NnBlockQ80 *)cast->output[batchIndex])[blockStart], size, 1, 0);
+        DEBUG_VECTOR(rmsNorm, "output", y);
+    }
+}
+
+// SILU -> MUL -> CAST (Q80), every thread computes its range of blocks
+static void siluMulCastForward_F32_Q80(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    NnCpuOpContext *silu = &context[0];
+    NnCpuOpContext *mul = &context[1];
+    NnCpuOpContext *cast = &context[2];
+    const NnMulOpCodeConfig *mulConfig = (NnMulOpCodeConfig *)mul->opConfig;
+    const float *multiplier = (float *)mul->buffers[mulConfig->multiplierBufferIndex];
+    const NnUint dim = silu->outputSize.x;
+    assert(dim % Q80_BLOCK_SIZE == 0);
+
+    SPLIT_THREADS(blockStart, blockEnd, dim / Q80_BLOCK_SIZE, nThreads, threadIndex);
+    const NnUint offset = blockStart * Q80_BLOCK_SIZE;
+    const NnUint size = (blockEnd - blockStart) * Q80_BLOCK_SIZE;
+    if (size == 0)
+        return;
+
+    for (NnUint z = 0u; z < silu->outputSize.z; z++) {
+        for (NnUint y = 0u; y < batchSize; y++) {
+            const NnUint index = z * silu->outputSize.y + y;
+            float *d = (float *)silu->output[index];
+            silu_F32(&d[offset], size, 1, 0);
+            mul_F32(&d[offset], &d[offset], &multiplier[dim * index + offset], size, 1, 0);
+            quantizeF32toQ80(&d[offset], &((NnBlockQ80 *)cast->output[index])[blockStart], size, 1, 0);
+        }
+    }
+}
+
 void printCpuInstructionSet() {
     printf("🧠 CPU:");
 #if defined(__ARM_NEON)
@@ -1589,6 +1909,8 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
     }
     if (code == OP_SHIFT) {
         if (quantType == F32_F32_F32) return shiftForward_F32_F32;
+        if (quantType == F32_F32_F16) return shiftForward_F32_F16;
+        if (quantType == F32_F32_Q80) return shiftForward_F32_Q80;
     }
     if (code == OP_SOFTMAX) {
         if (quantType == F32_F32_F32) return softmaxForward_F32_F32;
@@ -1598,3 +1920,145 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
     }
     return nullptr;
 }
+
+NnCpuOpForwardColumns getCpuOpForwardColumns(NnOpCode code, NnOpQuantType quantType) {
+    if (code == OP_MATMUL) {
+        if (quantType == F32_F32_F32) return matmulColumnsForward_F32_F32_F32;
+        if (quantType == Q80_Q40_F32) return matmulColumnsForward_Q80_Q40_F32;
+    }
+    if (code == OP_CAST) {
+        if (quantType == F32_F32_F32) return castColumnsForward_F32_F32;
+    }
+    return nullptr;
+}
+
+// MATMUL ops of the same input. The device concatenates their weights by rows at load time, then the group is one
+// matmul over the rows of all ops: the sgemm writes the rows side by side to the fused output and the next step
+// splits them, the other kernels split the rows of all ops between the threads and write to the outputs directly.
+// Weights which are not concatenated (e.g. mapped from a shard with padding) are multiplied op by op.
+static bool hasConcatenatedWeights(NnUint nOps, NnCpuOpContext *context) {
+    NnByte *weight = context[0].weight;
+    for (NnUint i = 0; i < nOps; i++) {
+        if (context[i].weight != weight)
+            return false;
+        weight += context[i].weightSize.nBytes;
+    }
+    return true;
+}
+
+template <NnUint nOps, NnCpuOpForward forward, typename X, typename W, void (*matmul)(float *, const X *, const W *, const NnUint, const NnUint, const NnUint, const NnUint)>
+static void matmulsForward(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    NnCpuOpContext *first = &context[0];
+    NnCpuFusedOutput *fusedOutput = first->fusedOutput;
+    if (threadIndex == 0 && fusedOutput != nullptr)
+        fusedOutput->isWritten = false;
+
+    if (fusedOutput == nullptr || !hasConcatenatedWeights(nOps, context)) {
+        for (NnUint i = 0; i < nOps; i++)
+            forward(nThreads, threadIndex, batchSize, &context[i]);
+        return;
+    }
+
+    NnUint d = 0;
+    for (NnUint i = 0; i < nOps; i++)
+        d += context[i].weightSize.x;
+    const NnUint n = first->weightSize.y;
+    assert(fusedOutput->size >= (NnSize)first->nBatches * d);
+
+    if (first->hasInputContinuousMemory && first->inputSize.z == 1u) {
+        const NnUint k = n / getBlockSize(first->inputSize.floatType);
+        if (llamafile_sgemm(
+            d, batchSize, k,
+            first->weight, k,
+            first->input[0], k,
+            fusedOutput->data, d,
+            threadIndex, nThreads, 0,
+            first->weightSize.floatType,
+            first->inputSize.floatType,
+            F_32)) {
+            if (threadIndex == 0)
+                fusedOutput->isWritten = true;
+            return;
+        }
+    }
+
+    SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+    NnUint opStart = 0;
+    for (NnUint i = 0; i < nOps; i++) {
+        const NnUint opEnd = opStart + context[i].weightSize.x;
+        const NnUint rowStart = std::max(start, opStart);
+        const NnUint rowEnd = std::min(end, opEnd);
+        if (rowStart < rowEnd) {
+            const W *weight = (const W *)&first->weight[getBytes(first->weightSize.floatType, (NnSize)rowStart * n)];
+            for (NnUint y = 0; y < batchSize; y++) {
+                float *output = (float *)context[i].output[y];
+                matmul(&output[rowStart - opStart], (const X *)first->input[y], weight, n, rowEnd - rowStart, 1, 0);
+            }
+        }
+        opStart = opEnd;
+    }
+}
+
+// The second step of fused matmuls, `context` is the context of the second op of the group
+template <NnUint nOps>
+static void matmulsSplitForward(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    NnCpuOpContext *group = &context[-1];
+    NnCpuFusedOutput *fusedOutput = group[0].fusedOutput;
+    if (fusedOutput == nullptr || !fusedOutput->isWritten)
+        return;
+
+    NnUint d = 0;
+    for (NnUint i = 0; i < nOps; i++)
+        d += group[i].weightSize.x;
+    SPLIT_THREADS(start, end, batchSize * nOps, nThreads, threadIndex);
+    for (NnUint job = start; job < end; job++) {
+        const NnUint y = job / nOps;
+        const NnUint opIndex = job % nOps;
+        NnUint opStart = 0;
+        for (NnUint i = 0; i < opIndex; i++)
+            opStart += group[i].weightSize.x;
+        std::memcpy(group[opIndex].output[y], &fusedOutput->data[(NnSize)y * d + opStart], group[opIndex].weightSize.x * sizeof(float));
+    }
+}
+
+template <NnCpuOpForward forward, typename X, typename W, void (*matmul)(float *, const X *, const W *, const NnUint, const NnUint, const NnUint, const NnUint)>
+static NnUint getMatmulsForwards(NnUint nOps, NnCpuOpForward *forwards) {
+    if (nOps == 2) {
+        forwards[0] = matmulsForward<2, forward, X, W, matmul>;
+        forwards[1] = matmulsSplitForward<2>;
+        return 2;
+    }
+    if (nOps == 3) {
+        forwards[0] = matmulsForward<3, forward, X, W, matmul>;
+        forwards[1] = matmulsSplitForward<3>;
+        return 2;
+    }
+    return 0;
+}
+
+NnUint getCpuFusedOpForwards(const NnOpCode *codes, const NnOpQuantType *quantTypes, NnUint nOps, NnCpuOpForward *forwards) {
+    if (codes[0] == OP_MATMUL) {
+        for (NnUint i = 1; i < nOps; i++) {
+            if (codes[i] != OP_MATMUL || quantTypes[i] != quantTypes[0])
+                return 0;
+        }
+        if (quantTypes[0] == F32_F32_F32) return getMatmulsForwards<matmulForward_F32_F32_F32, float, float, matmul_F32_F32_F32>(nOps, forwards);
+        if (quantTypes[0] == Q80_Q40_F32) return getMatmulsForwards<matmulForward_Q80_Q40_F32, NnBlockQ80, NnBlockQ40, matmul_Q80_Q40_F32>(nOps, forwards);
+        return 0;
+    }
+    if (nOps == 3 &&
+        codes[0] == OP_INV_RMS && quantTypes[0] == F32_F32_F32 &&
+        codes[1] == OP_RMS_NORM && quantTypes[1] == F32_F32_F32 &&
+        codes[2] == OP_CAST && quantTypes[2] == F32_F32_Q80) {
+        forwards[0] = rmsNormCastForward_F32_Q80;
+        return 1;
+    }
+    if (nOps == 3 &&
+        codes[0] == OP_SILU && quantTypes[0] == F32_F32_F32 &&
+        codes[1] == OP_MUL && quantTypes[1] == F32_F32_F32 &&
+        codes[2] == OP_CAST && quantTypes[2] == F32_F32_Q80) {
+        forwards[0] = siluMulCastForward_F32_Q80;
+        return 1;
+    }
+    return 0;
+}
@@ -9,6 +9,13 @@
         exit(-1); \
     }
 
+// Output of fused matmuls: the rows of all matmuls of a group side by side, shared by the groups of a device
+typedef struct {
+    float *data;
+    NnSize size; // number of floats
+    bool isWritten; // the first step of the group wrote the output, the second step splits it
+} NnCpuFusedOutput;
+
 typedef struct {
     const char *name;
     NnByte nBatches;
@@ -29,14 +36,22 @@ typedef struct {
 
     NnByte *weight;
     NnSize3D weightSize;
+
+    NnCpuFusedOutput *fusedOutput; // set for the first op of fused matmuls
 } NnCpuOpContext;
 
 typedef void (*NnCpuOpForwardInit)(NnCpuOpContext *context);
 typedef void (*NnCpuOpForward)(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context);
+typedef void (*NnCpuOpForwardColumns)(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnUint xStart, NnUint xEnd, NnCpuOpContext *context);
 
 void printCpuInstructionSet();
 NnCpuOpForwardInit getCpuOpForwardInit(NnOpCode code, NnOpQuantType quantType);
 NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType);
+// Ops whose output columns are independent, they may compute only a range of the columns
+NnCpuOpForwardColumns getCpuOpForwardColumns(NnOpCode code, NnOpQuantType quantType);
+// A chain or a group of ops executed in fewer steps than ops. Returns the number of steps and their forwards, 0 = the ops
+// are not fused. The forward of the step `s` gets the context of the op `s`, the contexts of the ops are consecutive
+NnUint getCpuFusedOpForwards(const NnOpCode *codes, const NnOpQuantType *quantTypes, NnUint nOps, NnCpuOpForward *forwards);
 
 void softmax_F32(float *x, const NnUint size);
 
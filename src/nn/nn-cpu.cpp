@@ -1,6 +1,8 @@
 #include "nn-cpu.hpp"
 #include "nn-cpu-ops.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <cstring>
 #include <stdexcept>
 #include <thread>
@@ -11,6 +13,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 
 #define DEBUG_CPU_OP_QUANTS false
 
@@ -38,13 +46,157 @@ static void releaseAlignedBuffer(NnByte *buffer) {
 #endif
 }
 
-NnCpuDevice::NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution) {
+#ifdef __linux__
+// Parses a list of CPUs like "0-3,8,10-11"
+static std::vector<int> readCpuList(const char *path) {
+    std::vector<int> cpus;
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+        return cpus;
+    char text[4096];
+    if (fgets(text, sizeof(text), file) != nullptr) {
+        for (char *part = strtok(text, ",\n"); part != nullptr; part = strtok(nullptr, ",\n")) {
+            int first;
+            int last;
+            int n = sscanf(part, "%d-%d", &first, &last);
+            if (n == 1)
+                last = first;
+            if (n < 1)
+                continue;
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        }
+    }
+    fclose(file);
+    return cpus;
+}
+
+// The policy of pages is set before the first touch, pages already touched are moved. The placement is only a hint,
+// a failure leaves the pages where they are.
+static void bindMemoryToNode(NnByte *memory, NnSize nBytes, int node, NnSize pageSize) {
+    if (nBytes == 0)
+        return;
+    const NnSize bitsPerLong = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> nodeMask(node / bitsPerLong + 1, 0ul);
+    nodeMask[node / bitsPerLong] |= 1ul << (node % bitsPerLong);
+    const uintptr_t start = (uintptr_t)memory & ~(uintptr_t)(pageSize - 1);
+    const uintptr_t end = ((uintptr_t)memory + nBytes + pageSize - 1) & ~(uintptr_t)(pageSize - 1);
+    syscall(SYS_mbind, (void *)start, (unsigned long)(end - start), MPOL_PREFERRED,
+        nodeMask.data(), (unsigned long)(nodeMask.size() * bitsPerLong + 1), MPOL_MF_MOVE);
+}
+#endif
+
+NnCpuNumaPlacement resolveCpuNumaPlacement(NnUint nThreads) {
+    NnCpuNumaPlacement placement;
+    placement.nNodes = 0;
+#ifdef __linux__
+    cpu_set_t allowedCpus;
+    CPU_ZERO(&allowedCpus);
+    if (sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) != 0)
+        return placement;
+
+    std::vector<std::pair<int, std::vector<int>>> nodes;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir != nullptr) {
+        for (struct dirent *entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) != 1)
+                continue;
+            const std::string path = std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist";
+            std::vector<int> cpus;
+            for (int cpu : readCpuList(path.c_str())) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowedCpus))
+                    cpus.push_back(cpu);
+            }
+            if (!cpus.empty())
+                nodes.push_back(std::make_pair(node, cpus));
+        }
+        closedir(dir);
+    }
+    std::sort(nodes.begin(), nodes.end());
+    if (nodes.empty()) {
+        // Without the NUMA topology the threads are only pinned
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowedCpus))
+                cpus.push_back(cpu);
+        }
+        nodes.push_back(std::make_pair(0, cpus));
+    }
+
+    placement.nNodes = (NnUint)nodes.size();
+    placement.cpus.resize(nThreads);
+    placement.nodes.resize(nThreads);
+    for (NnUint nodeIndex = 0; nodeIndex < placement.nNodes; nodeIndex++) {
+        SPLIT_THREADS(threadStart, threadEnd, nThreads, placement.nNodes, nodeIndex);
+        const std::vector<int> &cpus = nodes[nodeIndex].second;
+        for (NnUint threadIndex = threadStart; threadIndex < threadEnd; threadIndex++) {
+            placement.cpus[threadIndex] = cpus[(threadIndex - threadStart) % cpus.size()];
+            placement.nodes[threadIndex] = nodes[nodeIndex].first;
+        }
+    }
+#else
+    (void)nThreads;
+#endif
+    return placement;
+}
+
+// The rows of a matmul are split between the threads by SPLIT_THREADS, every range of rows is placed on the node of its thread
+static NnByte *allocNumaMatmulWeight(const NnSize3D *size, const NnCpuNumaPlacement *placement) {
+#ifdef __linux__
+    const NnSize pageSize = (NnSize)sysconf(_SC_PAGESIZE);
+    NnByte *buffer;
+    if (posix_memalign((void **)&buffer, pageSize, size->nBytes) != 0)
+        throw std::runtime_error("posix_memalign failed");
+    const NnUint nThreads = (NnUint)placement->nodes.size();
+    const NnSize rowBytes = getBytes(size->floatType, size->y);
+    for (NnUint z = 0; z < size->z; z++) {
+        NnByte *matrix = &buffer[z * size->nBytesXY];
+        for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+            SPLIT_THREADS(start, end, size->x, nThreads, threadIndex);
+            bindMemoryToNode(&matrix[start * rowBytes], (end - start) * rowBytes, placement->nodes[threadIndex], pageSize);
+        }
+    }
+    mlock(buffer, size->nBytes);
+    return buffer;
+#else
+    (void)placement;
+    return allocAlignedBuffer(size->nBytes);
+#endif
+}
+
+NnCpuDevice::NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, bool isNumaAware) {
     this->netConfig = netConfig;
     this->nodeConfig = nodeConfig;
     this->netExecution = netExecution;
 
     printCpuInstructionSet();
 
+    numaPlacement.nNodes = 0;
+    this->isNumaAware = false;
+    if (isNumaAware) {
+        numaPlacement = resolveCpuNumaPlacement(netExecution->nThreads);
+        this->isNumaAware = numaPlacement.nNodes > 0;
+        if (this->isNumaAware)
+            printf("🧠 NUMA: %u threads pinned on %u nodes\n", netExecution->nThreads, numaPlacement.nNodes);
+        else
+            printf("🚧 NUMA placement is not supported on this platform\n");
+    }
+
+    // The placement follows the row split of the plain matmul kernels. The chunked sync runs the
+    // matmuls by columns, where every chunk is split over all threads, so the weights keep the default placement
+    hasNumaWeights = this->isNumaAware;
+    for (NnUint segmentIndex = 0; hasNumaWeights && segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+        for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
+            if (segmentConfig->syncs[syncIndex].nChunks > 1) {
+                hasNumaWeights = false;
+                printf("🚧 NUMA: weights are not placed on the nodes with --sync-chunks > 1\n");
+                break;
+            }
+        }
+    }
+
     nBuffers = nodeConfig->nBuffers;
     buffers = new NnByte *[nBuffers];
     for (NnUint bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++) {
@@ -55,12 +207,18 @@ NnCpuDevice::NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNet
 
     bufferFlags = new NnByte[nBuffers];
     std::memset(bufferFlags, 0, nBuffers * sizeof(NnByte));
+
+    fusedOutput.data = nullptr;
+    fusedOutput.size = 0;
+    fusedOutput.isWritten = false;
 }
 
 NnCpuDevice::~NnCpuDevice() {
     for (NnUint bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++)
         releaseAlignedBuffer(buffers[bufferIndex]);
     delete[] buffers;
+    if (fusedOutput.data != nullptr)
+        releaseAlignedBuffer((NnByte *)fusedOutput.data);
     delete[] bufferFlags;
 }
 
@@ -68,6 +226,18 @@ NnUint NnCpuDevice::maxNThreads() {
     return std::thread::hardware_concurrency();
 }
 
+void NnCpuDevice::bindThread(NnUint threadIndex) {
+    if (!isNumaAware || threadIndex >= numaPlacement.cpus.size())
+        return;
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(numaPlacement.cpus[threadIndex], &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        printf("🚧 Cannot pin thread %u to CPU %d\n", threadIndex, numaPlacement.cpus[threadIndex]);
+#endif
+}
+
 NnDeviceSegment *NnCpuDevice::createSegment(NnUint segmentIndex) {
     NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
     assert(segmentConfig->nOps > 0);
@@ -107,7 +277,11 @@ NnDeviceSegment *NnCpuDevice::createSegment(NnUint segmentIndex) {
     }
 
     NnCpuOpForward *opForward = new NnCpuOpForward[segmentConfig->nOps];
+    NnCpuOpForwardColumns *opForwardColumns = new NnCpuOpForwardColumns[segmentConfig->nOps];
     NnCpuOpContext *opContexts = new NnCpuOpContext[segmentConfig->nOps];
+    NnUint tpGroupStart;
+    NnUint tpGroupEnd;
+    resolveTpGroup(netConfig, nodeConfig, &tpGroupStart, &tpGroupEnd);
 
     for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
         NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
@@ -125,26 +299,30 @@ NnDeviceSegment *NnCpuDevice::createSegment(NnUint segmentIndex) {
 
         opContext->input = new NnByte *[inputsPtr[opIndex].size()];
         opContext->inputSize = inputSizes[opIndex];
-        opContext->hasInputContinuousMemory = hasPointerContinuousMemory(&opConfig->input);
+        opContext->hasInputContinuousMemory = hasPointerContinuousMemory(&opConfig->input, tpGroupEnd - tpGroupStart);
         std::memcpy(opContext->input, inputsPtr[opIndex].data(), inputsPtr[opIndex].size() * sizeof(NnByte *));
 
         opContext->output = new NnByte *[outputsPtr[opIndex].size()];
         opContext->outputSize = outputSizes[opIndex];
-        opContext->hasOutputContinuousMemory = hasPointerContinuousMemory(&opConfig->output);
+        opContext->hasOutputContinuousMemory = hasPointerContinuousMemory(&opConfig->output, tpGroupEnd - tpGroupStart);
         std::memcpy(opContext->output, outputsPtr[opIndex].data(), outputsPtr[opIndex].size() * sizeof(NnByte *));
 
-#if not(DEBUG_USE_MMAP_FOR_WEIGHTS)
-        if (opContext->weightSize.nBytes > 0)
-            opContext->weight = allocAlignedBuffer(opContext->weightSize.nBytes);
-        else
-            opContext->weight = nullptr;
-#endif
+        opContext->weight = nullptr;
+        opContext->fusedOutput = nullptr;
 
         if (opInit != nullptr)
             opInit(opContext);
         opForward[opIndex] = opForwardLocal[opIndex];
+        opForwardColumns[opIndex] = getCpuOpForwardColumns(opConfig->code, opQuants[opIndex]);
     }
-    return new NnCpuDeviceSegment(opForward, opContexts, segmentConfig->nOps);
+    NnCpuDeviceSegment *segment = new NnCpuDeviceSegment(opForward, opForwardColumns, opContexts, segmentConfig->nOps);
+    for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++)
+        segment->opCodes.push_back(segmentConfig->ops[opIndex].code);
+    segment->opQuants = opQuants;
+    if (hasNumaWeights)
+        segment->numaPlacement = &numaPlacement;
+    segment->fusedOutput = &fusedOutput;
+    return segment;
 }
 
 NnCpuDeviceSegment::~NnCpuDeviceSegment() {
@@ -152,12 +330,15 @@ NnCpuDeviceSegment::~NnCpuDeviceSegment() {
         NnCpuOpContext *context = &opContexts[opIndex];
         delete[] context->input;
         delete[] context->output;
-#if not(DEBUG_USE_MMAP_FOR_WEIGHTS)
-        if (context->weightSize.nBytes > 0)
+        if (isWeightAllocated[opIndex])
             releaseAlignedBuffer(context->weight);
-#endif
+    }
+    for (NnCpuFusedWeight &fusedWeight : fusedWeights) {
+        if (fusedWeight.weight != nullptr)
+            releaseAlignedBuffer(fusedWeight.weight);
     }
     delete[] opForward;
+    delete[] opForwardColumns;
     delete[] opContexts;
 }
 
@@ -196,12 +377,17 @@ std::vector<NnByte *> NnCpuDevice::resolvePointer(NnSize3D *pntrSize, NnPointerC
         *pntrSize = *sourceSize;
 
         if (pointerConfig->type == PNTR_BATCHED_SLICE) {
-            assert(sourceSize->x % netConfig->nNodes == 0);
-            NnUint xSlice = sourceSize->x / netConfig->nNodes;
+            // the row is split between the nodes of the tensor parallel group
+            NnUint tpGroupStart;
+            NnUint tpGroupEnd;
+            resolveTpGroup(netConfig, nodeConfig, &tpGroupStart, &tpGroupEnd);
+            const NnUint tpSize = tpGroupEnd - tpGroupStart;
+            assert(sourceSize->x % tpSize == 0);
+            NnUint xSlice = sourceSize->x / tpSize;
             NnSize xSliceBytes = getBytes(sourceSize->floatType, xSlice);
             for (NnUint z = 0; z < sourceSize->z; z++) {
                 for (NnUint y = 0; y < sourceSize->y; y++)
-                    pntr[z * sourceSize->y + y] = &pntr[z * sourceSize->y + y][xSliceBytes * nodeConfig->nodeIndex];
+                    pntr[z * sourceSize->y + y] = &pntr[z * sourceSize->y + y][xSliceBytes * (nodeConfig->nodeIndex - tpGroupStart)];
             }
             *pntrSize = size3D(sourceSize->floatType, sourceSize->z, sourceSize->y, xSlice);
         }
@@ -217,12 +403,34 @@ void NnCpuDeviceSegment::loadWeight(NnUint opIndex, NnSize offset, NnSize nBytes
     assert(opIndex < nOps);
     NnCpuOpContext *context = &opContexts[opIndex];
     assert(offset + nBytes <= context->weightSize.nBytes);
-#if DEBUG_USE_MMAP_FOR_WEIGHTS
-    assert(offset == 0u);
-    context->weight = weight;
-#else
+    if (context->weight == nullptr) {
+        context->weight = numaPlacement != nullptr && opCodes[opIndex] == OP_MATMUL
+            ? allocNumaMatmulWeight(&context->weightSize, numaPlacement)
+            : allocAlignedBuffer(context->weightSize.nBytes);
+        isWeightAllocated[opIndex] = true;
+    }
     std::memcpy(&context->weight[offset], weight, nBytes);
-#endif
+}
+
+bool NnCpuDeviceSegment::mapWeight(NnUint opIndex, NnByte *weight) {
+    assert(opIndex < nOps);
+    NnCpuOpContext *context = &opContexts[opIndex];
+    for (NnCpuFusedWeight &fusedWeight : fusedWeights) {
+        if (fusedWeight.weight == nullptr || opIndex < fusedWeight.opIndex || opIndex >= fusedWeight.opIndex + fusedWeight.nOps)
+            continue;
+        // The mapped weights replace the concatenated weight, the fused matmuls still run as one matmul
+        // if the mapped weights follow each other in the memory
+        for (NnUint i = fusedWeight.opIndex; i < fusedWeight.opIndex + fusedWeight.nOps; i++)
+            opContexts[i].weight = nullptr;
+        releaseAlignedBuffer(fusedWeight.weight);
+        fusedWeight.weight = nullptr;
+    }
+    if (isWeightAllocated[opIndex]) {
+        releaseAlignedBuffer(context->weight);
+        isWeightAllocated[opIndex] = false;
+    }
+    context->weight = weight;
+    return true;
 }
 
 void NnCpuDeviceSegment::forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize) {
@@ -230,3 +438,63 @@ void NnCpuDeviceSegment::forward(NnUint opIndex, NnUint nThreads, NnUint threadI
     // printf("forward: %d %s (%d/%d)\n", opIndex, context->name, threadIndex + 1, nThreads); fflush(stdout);
     opForward[opIndex](nThreads, threadIndex, batchSize, context);
 }
+
+bool NnCpuDeviceSegment::canForwardColumns(NnUint opIndex) {
+    assert(opIndex < nOps);
+    return opForwardColumns[opIndex] != nullptr;
+}
+
+void NnCpuDeviceSegment::concatMatmulWeights(NnUint opIndex, NnUint nFusedOps) {
+    NnCpuOpContext *contexts = &opContexts[opIndex];
+    NnUint d = 0;
+    for (NnUint i = 0; i < nFusedOps; i++) {
+        const NnMatmulOpConfig *config = (NnMatmulOpConfig *)contexts[i].opConfig;
+        if (contexts[i].weight != nullptr ||
+            config->nActiveExperts != 0 ||
+            contexts[i].weightSize.z != 1 ||
+            contexts[i].weightSize.y != contexts[0].weightSize.y ||
+            contexts[i].weightSize.floatType != contexts[0].weightSize.floatType)
+            return; // the matmuls run op by op
+        d += contexts[i].weightSize.x;
+    }
+
+    // One weight of [d, n] holds the rows of all matmuls, the placement splits the rows of all matmuls between the threads
+    const NnSize3D weightSize = size2D(contexts[0].weightSize.floatType, contexts[0].weightSize.y, d);
+    NnByte *weight = numaPlacement != nullptr
+        ? allocNumaMatmulWeight(&weightSize, numaPlacement)
+        : allocAlignedBuffer(weightSize.nBytes);
+    NnSize offset = 0;
+    for (NnUint i = 0; i < nFusedOps; i++) {
+        contexts[i].weight = &weight[offset];
+        offset += contexts[i].weightSize.nBytes;
+    }
+    fusedWeights.push_back(NnCpuFusedWeight{ opIndex, nFusedOps, weight });
+
+    const NnSize outputSize = (NnSize)contexts[0].nBatches * d;
+    if (fusedOutput->size < outputSize) {
+        if (fusedOutput->data != nullptr)
+            releaseAlignedBuffer((NnByte *)fusedOutput->data);
+        fusedOutput->data = (float *)allocAlignedBuffer(outputSize * sizeof(float));
+        fusedOutput->size = outputSize;
+    }
+    contexts[0].fusedOutput = fusedOutput;
+}
+
+NnUint NnCpuDeviceSegment::fuseOps(NnUint opIndex, NnUint nFusedOps) {
+    assert(opIndex + nFusedOps <= nOps);
+    std::vector<NnCpuOpForward> forwards(nFusedOps);
+    const NnUint nSteps = getCpuFusedOpForwards(&opCodes[opIndex], &opQuants[opIndex], nFusedOps, forwards.data());
+    if (nSteps == 0)
+        return 0;
+    if (opCodes[opIndex] == OP_MATMUL)
+        concatMatmulWeights(opIndex, nFusedOps);
+    // The fused forwards get the contexts of all ops, they follow the context of the first op
+    for (NnUint stepIndex = 0; stepIndex < nSteps; stepIndex++)
+        opForward[opIndex + stepIndex] = forwards[stepIndex];
+    return nSteps;
+}
+
+void NnCpuDeviceSegment::forwardColumns(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnUint xStart, NnUint xEnd) {
+    NnCpuOpContext *context = &opContexts[opIndex];
+    opForwardColumns[opIndex](nThreads, threadIndex, batchSize, xStart, xEnd, context);
+}
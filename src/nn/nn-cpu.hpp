@@ -5,7 +5,16 @@
 #include "nn-executor.hpp"
 #include "nn-cpu-ops.hpp"
 
-#define DEBUG_USE_MMAP_FOR_WEIGHTS false
+// The executor thread `i` is pinned to the core `cpus[i]` of the NUMA node `nodes[i]`
+typedef struct {
+    NnUint nNodes;
+    std::vector<int> cpus;
+    std::vector<int> nodes;
+} NnCpuNumaPlacement;
+
+// Spreads the threads over the NUMA nodes in contiguous blocks, so the rows of a matmul split between
+// the threads form one range per node. Returns no threads where the placement is not supported.
+NnCpuNumaPlacement resolveCpuNumaPlacement(NnUint nThreads);
 
 class NnCpuDevice : public NnDevice {
 public:
@@ -16,24 +25,50 @@ private:
     NnNetExecution *netExecution;
     NnUint nBuffers;
     NnByte *bufferFlags;
+    NnCpuNumaPlacement numaPlacement;
+    bool isNumaAware;
+    bool hasNumaWeights;
+    NnCpuFusedOutput fusedOutput;
 public:
-    NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution);
+    NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, bool isNumaAware = false);
     ~NnCpuDevice() override;
     NnUint maxNThreads() override;
     NnDeviceSegment *createSegment(NnUint segmentIndex) override;
+    void bindThread(NnUint threadIndex) override;
     std::vector<NnByte *> resolvePointer(NnSize3D *pntrSize, NnPointerConfig *pointerConfig);
 };
 
+// Weights of fused matmuls concatenated by rows, the weights of the ops point into it
+typedef struct {
+    NnUint opIndex;
+    NnUint nOps;
+    NnByte *weight; // null = released, the weights of the ops are mapped
+} NnCpuFusedWeight;
+
 class NnCpuDeviceSegment : public NnDeviceSegment {
+private:
+    void concatMatmulWeights(NnUint opIndex, NnUint nFusedOps);
 public:
     NnUint nOps;
     NnCpuOpForward *opForward;
+    NnCpuOpForwardColumns *opForwardColumns;
     NnCpuOpContext *opContexts;
-    NnCpuDeviceSegment(NnCpuOpForward *opForward, NnCpuOpContext *opContexts, NnUint nOps)
-        : opForward(opForward), opContexts(opContexts), nOps(nOps) {}
+    std::vector<bool> isWeightAllocated; // weights are allocated on the first load, mapped weights are not owned
+    std::vector<NnOpCode> opCodes;
+    std::vector<NnOpQuantType> opQuants;
+    // Matmul weights are placed by the rows of the threads, null = the default placement
+    const NnCpuNumaPlacement *numaPlacement;
+    NnCpuFusedOutput *fusedOutput;
+    std::vector<NnCpuFusedWeight> fusedWeights;
+    NnCpuDeviceSegment(NnCpuOpForward *opForward, NnCpuOpForwardColumns *opForwardColumns, NnCpuOpContext *opContexts, NnUint nOps)
+        : opForward(opForward), opForwardColumns(opForwardColumns), opContexts(opContexts), nOps(nOps), isWeightAllocated(nOps, false), numaPlacement(nullptr), fusedOutput(nullptr) {}
     ~NnCpuDeviceSegment() override;
     void loadWeight(NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) override;
+    bool mapWeight(NnUint opIndex, NnByte *weight) override;
     void forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize) override;
+    bool canForwardColumns(NnUint opIndex) override;
+    void forwardColumns(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnUint xStart, NnUint xEnd) override;
+    NnUint fuseOps(NnUint opIndex, NnUint nFusedOps) override;
 };
 
 #endif
\ No newline at end of file
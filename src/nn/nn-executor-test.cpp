@@ -0,0 +1,134 @@
+#include "nn-core.hpp"
+#include "nn-config-builder.hpp"
+#include "nn-executor.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define MAX_THREADS 8
+
+static void assertTrue(bool condition, const char *message) {
+    if (!condition)
+        throw std::runtime_error(message);
+}
+
+// Every thread counts its visits of the op, a step must see all visits of the previous one
+class CountingSegment : public NnDeviceSegment {
+public:
+    std::vector<std::atomic_uint> *counters;
+    std::atomic_uint *nViolations;
+    CountingSegment(std::vector<std::atomic_uint> *counters, std::atomic_uint *nViolations) {
+        this->counters = counters;
+        this->nViolations = nViolations;
+    }
+    void loadWeight(NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) override {}
+    void forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize) override {
+        if (counters == nullptr)
+            return;
+        if (opIndex > 0 && (*counters)[opIndex - 1].load() % nThreads != 0)
+            nViolations->fetch_add(1);
+        (*counters)[opIndex].fetch_add(1);
+    }
+};
+
+class CountingDevice : public NnDevice {
+public:
+    std::vector<std::atomic_uint> *counters;
+    std::atomic_uint *nViolations;
+    CountingDevice(std::vector<std::atomic_uint> *counters, std::atomic_uint *nViolations) {
+        this->counters = counters;
+        this->nViolations = nViolations;
+    }
+    NnUint maxNThreads() override { return MAX_THREADS; }
+    NnDeviceSegment *createSegment(NnUint segmentIndex) override {
+        return new CountingSegment(counters, nViolations);
+    }
+};
+
+static void buildConfig(NnUint nOps, NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
+    NnNetConfigBuilder netBuilder(1, 1);
+    NnUint xPipeIndex = netBuilder.addPipe("X", size2D(F_32, 1, 1));
+    NnNodeConfigBuilder nodeBuilder(0);
+    NnSegmentConfigBuilder segmentBuilder;
+    for (NnUint opIndex = 0; opIndex < nOps; opIndex++) {
+        segmentBuilder.addOp(OP_CAST, "cast", opIndex,
+            pointerBatchConfig(SRC_PIPE, xPipeIndex),
+            pointerBatchConfig(SRC_PIPE, xPipeIndex),
+            size0(),
+            NnCastOpCodeConfig{});
+    }
+    nodeBuilder.addSegment(segmentBuilder.build());
+    *netConfig = netBuilder.build();
+    *nodeConfig = nodeBuilder.build();
+}
+
+static void testStepOrder(NnUint nThreads) {
+    const NnUint nOps = 64;
+    const NnUint nRuns = 20;
+    NnNetConfig netConfig;
+    NnNodeConfig nodeConfig;
+    buildConfig(nOps, &netConfig, &nodeConfig);
+
+    std::vector<std::atomic_uint> counters(nOps);
+    for (std::atomic_uint &counter : counters)
+        counter.store(0);
+    std::atomic_uint nViolations(0);
+
+    NnNetExecution execution(nThreads, &netConfig);
+    std::vector<NnExecutorDevice> devices;
+    devices.push_back(NnExecutorDevice(new CountingDevice(&counters, &nViolations), -1, -1));
+    NnFakeNodeSynchronizer synchronizer;
+    {
+        NnExecutor executor(&netConfig, &nodeConfig, &devices, &execution, &synchronizer, false);
+        execution.setBatchSize(1);
+        for (NnUint run = 0; run < nRuns; run++)
+            executor.forward();
+    }
+
+    for (NnUint opIndex = 0; opIndex < nOps; opIndex++)
+        assertTrue(counters[opIndex].load() == nThreads * nRuns, "every thread must execute every step");
+    assertTrue(nViolations.load() == 0, "a step started before the previous one was done");
+    releaseNetConfig(&netConfig);
+    releaseNodeConfig(&nodeConfig);
+}
+
+// Steps without work measure the cost of the barrier and of the dispatch, run with `--benchmark`
+static void benchmarkStepOverhead(NnUint nThreads) {
+    const NnUint nOps = 1500;
+    const NnUint nRuns = 20;
+    NnNetConfig netConfig;
+    NnNodeConfig nodeConfig;
+    buildConfig(nOps, &netConfig, &nodeConfig);
+
+    NnNetExecution execution(nThreads, &netConfig);
+    std::vector<NnExecutorDevice> devices;
+    devices.push_back(NnExecutorDevice(new CountingDevice(nullptr, nullptr), -1, -1));
+    NnFakeNodeSynchronizer synchronizer;
+    NnExecutor executor(&netConfig, &nodeConfig, &devices, &execution, &synchronizer, false);
+    execution.setBatchSize(1);
+    executor.forward();
+
+    Timer timer;
+    for (NnUint run = 0; run < nRuns; run++)
+        executor.forward();
+    const double stepUs = timer.elapsedMicroseconds() / (double)(nRuns * nOps);
+    printf("⏱️  nThreads=%u: %.3f us per step\n", nThreads, stepUs);
+    releaseNetConfig(&netConfig);
+    releaseNodeConfig(&nodeConfig);
+}
+
+int main(int argc, char **argv) {
+    initQuants();
+
+    for (NnUint nThreads = 1; nThreads <= 4; nThreads *= 2)
+        testStepOrder(nThreads);
+    printf("✅           testStepOrder passed\n");
+
+    if (argc > 1 && std::strcmp(argv[1], "--benchmark") == 0) {
+        for (NnUint nThreads = 1; nThreads <= 4; nThreads *= 2)
+            benchmarkStepOverhead(nThreads);
+    }
+    return 0;
+}
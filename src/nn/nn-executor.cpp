@@ -3,11 +3,20 @@
 #include <chrono>
 #include <cstdlib>
 #include "nn-executor.hpp"
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 
 static inline void executeStep(NnExecutorStep *step, NnUint nThreads, NnExecutorThread *thread, NnExecutorContext *context);
 
 #define DEFAULT_EXEC_STALL_LOG_MS 2000ul
 #define DEFAULT_EXEC_STALL_TIMEOUT_MS 180000ul
+#define DEFAULT_EXEC_SPIN_US 50ul
+// A parked thread checks the state of the run at least this often, a failed run does not wake it otherwise
+#define EXEC_PARK_TIMEOUT_MS 10
 
 static unsigned long readExecutorTimeoutEnvMs(const char *name, unsigned long fallbackMs) {
     const char *value = std::getenv(name);
@@ -32,9 +41,71 @@ static inline unsigned long getExecutorStallTimeoutMs() {
     return raw < minimum ? minimum : raw;
 }
 
+static inline unsigned long getExecutorSpinUs() {
+    static const unsigned long value = readExecutorTimeoutEnvMs("DLLAMA_EXEC_SPIN_US", DEFAULT_EXEC_SPIN_US);
+    return value;
+}
+
+static void parkOnStep(std::atomic_uint *stepIndex, NnUint value) {
+#ifdef __linux__
+    struct timespec timeout;
+    timeout.tv_sec = EXEC_PARK_TIMEOUT_MS / 1000;
+    timeout.tv_nsec = (long)(EXEC_PARK_TIMEOUT_MS % 1000) * 1000000L;
+    syscall(SYS_futex, (uint32_t *)stepIndex, FUTEX_WAIT_PRIVATE, value, &timeout, nullptr, 0);
+#else
+    if (stepIndex->load() == value)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+}
+
+static void wakeParkedThreads(NnExecutorContext *context) {
+#ifdef __linux__
+    if (context->nParkedThreads.load() > 0)
+        syscall(SYS_futex, (uint32_t *)&context->currentStepIndex, FUTEX_WAKE_PRIVATE, 1 << 30, nullptr, nullptr, 0);
+#endif
+}
+
+// Returns false when the run has failed or was stopped. The last thread that arrives opens the barrier,
+// the others spin for a moment (the next step usually follows quickly) and then park on the futex,
+// so threads waiting for a long sync of nodes do not take cycles from the network stack.
+static bool waitForNextStep(NnExecutorContext *context, NnExecutorStep *step, NnUint stepIndex, NnUint epoch) {
+    if (context->doneThreadCount.fetch_add(1) == context->nThreads - 1) {
+        if (context->timer != nullptr) {
+            NnUint time = context->timer->elapsedMicroseconds();
+            context->totalTime[step->type] += time;
+            context->timer->reset();
+        }
+        context->doneThreadCount.store(0);
+        context->currentStepIndex.store(stepIndex + 1);
+        wakeParkedThreads(context);
+        return true;
+    }
+
+    const unsigned long spinUs = getExecutorSpinUs();
+    const auto startTime = std::chrono::steady_clock::now();
+    bool isSpinning = true;
+    while (context->currentStepIndex.load() == stepIndex) {
+        if (!context->isAlive.load() || context->isShutdown.load() || context->epoch.load() != epoch)
+            return false;
+        if (isSpinning) {
+            std::this_thread::yield();
+            auto waitUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+            isSpinning = (unsigned long)waitUs < spinUs;
+            continue;
+        }
+        // The waker checks the parked threads after moving the index, so one of both sees the other
+        context->nParkedThreads.fetch_add(1);
+        if (context->currentStepIndex.load() == stepIndex)
+            parkOnStep(&context->currentStepIndex, stepIndex);
+        context->nParkedThreads.fetch_sub(1);
+    }
+    return true;
+}
+
 static inline const char *executorStepTypeToString(NnExecutorStepType type) {
     if (type == STEP_EXECUTE_OP) return "EXECUTE_OP";
     if (type == STEP_SYNC_NODES) return "SYNC_NODES";
+    if (type == STEP_SYNC_CHUNK) return "SYNC_CHUNK";
     return "UNKNOWN";
 }
 
@@ -47,6 +118,8 @@ NnNetExecution::NnNetExecution(NnUint nThreads, NnNetConfig *netConfig) {
     this->nBatches = netConfig->nBatches;
     this->nPipes = netConfig->nPipes;
     this->batchSize = 0; // This value must be overwritten before calling forward
+    this->nOutputRows = 0;
+    this->outputTopK = 0;
 
     pipes = new NnByte *[netConfig->nPipes];
     for (NnUint pipeIndex = 0; pipeIndex < netConfig->nPipes; pipeIndex++) {
@@ -66,6 +139,17 @@ NnNetExecution::~NnNetExecution() {
 void NnNetExecution::setBatchSize(NnUint batchSize) {
     assert(batchSize <= nBatches);
     this->batchSize = batchSize;
+    this->nOutputRows = batchSize;
+    this->outputTopK = 0;
+}
+
+void NnNetExecution::setOutputRows(NnUint nOutputRows) {
+    assert(nOutputRows <= batchSize);
+    this->nOutputRows = nOutputRows;
+}
+
+void NnNetExecution::setOutputTopK(NnUint outputTopK) {
+    this->outputTopK = outputTopK;
 }
 
 NnExecutorDevice::NnExecutorDevice(NnDevice *device, int segmentFrom, int segmentTo) {
@@ -74,6 +158,97 @@ NnExecutorDevice::NnExecutorDevice(NnDevice *device, int segmentFrom, int segmen
     this->segmentTo = segmentTo;
 }
 
+static NnUint getPointerX(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnPointerConfig *pointer) {
+    if (pointer->source == SRC_PIPE)
+        return netConfig->pipes[pointer->pointerIndex].size.x;
+    return nodeConfig->buffers[pointer->pointerIndex].size.x;
+}
+
+static bool isSamePointer(NnPointerConfig *a, NnPointerConfig *b) {
+    return a->source == b->source && a->pointerIndex == b->pointerIndex && a->type == b->type;
+}
+
+// Returns the index of the first op of the segment tail that may be computed in chunks of columns:
+// a matmul followed by casts that write the pipe of the chunked sync. Returns `nOps` if there is no such tail.
+static NnUint findChunkedOps(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnSegmentConfig *segmentConfig, NnDeviceSegment *segment, NnSyncConfig **chunkedSync) {
+    const NnUint nOps = segmentConfig->nOps;
+    NnSyncConfig *syncConfig = getChunkedSync(netConfig, segmentConfig);
+    if (syncConfig == nullptr)
+        return nOps;
+
+    NnUint tpGroupStart;
+    NnUint tpGroupEnd;
+    resolveTpGroup(netConfig, nodeConfig, &tpGroupStart, &tpGroupEnd);
+    if (tpGroupEnd - tpGroupStart < 2)
+        return nOps;
+
+    const NnUint x = netConfig->pipes[syncConfig->pipeIndex].size.x;
+    NnPointerConfig pipePointer = pointerBatchConfig(SRC_PIPE, syncConfig->pipeIndex);
+    if (!isSamePointer(&segmentConfig->ops[nOps - 1].output, &pipePointer))
+        return nOps;
+
+    for (NnUint opIndex = nOps; opIndex-- > 0;) {
+        NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
+        if (opConfig->output.type != PNTR_BATCH ||
+            getPointerX(netConfig, nodeConfig, &opConfig->output) != x ||
+            !segment->canForwardColumns(opIndex))
+            return nOps;
+        if (opConfig->code == OP_MATMUL) {
+            *chunkedSync = syncConfig;
+            return opIndex;
+        }
+        if (opConfig->code != OP_CAST || opIndex == 0 || !isSamePointer(&segmentConfig->ops[opIndex - 1].output, &opConfig->input))
+            return nOps;
+    }
+    return nOps;
+}
+// Returns the length of the chain or group of ops starting at `opIndex` that the device may fuse, or 1.
+// Returns the length of the chain of ops starting at `opIndex` that may be executed as one step, or 1.
+// Chains: INV_RMS -> RMS_NORM -> CAST and SILU -> MUL -> CAST, every op consumes the output of the previous one.
+// The fused norm reads the whole row in every thread, so the RMS_NORM must not write its input.
+// The MERGE_ADD before a norm stays a separate step: the inverse RMS needs the whole merged row, and a thread
+// cannot merge its part of the row in place while other threads still read the row.
+// Groups: MATMUL ops of the same input (q/k/v, w1/w3), the ops do not depend on each other, the device may concatenate their weights.
+static NnUint findFusedOps(NnSegmentConfig *segmentConfig, NnUint opIndex, NnUint nOps) {
+    NnOpConfig *ops = &segmentConfig->ops[opIndex];
+    const NnUint nRestOps = nOps - opIndex;
+    if (ops[0].code == OP_MATMUL && !isSamePointer(&ops[0].output, &ops[0].input)) {
+        NnUint nMatmuls = 1;
+        while (nMatmuls < nRestOps &&
+            ops[nMatmuls].code == OP_MATMUL &&
+            isSamePointer(&ops[nMatmuls].input, &ops[0].input) &&
+            !isSamePointer(&ops[nMatmuls].output, &ops[0].input))
+            nMatmuls++;
+        return nMatmuls;
+    }
+    if (nRestOps >= 3 &&
+        ops[0].code == OP_INV_RMS &&
+        ops[1].code == OP_RMS_NORM &&
+        ops[2].code == OP_CAST) {
+        const NnInvRmsOpConfig *invRmsConfig = (NnInvRmsOpConfig *)ops[0].config;
+        const NnRmsNormOpConfig *rmsNormConfig = (NnRmsNormOpConfig *)ops[1].config;
+        if (isSamePointer(&ops[0].input, &ops[1].input) &&
+            ops[0].output.source == SRC_BUFFER &&
+            ops[0].output.pointerIndex == rmsNormConfig->invRmsBufferIndex &&
+            invRmsConfig->nColumns == 1 &&
+            rmsNormConfig->nColumns == 1 &&
+            !isSamePointer(&ops[1].input, &ops[1].output) &&
+            isSamePointer(&ops[1].output, &ops[2].input))
+            return 3;
+    }
+    if (nRestOps >= 3 &&
+        ops[0].code == OP_SILU &&
+        ops[1].code == OP_MUL &&
+        ops[2].code == OP_CAST) {
+        if (isSamePointer(&ops[0].input, &ops[0].output) &&
+            isSamePointer(&ops[0].output, &ops[1].input) &&
+            isSamePointer(&ops[1].input, &ops[1].output) &&
+            isSamePointer(&ops[1].output, &ops[2].input))
+            return 3;
+    }
+    return 1;
+}
+
 NnExecutorException::NnExecutorException(const std::string message)
     : std::runtime_error(message) 
 {}
@@ -91,6 +266,8 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::ve
 
     this->netExecution = netExecution;
     this->nodeConfig = nodeConfig;
+    for (NnExecutorDevice &d : *devices)
+        this->devices.push_back(d.device.get());
 
     bool useSynchronizer = netConfig->nNodes > 1;
     for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
@@ -112,11 +289,39 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::ve
             NnDeviceSegment *segment = device->createSegment(segmentIndex);
             segments[segmentIndex] = std::unique_ptr<NnDeviceSegment>(segment);
 
-            for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++)
-                steps.push_back(NnExecutorStep{ STEP_EXECUTE_OP, segment, opIndex, &segmentConfig->ops[opIndex] });
+            NnSyncConfig *chunkedSync = nullptr;
+            const NnUint nFullOps = useSynchronizer
+                ? findChunkedOps(netConfig, nodeConfig, segmentConfig, segment, &chunkedSync)
+                : segmentConfig->nOps;
+            for (NnUint opIndex = 0; opIndex < nFullOps;) {
+                // Fused ops take fewer steps, it saves the barriers between the ops and the passes over the memory
+                NnUint nFusedOps = findFusedOps(segmentConfig, opIndex, nFullOps);
+                NnUint nSteps = nFusedOps > 1 ? segment->fuseOps(opIndex, nFusedOps) : 0;
+                if (nSteps == 0) {
+                    nFusedOps = 1;
+                    nSteps = 1;
+                }
+                assert(nSteps <= nFusedOps);
+                for (NnUint stepIndex = 0; stepIndex < nSteps; stepIndex++)
+                    steps.push_back(NnExecutorStep{ STEP_EXECUTE_OP, segment, opIndex + stepIndex, &segmentConfig->ops[opIndex + stepIndex], segmentConfig->onlyOutputRows, 0, 0, 0 });
+                opIndex += nFusedOps;
+            }
+
+            if (chunkedSync != nullptr) {
+                // The sync of a chunk runs in the background while the next chunk is computed
+                const NnUint x = netConfig->pipes[chunkedSync->pipeIndex].size.x;
+                for (NnUint chunkIndex = 0; chunkIndex < chunkedSync->nChunks; chunkIndex++) {
+                    NnUint xStart;
+                    NnUint xEnd;
+                    splitSyncChunk(x, chunkedSync->nChunks, chunkIndex, &xStart, &xEnd);
+                    for (NnUint opIndex = nFullOps; opIndex < segmentConfig->nOps; opIndex++)
+                        steps.push_back(NnExecutorStep{ STEP_EXECUTE_OP, segment, opIndex, &segmentConfig->ops[opIndex], segmentConfig->onlyOutputRows, chunkIndex, xStart, xEnd });
+                    steps.push_back(NnExecutorStep{ STEP_SYNC_CHUNK, nullptr, segmentIndex, nullptr, segmentConfig->onlyOutputRows, chunkIndex, 0, 0 });
+                }
+            }
         }
         if (useSynchronizer && segmentConfig->nSyncs > 0)
-            steps.push_back(NnExecutorStep{ STEP_SYNC_NODES, nullptr, segmentIndex, nullptr });
+            steps.push_back(NnExecutorStep{ STEP_SYNC_NODES, nullptr, segmentIndex, nullptr, segmentConfig->onlyOutputRows, 0, 0, 0 });
     }
 
     steps.shrink_to_fit();
@@ -128,6 +333,7 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::ve
     context.epoch.store(0);
     context.currentStepIndex.store(0);
     context.doneThreadCount.store(0);
+    context.nParkedThreads.store(0);
     context.doneRunThreadCount.store(0);
     context.isAlive.store(true);
     context.isShutdown.store(false);
@@ -149,6 +355,8 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::ve
             NnExecutorThread *thread = &this->threads[threadIndex];
             NnExecutorContext *ctx = thread->context;
             NnUint localEpoch = 0;
+            for (NnDevice *device : this->devices)
+                device->bindThread(threadIndex);
 
             while (true) {
                 {
@@ -166,41 +374,20 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::ve
                 NnUint nThreads = ctx->nThreads;
                 NnUint doneCount = nThreads - 1;
 
-                while (ctx->isAlive.load()) {
-                    const NnUint currentStepIndex = ctx->currentStepIndex.load();
-                    if (currentStepIndex == ctx->nSteps)
-                        break;
-
-                    NnExecutorStep *step = &ctx->steps[currentStepIndex];
+                // Every thread executes all steps in order, the barrier only tells when the next one may start
+                for (NnUint stepIndex = 0; stepIndex < ctx->nSteps && ctx->isAlive.load(); stepIndex++) {
+                    NnExecutorStep *step = &ctx->steps[stepIndex];
                     try {
                         executeStep(step, nThreads, thread, ctx);
                     } catch (const std::runtime_error &e) {
                         ctx->isAlive.store(false);
                         printf("🚨 Execution error: %s\n", e.what());
+                        wakeParkedThreads(ctx);
                         ctx->cv.notify_all();
                         break;
                     }
-
-                    NnUint currentCount = ctx->doneThreadCount.fetch_add(1);
-                    if (currentCount == doneCount) {
-                        if (ctx->timer != nullptr) {
-                            NnUint time = ctx->timer->elapsedMicroseconds();
-                            ctx->totalTime[step->type] += time;
-                            ctx->timer->reset();
-                        }
-
-                        ctx->doneThreadCount.store(0);
-                        ctx->currentStepIndex.fetch_add(1);
-                    } else {
-                        while (
-                            ctx->currentStepIndex.load() == currentStepIndex &&
-                            ctx->isAlive.load() &&
-                            !ctx->isShutdown.load() &&
-                            ctx->epoch.load() == localEpoch
-                        ) {
-                            std::this_thread::yield();
-                        }
-                    }
+                    if (!waitForNextStep(ctx, step, stepIndex, localEpoch))
+                        break;
                 }
 
                 NnUint runCount = ctx->doneRunThreadCount.fetch_add(1);
@@ -226,15 +413,15 @@ NnExecutor::~NnExecutor() {
     }
 }
 
-void NnExecutor::loadWeight(const char *name, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) {
+void NnExecutor::findOp(const char *name, NnUint opIndex, NnDeviceSegment **segment, NnUint *segmentOpIndex) {
     for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
         NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
         for (NnUint i = 0; i < segmentConfig->nOps; i++) {
             NnOpConfig *opConfig = &segmentConfig->ops[i];
             if (opConfig->index == opIndex && std::strcmp(opConfig->name, name) == 0) {
-                NnDeviceSegment *segment = segments[segmentIndex].get();
-                assert(segment != nullptr);
-                segment->loadWeight(i, offset, nBytes, weight);
+                *segment = segments[segmentIndex].get();
+                assert(*segment != nullptr);
+                *segmentOpIndex = i;
                 return;
             }
         }
@@ -242,11 +429,33 @@ void NnExecutor::loadWeight(const char *name, NnUint opIndex, NnSize offset, NnS
     throw std::invalid_argument("Cannot locate op by name: " + std::string(name));
 }
 
+void NnExecutor::loadWeight(const char *name, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) {
+    NnDeviceSegment *segment;
+    NnUint segmentOpIndex;
+    findOp(name, opIndex, &segment, &segmentOpIndex);
+    segment->loadWeight(segmentOpIndex, offset, nBytes, weight);
+}
+
+bool NnExecutor::mapWeight(const char *name, NnUint opIndex, NnByte *weight) {
+    NnDeviceSegment *segment;
+    NnUint segmentOpIndex;
+    findOp(name, opIndex, &segment, &segmentOpIndex);
+    return segment->mapWeight(segmentOpIndex, weight);
+}
+
 static inline void executeStep(NnExecutorStep *step, NnUint nThreads, NnExecutorThread *thread, NnExecutorContext *context) {
+    const NnUint batchSize = step->onlyOutputRows ? context->nOutputRows : context->batchSize;
+    if (batchSize == 0)
+        return;
     if (step->type == STEP_EXECUTE_OP) {
-        step->segment->forward(step->arg0, nThreads, thread->threadIndex, context->batchSize);
+        if (step->xEnd == 0)
+            step->segment->forward(step->arg0, nThreads, thread->threadIndex, batchSize);
+        else
+            step->segment->forwardColumns(step->arg0, nThreads, thread->threadIndex, batchSize, step->xStart, step->xEnd);
     } else if (step->type == STEP_SYNC_NODES) {
         context->synchronizer->sync(step->arg0, nThreads, thread->threadIndex);
+    } else if (step->type == STEP_SYNC_CHUNK) {
+        context->synchronizer->syncChunk(step->arg0, step->chunkIndex, nThreads, thread->threadIndex);
     } else {
         throw std::invalid_argument("Unsupported step type");
     }
@@ -263,6 +472,7 @@ void NnExecutor::forward() {
         context.doneRunThreadCount.store(0);
         context.isRunDone.store(false);
         context.batchSize = netExecution->batchSize;
+        context.nOutputRows = netExecution->nOutputRows;
 
         if (context.timer != nullptr) {
             std::memset(context.totalTime, 0, sizeof(context.totalTime));
@@ -348,6 +558,7 @@ void NnExecutor::forward() {
             context.isAlive.store(false);
             context.isRunDone.store(true);
             context.epoch.fetch_add(1);
+            wakeParkedThreads(&context);
             context.cv.notify_all();
             break;
         }
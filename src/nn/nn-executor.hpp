@@ -13,7 +13,17 @@ class NnDeviceSegment {
 public:
     virtual ~NnDeviceSegment() {};
     virtual void loadWeight(NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) = 0;
+    // Uses the memory as the weight of the op without a copy, the memory must outlive the segment
+    virtual bool mapWeight(NnUint opIndex, NnByte *weight) { return false; }
     virtual void forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize) = 0;
+    // The op computes every column of its output independently, so it may compute only the columns [xStart, xEnd)
+    virtual bool canForwardColumns(NnUint opIndex) { return false; }
+    virtual void forwardColumns(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnUint xStart, NnUint xEnd) {
+        throw std::runtime_error("The device does not support forward of columns");
+    }
+    // Returns the number of steps in which the device executes the ops [opIndex, opIndex + nOps), 0 = not fused.
+    // The executor calls the forward of the ops [opIndex, opIndex + nSteps) as separate steps and skips the others
+    virtual NnUint fuseOps(NnUint opIndex, NnUint nOps) { return 0; }
 };
 
 class NnDevice {
@@ -21,12 +31,16 @@ public:
     virtual NnUint maxNThreads() = 0;
     virtual ~NnDevice() {}
     virtual NnDeviceSegment *createSegment(NnUint segmentIndex) = 0;
+    // Called by every executor thread before its first step, e.g. to pin the thread to a core
+    virtual void bindThread(NnUint threadIndex) {}
 };
 
 class NnNodeSynchronizer {
 public:
     virtual ~NnNodeSynchronizer() {};
     virtual void sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) = 0;
+    // Starts the chunked sync of the computed columns in the background, `sync` of the segment waits for it
+    virtual void syncChunk(NnUint segmentIndex, NnUint chunkIndex, NnUint nThreads, NnUint threadIndex) {}
 };
 
 class NnFakeNodeSynchronizer : public NnNodeSynchronizer {
@@ -41,18 +55,23 @@ public:
     NnUint nPipes;
     NnByte **pipes;
     NnUint batchSize;
+    NnUint nOutputRows;
+    NnUint outputTopK;
     NnUint nBatches;
     NnNetExecution(NnUint nThreads, NnNetConfig *netConfig);
     ~NnNetExecution();
     void setBatchSize(NnUint batchSize);
+    void setOutputRows(NnUint nOutputRows);
+    void setOutputTopK(NnUint outputTopK);
 };
 
 enum NnExecutorStepType {
     STEP_EXECUTE_OP,
     STEP_SYNC_NODES,
+    STEP_SYNC_CHUNK,
 };
 
-#define N_STEP_TYPES STEP_SYNC_NODES + 1
+#define N_STEP_TYPES STEP_SYNC_CHUNK + 1
 
 class NnExecutorDevice {
 public:
@@ -67,6 +86,10 @@ typedef struct {
     NnDeviceSegment *segment;
     NnUint arg0;
     NnOpConfig *opConfig;
+    bool onlyOutputRows;
+    NnUint chunkIndex;
+    NnUint xStart; // a chunked op computes only the columns [xStart, xEnd) of its output, xEnd = 0 means all columns
+    NnUint xEnd;
 } NnExecutorStep;
 
 typedef struct {
@@ -75,13 +98,17 @@ typedef struct {
     NnExecutorStep *steps;
     NnNodeSynchronizer *synchronizer;
     std::atomic_uint epoch;
+    // The step barrier: the last thread that finishes a step moves the index, it is the sense of the barrier
+    // and the futex word of the parked threads
     std::atomic_uint currentStepIndex;
     std::atomic_uint doneThreadCount;
+    std::atomic_uint nParkedThreads;
     std::atomic_uint doneRunThreadCount;
     std::atomic_bool isAlive;
     std::atomic_bool isShutdown;
     std::atomic_bool isRunDone;
     NnUint batchSize;
+    NnUint nOutputRows;
     Timer *timer;
     NnUint totalTime[N_STEP_TYPES];
     std::mutex mutex;
@@ -102,15 +129,18 @@ class NnExecutor {
 private:
     NnNetExecution *netExecution;
     NnNodeConfig *nodeConfig;
+    std::vector<NnDevice *> devices;
     std::vector<std::unique_ptr<NnDeviceSegment>> segments;
     std::vector<NnExecutorStep> steps;
     std::vector<NnExecutorThread> threads;
     std::vector<std::thread> threadHandles;
     NnExecutorContext context;
+    void findOp(const char *name, NnUint opIndex, NnDeviceSegment **segment, NnUint *segmentOpIndex);
 public:
     NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, std::vector<NnExecutorDevice> *device, NnNetExecution *netExecution, NnNodeSynchronizer *synchronizer, bool benchmark);
     ~NnExecutor();
     void loadWeight(const char *name, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight);
+    bool mapWeight(const char *name, NnUint opIndex, NnByte *weight);
     void forward();
     NnUint getTotalTime(NnExecutorStepType type);
 };
@@ -9,10 +9,19 @@ typedef SSIZE_T ssize_t;
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>  // for getaddrinfo
+#include <poll.h>
+#include <sys/uio.h>
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define NN_ZEROCOPY 1
+#endif
 #endif
 #include "nn-network.hpp"
+#include "nn-shm.hpp"
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <numeric>
 #include <stdexcept>
 #include <vector>
 #include <fcntl.h>
@@ -31,6 +40,8 @@ typedef SSIZE_T ssize_t;
 
 #define ACK 23571114
 #define MAX_CHUNK_SIZE 4096
+// Below this size pinning the pages costs more than copying them
+#define ZEROCOPY_MIN_BYTES (64 * 1024)
 
 #if defined(MSG_NOSIGNAL)
 #define NN_SEND_FLAGS MSG_NOSIGNAL
@@ -40,6 +51,9 @@ typedef SSIZE_T ssize_t;
 
 #define DEFAULT_NET_STALL_LOG_MS 2000ul
 #define DEFAULT_NET_STALL_TIMEOUT_MS 60000ul
+#define DEFAULT_NET_SPIN_US 200ul
+// A blocked wait wakes up at least this often, so the stall log and the timeouts keep working
+#define SOCKET_POLL_TIMEOUT_MS 100
 
 static unsigned long readTimeoutEnvMs(const char *name, unsigned long fallbackMs) {
     const char *value = std::getenv(name);
@@ -64,8 +78,62 @@ static inline unsigned long getNetStallTimeoutMs() {
     return raw < minimum ? minimum : raw;
 }
 
-static inline void sleepOnSocketRetry() {
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+static inline unsigned long getNetSpinUs() {
+    static const unsigned long value = readTimeoutEnvMs("DLLAMA_NET_SPIN_US", DEFAULT_NET_SPIN_US);
+    return value;
+}
+
+static inline int pollSockets(struct pollfd *fds, NnUint n, int timeoutMs) {
+#ifdef _WIN32
+    return WSAPoll(fds, (ULONG)n, timeoutMs);
+#else
+    return poll(fds, (nfds_t)n, timeoutMs);
+#endif
+}
+
+// Waits until one of the sockets is ready. Shortly after the last progress the wait spins, so the next part
+// of a message that is on the way is picked up without a syscall. Then the thread blocks in poll and
+// wakes up as soon as the kernel has data or space, an idle node does not burn a core.
+static inline bool spinAfterProgress(std::chrono::steady_clock::time_point lastProgressTime) {
+    auto spinUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - lastProgressTime).count();
+    if ((unsigned long)spinUs < getNetSpinUs()) {
+        std::this_thread::yield();
+        return true;
+    }
+    return false;
+}
+
+static void waitForSockets(struct pollfd *fds, NnUint n, std::chrono::steady_clock::time_point lastProgressTime) {
+    if (spinAfterProgress(lastProgressTime))
+        return;
+    for (NnUint i = 0; i < n; i++)
+        fds[i].revents = 0;
+    if (pollSockets(fds, n, SOCKET_POLL_TIMEOUT_MS) < 0 && errno != EINTR)
+        throw NnTransferSocketException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
+}
+
+static inline void waitForSocket(int socket, short events, std::chrono::steady_clock::time_point lastProgressTime) {
+    struct pollfd fd;
+    fd.fd = socket;
+    fd.events = events;
+    fd.revents = 0;
+    waitForSockets(&fd, 1, lastProgressTime);
+}
+
+// Waits for the sockets of the unfinished transfers
+static void waitForIos(const int *sockets, NnUint n, const NnSocketIo *ios, short events, std::chrono::steady_clock::time_point lastProgressTime) {
+    static thread_local std::vector<struct pollfd> fds;
+    fds.clear();
+    for (NnUint i = 0; i < n; i++) {
+        if (ios[i].size == 0)
+            continue;
+        struct pollfd fd;
+        fd.fd = sockets[ios[i].socketIndex];
+        fd.events = events;
+        fd.revents = 0;
+        fds.push_back(fd);
+    }
+    waitForSockets(fds.data(), (NnUint)fds.size(), lastProgressTime);
 }
 
 static inline bool isEagainError() {
@@ -159,7 +227,7 @@ void writeSocket(int socket, const void *data, NnSize size) {
                     fflush(stdout);
                     lastLogTime = now;
                 }
-                sleepOnSocketRetry();
+                waitForSocket(socket, POLLOUT, lastProgressTime);
                 continue;
             }
             throw NnTransferSocketException(0, "Error writing to socket");
@@ -172,8 +240,8 @@ void writeSocket(int socket, const void *data, NnSize size) {
     }
 }
 
-static inline bool tryReadSocket(int socket, void *data, NnSize size, unsigned long maxAttempts) {
-    // maxAttempts = 0 means infinite attempts
+static inline bool tryReadSocket(int socket, void *data, NnSize size, unsigned long idleTimeoutMs) {
+    // idleTimeoutMs = 0 means waiting for the first byte without a limit
     auto lastProgressTime = std::chrono::steady_clock::now();
     auto lastLogTime = lastProgressTime;
     const unsigned long logTimeoutMs = getNetStallLogMs();
@@ -188,11 +256,11 @@ static inline bool tryReadSocket(int socket, void *data, NnSize size, unsigned l
                 long long stallMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(now - lastProgressTime).count();
                 long long sinceLogMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(now - lastLogTime).count();
 
-                if (s == size && maxAttempts > 0) {
-                    maxAttempts--;
-                    if (maxAttempts == 0) {
+                if (s == size && idleTimeoutMs > 0) {
+                    if ((unsigned long)stallMs >= idleTimeoutMs)
                         return false;
-                    }
+                    waitForSocket(socket, POLLIN, lastProgressTime);
+                    continue;
                 }
 
                 if ((unsigned long)stallMs >= hardTimeoutMs) {
@@ -214,7 +282,7 @@ static inline bool tryReadSocket(int socket, void *data, NnSize size, unsigned l
                     fflush(stdout);
                     lastLogTime = now;
                 }
-                sleepOnSocketRetry();
+                waitForSocket(socket, POLLIN, lastProgressTime);
                 continue;
             }
             throw NnTransferSocketException(0, "Error reading from socket");
@@ -228,12 +296,162 @@ static inline bool tryReadSocket(int socket, void *data, NnSize size, unsigned l
     return true;
 }
 
+#ifndef _WIN32
+// Sends the vector with as few `sendmsg` calls as the socket allows, returns the number of calls that sent data
+static NnUint writeSocketVector(int socket, struct iovec *iov, int iovcnt, int flags) {
+    auto lastProgressTime = std::chrono::steady_clock::now();
+    auto lastLogTime = lastProgressTime;
+    const unsigned long logTimeoutMs = getNetStallLogMs();
+    const unsigned long hardTimeoutMs = getNetStallTimeoutMs();
+    NnUint nCalls = 0;
+
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t s = sendmsg(socket, &msg, NN_SEND_FLAGS | flags);
+        if (s < 0) {
+#ifdef NN_ZEROCOPY
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY) != 0) {
+                // The kernel cannot pin more pages now, the rest goes the usual way
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+#endif
+            if (isEagainError()) {
+                auto now = std::chrono::steady_clock::now();
+                long long stallMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(now - lastProgressTime).count();
+                long long sinceLogMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(now - lastLogTime).count();
+                if ((unsigned long)stallMs >= hardTimeoutMs) {
+                    printf("🚨 [NET_TIMEOUT] writeSocketVector fd=%d stalled=%lldms (timeout=%lums)\n", socket, stallMs, hardTimeoutMs);
+                    fflush(stdout);
+                    throw NnTransferSocketException(SOCKET_LAST_ERRCODE,
+                        "writeSocketVector timeout after " + std::to_string(stallMs) + "ms");
+                }
+                if ((unsigned long)stallMs >= logTimeoutMs && (unsigned long)sinceLogMs >= logTimeoutMs) {
+                    printf("⏳ [NET_STALL] writeSocketVector fd=%d stalled=%lldms\n", socket, stallMs);
+                    fflush(stdout);
+                    lastLogTime = now;
+                }
+                waitForSocket(socket, POLLOUT, lastProgressTime);
+                continue;
+            }
+            throw NnTransferSocketException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
+        } else if (s == 0) {
+            throw NnTransferSocketException(0, "Socket closed");
+        }
+#ifdef NN_ZEROCOPY
+        if ((flags & MSG_ZEROCOPY) != 0)
+            nCalls++;
+#endif
+        size_t sent = (size_t)s;
+        while (iovcnt > 0 && sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+        lastProgressTime = std::chrono::steady_clock::now();
+    }
+    return nCalls;
+}
+#endif
+
+#ifdef NN_ZEROCOPY
+// Every zero-copy call gets a completion in the error queue of the socket, until then the kernel may read the buffers
+static void waitZeroCopy(int socket, NnUint nCalls) {
+    auto startTime = std::chrono::steady_clock::now();
+    const unsigned long hardTimeoutMs = getNetStallTimeoutMs();
+    NnUint nDone = 0;
+    while (nDone < nCalls) {
+        char control[128];
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE) < 0) {
+            if (!isEagainError())
+                throw NnTransferSocketException(SOCKET_LAST_ERRCODE, SOCKET_LAST_ERROR);
+            long long waitMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+            if ((unsigned long)waitMs >= hardTimeoutMs)
+                throw NnTransferSocketException(0, "Zero-copy completion timeout after " + std::to_string(waitMs) + "ms");
+            struct pollfd pfd = { socket, 0, 0 };
+            poll(&pfd, 1, 1);
+            continue;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+                throw NnTransferSocketException(err->ee_errno, "Zero-copy send failed");
+            nDone += err->ee_data - err->ee_info + 1;
+        }
+    }
+}
+#endif
+
 void readSocket(int socket, void *data, NnSize size) {
     if (!tryReadSocket(socket, data, size, 0)) {
         throw std::runtime_error("Error reading from socket");
     }
 }
 
+// A shared memory link has no kernel buffer, the waits sleep on the futex of the ring instead of poll
+static void writeChannel(NnSharedMemoryChannel *channel, const void *data, NnSize size) {
+    auto lastProgressTime = std::chrono::steady_clock::now();
+    const unsigned long hardTimeoutMs = getNetStallTimeoutMs();
+
+    while (size > 0) {
+        NnSize s = channel->trySend(data, size);
+        if (s == 0) {
+            if (spinAfterProgress(lastProgressTime))
+                continue;
+            long long stallMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lastProgressTime).count();
+            if ((unsigned long)stallMs >= hardTimeoutMs)
+                throw NnTransferSocketException(0, "writeChannel timeout after " + std::to_string(stallMs) + "ms");
+            channel->waitForSpace(SOCKET_POLL_TIMEOUT_MS);
+            continue;
+        }
+        size -= s;
+        data = (const char*)data + s;
+        lastProgressTime = std::chrono::steady_clock::now();
+    }
+}
+
+static bool tryReadChannel(NnSharedMemoryChannel *channel, void *data, NnSize size, unsigned long idleTimeoutMs) {
+    // idleTimeoutMs = 0 means waiting for the first byte without a limit
+    auto lastProgressTime = std::chrono::steady_clock::now();
+    const unsigned long hardTimeoutMs = getNetStallTimeoutMs();
+
+    NnSize s = size;
+    while (s > 0) {
+        NnSize r = channel->tryRecv(data, s);
+        if (r == 0) {
+            if (spinAfterProgress(lastProgressTime))
+                continue;
+            long long stallMs = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lastProgressTime).count();
+            if (s == size && idleTimeoutMs > 0) {
+                if ((unsigned long)stallMs >= idleTimeoutMs)
+                    return false;
+            } else if ((unsigned long)stallMs >= hardTimeoutMs) {
+                throw NnTransferSocketException(0, "tryReadChannel timeout after " + std::to_string(stallMs) + "ms");
+            }
+            channel->waitForData(SOCKET_POLL_TIMEOUT_MS);
+            continue;
+        }
+        data = (char*)data + r;
+        s -= r;
+        lastProgressTime = std::chrono::steady_clock::now();
+    }
+    return true;
+}
+
 static void readAckPacket(int socket) {
     NnUint packet;
     readSocket(socket, &packet, sizeof(packet));
@@ -513,6 +731,61 @@ int NnSocket::release() {
     return fd;
 }
 
+typedef struct {
+    NnUint nodeIndex;
+    NnUint streamIndex;
+} NnStreamHeader;
+
+static inline NnUint getSocketIndexForNode(NnUint myNodeIndex, NnUint peerNode) {
+    // Root (node 0): sockets map directly to workers
+    // socket[0] -> worker 1, socket[1] -> worker 2, etc.
+    if (myNodeIndex == 0) {
+        return peerNode - 1;
+    }
+    
+    // Workers: socket[0] is root, socket[1..n-2] are other workers
+    // When communicating with other workers, skip self
+    if (peerNode == 0) {
+        return 0;  // Root is always socket[0] for workers
+    }
+    
+    // Worker to worker: map peer node to socket index
+    // Socket indices for workers: 0=root, 1=node1, 2=node2, ..., but skip self
+    if (peerNode < myNodeIndex) {
+        return peerNode;  // Peer comes before us in socket array
+    } else {
+        return peerNode - 1;  // Peer comes after us, but we skip ourselves
+    }
+}
+
+// The root waits until every worker has its primary connections, so a connection of an extra stream
+// is never accepted as a primary one. A connection of an extra stream starts with a header, thus
+// the accepting node does not depend on the order of connections.
+static void connectStreams(NnUint nodeIndex, NnUint nNodes, NnUint nStreams, char **hosts, int *ports, int serverSocket, std::vector<NnSocket> *sockets) {
+    const NnUint nSockets = nNodes - 1;
+    for (NnUint streamIndex = 1; streamIndex < nStreams; streamIndex++) {
+        for (NnUint peerIndex = nodeIndex + 1; peerIndex < nNodes; peerIndex++) {
+            NnUint socketIndex = getSocketIndexForNode(nodeIndex, peerIndex);
+            int fd = connectSocket(hosts[socketIndex], ports[socketIndex]);
+            sockets->at(streamIndex * nSockets + socketIndex).assign(fd);
+            NnStreamHeader header = { nodeIndex, streamIndex };
+            writeSocket(fd, &header, sizeof(header));
+        }
+    }
+    const NnUint nAccepts = nodeIndex * (nStreams - 1);
+    for (NnUint i = 0; i < nAccepts; i++) {
+        NnSocket socket(acceptSocket(serverSocket));
+        NnStreamHeader header;
+        readSocket(socket.fd, &header, sizeof(header));
+        if (header.nodeIndex >= nodeIndex || header.streamIndex == 0 || header.streamIndex >= nStreams)
+            throw std::runtime_error("Invalid stream header");
+        NnUint socketIndex = getSocketIndexForNode(nodeIndex, header.nodeIndex);
+        sockets->at(header.streamIndex * nSockets + socketIndex).assign(socket.release());
+    }
+    if (nStreams > 1)
+        printf("⭕ Node[%d]: %d streams per peer\n", nodeIndex, nStreams);
+}
+
 std::unique_ptr<NnNetwork> NnNetwork::serve(int port) {
     NnSocket socketSocket(createServerSocket(port));
     printf("DEBUG: socketSocket.fd = %d\n", socketSocket.fd);
@@ -528,9 +801,13 @@ std::unique_ptr<NnNetwork> NnNetwork::serve(int port) {
     printf("⭕ nNodes: %d\n", nNodes);
     readSocket(rootSocketFd, &nodeIndex, sizeof(nodeIndex)); // receive this worker's node index
     printf("⭕ NodeIndex: %d\n", nodeIndex);
+    NnUint nStreams;
+    readSocket(rootSocketFd, &nStreams, sizeof(nStreams)); // receive the number of streams per peer
+    NnUint isLocal;
+    readSocket(rootSocketFd, &isLocal, sizeof(isLocal)); // receive whether this worker runs on the host of the root
     nSockets = nNodes - 1;
 
-    std::vector<NnSocket> sockets(nSockets);
+    std::vector<NnSocket> sockets(nSockets * nStreams);
     sockets[0].assign(rootSocket.release());
 
     printf("⭕ Socket[0]: accepted root node\n");
@@ -559,13 +836,18 @@ std::unique_ptr<NnNetwork> NnNetwork::serve(int port) {
     readAckPacket(rootSocketFd);
     printf("⭕ Worker[%d]: root-ready ACK received\n", nodeIndex);
 
+    // Two workers share memory when both run on the host of the root
+    std::vector<bool> isLocalSocket(nSockets, false);
+    isLocalSocket[0] = isLocal != 0;
     for (NnUint i = 0; i < nOtherWorkers; i++) {
-        char *host = hosts[i].get();
+        bool isLocalHost = isSharedMemoryAddress(hosts[i].get());
+        char *host = (char *)stripSharedMemoryScheme(hosts[i].get());
         int port = ports[i];
         // Calculate actual worker's node index from hosts array index
         NnUint otherWorkerIndex = (i < nodeIndex - 1) ? (i + 1) : (i + 2);
         NnUint socketIndex = otherWorkerIndex < nodeIndex ? otherWorkerIndex : (otherWorkerIndex - 1);
         printf("⭕ Worker[%d]: peer node=%d mapped to socketIndex=%d\n", nodeIndex, otherWorkerIndex, socketIndex);
+        isLocalSocket[socketIndex] = isLocal != 0 && isLocalHost;
         if (otherWorkerIndex < nodeIndex) {
             // Lower-indexed workers are already listening
             printf("⭕ Socket[%d]: wait for %s:%d worker\n", socketIndex, host, port);
@@ -579,17 +861,43 @@ std::unique_ptr<NnNetwork> NnNetwork::serve(int port) {
         }
     }
 
+    if (nStreams > 1) {
+        // Hosts and ports indexed by the socket index, the socket 0 is the root and it is never connected by a worker
+        std::vector<char *> socketHosts(nSockets, nullptr);
+        std::vector<int> socketPorts(nSockets, 0);
+        for (NnUint i = 0; i < nOtherWorkers; i++) {
+            NnUint otherWorkerIndex = (i < nodeIndex - 1) ? (i + 1) : (i + 2);
+            NnUint socketIndex = otherWorkerIndex < nodeIndex ? otherWorkerIndex : (otherWorkerIndex - 1);
+            socketHosts[socketIndex] = (char *)stripSharedMemoryScheme(hosts[i].get());
+            socketPorts[socketIndex] = ports[i];
+        }
+        writeAckPacket(sockets[0].fd);
+        readAckPacket(sockets[0].fd);
+        connectStreams(nodeIndex, nNodes, nStreams, socketHosts.data(), socketPorts.data(), socketSocket.fd, &sockets);
+    }
+
+    std::unique_ptr<NnNetwork> network(new NnNetwork(&sockets, nStreams));
+    network->attachSharedMemory(nodeIndex, isLocalSocket);
     printf("⭕ Network is initialized\n");
-    return std::unique_ptr<NnNetwork>(new NnNetwork(&sockets));
+    return network;
 }
 
-std::unique_ptr<NnNetwork> NnNetwork::connect(NnUint nSockets, char **hosts, NnUint *ports) {
+std::unique_ptr<NnNetwork> NnNetwork::connect(NnUint nSockets, char **hosts, NnUint *ports, NnUint nStreams) {
     assert(nSockets > 0);
+    assert(nStreams > 0);
     NnUint nNodes = nSockets + 1; // +1 for root node
 
+    // A worker with the shared memory scheme runs on this host, the TCP connection is used only for the handshake
+    std::vector<char *> socketHosts(nSockets);
+    std::vector<bool> isLocalSocket(nSockets);
+    for (NnUint i = 0; i < nSockets; i++) {
+        socketHosts[i] = (char *)stripSharedMemoryScheme(hosts[i]);
+        isLocalSocket[i] = isSharedMemoryAddress(hosts[i]);
+    }
+
     std::set<std::string> seenEndpoints;
     for (NnUint i = 0; i < nSockets; i++) {
-        std::string endpoint = std::string(hosts[i]) + ":" + std::to_string(ports[i]);
+        std::string endpoint = std::string(socketHosts[i]) + ":" + std::to_string(ports[i]);
         if (!seenEndpoints.insert(endpoint).second) {
             throw std::runtime_error(
                 "Duplicate worker endpoint detected: " + endpoint +
@@ -599,15 +907,18 @@ std::unique_ptr<NnNetwork> NnNetwork::connect(NnUint nSockets, char **hosts, NnU
 
     printf("⭕ Root expects %d workers\n", nSockets);
 
-    std::vector<NnSocket> sockets(nSockets);
+    std::vector<NnSocket> sockets(nSockets * nStreams);
     struct sockaddr_in addr;
     for (NnUint i = 0; i < nSockets; i++) {
         printf("⭕ Socket[%d]: connecting to %s:%d worker\n", i, hosts[i], ports[i]);
-        int fd = connectSocket(hosts[i], ports[i]);
+        int fd = connectSocket(socketHosts[i], ports[i]);
         sockets[i].assign(fd);
         writeSocket(fd, &nNodes, sizeof(nNodes)); // send total nodes
         NnUint nodeIndex = i + 1; // worker node index (root is 0)
         writeSocket(fd, &nodeIndex, sizeof(nodeIndex)); // send worker's node index
+        writeSocket(fd, &nStreams, sizeof(nStreams)); // send the number of streams per peer
+        NnUint isLocal = isLocalSocket[i] ? 1 : 0;
+        writeSocket(fd, &isLocal, sizeof(isLocal)); // send whether the worker runs on this host
         for (NnUint j = 0; j < nSockets; j++) {
             if (j == i)
                 continue;
@@ -624,47 +935,131 @@ std::unique_ptr<NnNetwork> NnNetwork::connect(NnUint nSockets, char **hosts, NnU
     for (NnUint i = 0; i < nSockets; i++) {
         writeAckPacket(sockets[i].fd);
     }
+    if (nStreams > 1) {
+        for (NnUint i = 0; i < nSockets; i++)
+            readAckPacket(sockets[i].fd);
+        for (NnUint i = 0; i < nSockets; i++)
+            writeAckPacket(sockets[i].fd);
+        std::vector<int> socketPorts(ports, ports + nSockets);
+        connectStreams(0, nNodes, nStreams, socketHosts.data(), socketPorts.data(), -1, &sockets);
+    }
+    std::unique_ptr<NnNetwork> network(new NnNetwork(&sockets, nStreams));
+    network->attachSharedMemory(0, isLocalSocket);
     printf("⭕ Network is initialized\n");
-    return std::unique_ptr<NnNetwork>(new NnNetwork(&sockets));
-}
-
-NnNetwork::NnNetwork(std::vector<NnSocket> *sockets) {
-    this->nSockets = sockets->size();
-    this->sockets = new int[nSockets];
-    for (NnUint i = 0; i < nSockets; i++)
+    return network;
+}
+
+NnNetwork::NnNetwork(std::vector<NnSocket> *sockets, NnUint nStreams) {
+    assert(nStreams > 0 && sockets->size() % nStreams == 0);
+    const NnUint nTotalSockets = sockets->size();
+    this->nSockets = nTotalSockets / nStreams;
+    this->nStreams = nStreams;
+    this->sockets = new int[nTotalSockets];
+    this->isZeroCopy = false;
+    this->channels = new NnSharedMemoryChannel*[nTotalSockets];
+    for (NnUint i = 0; i < nTotalSockets; i++) {
         this->sockets[i] = sockets->at(i).release();
-    this->sentBytes = new NnSize[nSockets];
-    this->recvBytes = new NnSize[nSockets];
-    this->socketStats = new NnSocketPerformanceStats[nSockets];
+        this->channels[i] = nullptr;
+    }
+    this->sentBytes = new NnSize[nTotalSockets];
+    this->recvBytes = new NnSize[nTotalSockets];
+    this->socketStats = new NnSocketPerformanceStats[nTotalSockets];
 }
 
 NnNetwork::~NnNetwork() {
     delete[] sentBytes;
     delete[] recvBytes;
     delete[] socketStats;
-    for (NnUint i = 0; i < nSockets; i++)
+    for (NnUint i = 0; i < nSockets * nStreams; i++) {
+        delete channels[i];
         destroySocket(sockets[i]);
+    }
+    delete[] channels;
     delete[] sockets;
     printf("⭕ Network is closed\n");
 }
 
+// Every stream of a local peer gets its own channel. The lower node creates the segment and sends
+// its name, the higher node opens it and confirms, then the name is unlinked, so a crashed node
+// does not leave the segment behind. Names are small, so the writes of a phase do not block.
+void NnNetwork::attachSharedMemory(NnUint nodeIndex, const std::vector<bool> &isLocalSocket) {
+    assert(isLocalSocket.size() == nSockets);
+    NnUint nChannels = 0;
+    for (NnUint phase = 0; phase < 3; phase++) {
+        for (NnUint socketIndex = 0; socketIndex < nSockets; socketIndex++) {
+            if (!isLocalSocket[socketIndex])
+                continue;
+            NnUint peerIndex = nodeIndex == 0
+                ? socketIndex + 1
+                : (socketIndex == 0 ? 0 : (socketIndex < nodeIndex ? socketIndex : socketIndex + 1));
+            bool isCreator = nodeIndex < peerIndex;
+            for (NnUint streamIndex = 0; streamIndex < nStreams; streamIndex++) {
+                NnUint i = streamIndex * nSockets + socketIndex;
+                if (phase == 0 && isCreator) {
+                    channels[i] = NnSharedMemoryChannel::create();
+                    NnUint nameLen = std::strlen(channels[i]->getName()) + 1;
+                    writeSocket(sockets[i], &nameLen, sizeof(nameLen));
+                    writeSocket(sockets[i], channels[i]->getName(), nameLen);
+                } else if (phase == 1 && !isCreator) {
+                    NnUint nameLen;
+                    readSocket(sockets[i], &nameLen, sizeof(nameLen));
+                    std::vector<char> name(nameLen);
+                    readSocket(sockets[i], name.data(), nameLen);
+                    if (nameLen == 0 || name[nameLen - 1] != '\0')
+                        throw std::runtime_error("Invalid shared memory name");
+                    channels[i] = NnSharedMemoryChannel::open(name.data());
+                    writeAckPacket(sockets[i]);
+                    nChannels++;
+                } else if (phase == 2 && isCreator) {
+                    readAckPacket(sockets[i]);
+                    channels[i]->unlink();
+                    nChannels++;
+                }
+            }
+        }
+    }
+    if (nChannels > 0)
+        printf("⭕ Node[%d]: %d shared memory channels\n", nodeIndex, nChannels);
+}
+
 void NnNetwork::setTurbo(bool enabled) {
-    for (NnUint i = 0; i < nSockets; i++) {
+    for (NnUint i = 0; i < nSockets * nStreams; i++) {
         ::setNonBlocking(sockets[i], enabled);
     }
 }
 
+void NnNetwork::setZeroCopy(bool enabled) {
+#ifdef NN_ZEROCOPY
+    int value = enabled ? 1 : 0;
+    for (NnUint i = 0; i < nSockets * nStreams; i++) {
+        if (setsockopt(sockets[i], SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(value)) < 0) {
+            printf("⚠️ Zero-copy sends are not supported: %s\n", strerror(errno));
+            isZeroCopy = false;
+            return;
+        }
+    }
+    isZeroCopy = enabled;
+#else
+    if (enabled)
+        printf("⚠️ Zero-copy sends are not supported on this platform\n");
+#endif
+}
+
 void NnNetwork::write(const NnUint socketIndex, const void *data, const NnSize size) {
-    assert(socketIndex < nSockets);
+    assert(socketIndex < nSockets * nStreams);
 
     auto startTime = std::chrono::high_resolution_clock::now();
     
-    NnByte *current = (NnByte *)data;
-    int s = sockets[socketIndex];
-    for (NnSize chunk = 0; chunk < size; chunk += MAX_CHUNK_SIZE) {
-        NnSize chunkSize = chunk + MAX_CHUNK_SIZE < size ? MAX_CHUNK_SIZE : size - chunk;
-        writeSocket(s, current, chunkSize);
-        current += chunkSize;
+    if (channels[socketIndex] != nullptr) {
+        writeChannel(channels[socketIndex], data, size);
+    } else {
+        NnByte *current = (NnByte *)data;
+        int s = sockets[socketIndex];
+        for (NnSize chunk = 0; chunk < size; chunk += MAX_CHUNK_SIZE) {
+            NnSize chunkSize = chunk + MAX_CHUNK_SIZE < size ? MAX_CHUNK_SIZE : size - chunk;
+            writeSocket(s, current, chunkSize);
+            current += chunkSize;
+        }
     }
     sentBytes[socketIndex] += size;
     
@@ -673,16 +1068,21 @@ void NnNetwork::write(const NnUint socketIndex, const void *data, const NnSize s
 }
 
 void NnNetwork::read(const NnUint socketIndex, void *data, const NnSize size) {
-    assert(socketIndex < nSockets);
+    assert(socketIndex < nSockets * nStreams);
 
     auto startTime = std::chrono::high_resolution_clock::now();
     
-    NnByte *current = (NnByte *)data;
-    int s = sockets[socketIndex];
-    for (NnSize chunk = 0; chunk < size; chunk += MAX_CHUNK_SIZE) {
-        NnSize chunkSize = chunk + MAX_CHUNK_SIZE < size ? MAX_CHUNK_SIZE : size - chunk;
-        readSocket(s, current, chunkSize);
-        current += chunkSize;
+    if (channels[socketIndex] != nullptr) {
+        if (!tryReadChannel(channels[socketIndex], data, size, 0))
+            throw std::runtime_error("Error reading from shared memory");
+    } else {
+        NnByte *current = (NnByte *)data;
+        int s = sockets[socketIndex];
+        for (NnSize chunk = 0; chunk < size; chunk += MAX_CHUNK_SIZE) {
+            NnSize chunkSize = chunk + MAX_CHUNK_SIZE < size ? MAX_CHUNK_SIZE : size - chunk;
+            readSocket(s, current, chunkSize);
+            current += chunkSize;
+        }
     }
     recvBytes[socketIndex] += size;
     
@@ -690,19 +1090,74 @@ void NnNetwork::read(const NnUint socketIndex, void *data, const NnSize size) {
     recordOperation("read", socketIndex, size, startTime, endTime);
 }
 
+void NnNetwork::writeVector(const NnUint socketIndex, NnUint n, const NnSocketBuffer *buffers) {
+    assert(socketIndex < nSockets * nStreams);
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    NnSize size = 0;
+    for (NnUint i = 0; i < n; i++)
+        size += buffers[i].size;
+    if (channels[socketIndex] != nullptr) {
+        for (NnUint i = 0; i < n; i++)
+            writeChannel(channels[socketIndex], buffers[i].data, buffers[i].size);
+    } else {
+#ifdef _WIN32
+        for (NnUint i = 0; i < n; i++)
+            writeSocket(sockets[socketIndex], buffers[i].data, buffers[i].size);
+#else
+        std::vector<struct iovec> iov(n);
+        for (NnUint i = 0; i < n; i++) {
+            iov[i].iov_base = (void *)buffers[i].data;
+            iov[i].iov_len = buffers[i].size;
+        }
+        int flags = 0;
+#ifdef NN_ZEROCOPY
+        if (isZeroCopy && size >= ZEROCOPY_MIN_BYTES)
+            flags |= MSG_ZEROCOPY;
+#endif
+        NnUint nZeroCopyCalls = writeSocketVector(sockets[socketIndex], iov.data(), (int)n, flags);
+#ifdef NN_ZEROCOPY
+        if (nZeroCopyCalls > 0)
+            waitZeroCopy(sockets[socketIndex], nZeroCopyCalls);
+#else
+        (void)nZeroCopyCalls;
+#endif
+#endif
+    }
+    sentBytes[socketIndex] += size;
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+    recordOperation("write", socketIndex, size, startTime, endTime);
+}
+
 void NnNetwork::writeAck(const NnUint socketIndex) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
+    if (channels[socketIndex] != nullptr) {
+        NnUint packet = ACK;
+        writeChannel(channels[socketIndex], &packet, sizeof(packet));
+        return;
+    }
     writeAckPacket(sockets[socketIndex]);
 }
 
 void NnNetwork::readAck(const NnUint socketIndex) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
+    if (channels[socketIndex] != nullptr) {
+        NnUint packet;
+        if (!tryReadChannel(channels[socketIndex], &packet, sizeof(packet), 0) || packet != ACK)
+            throw std::runtime_error("Invalid ack packet");
+        return;
+    }
     readAckPacket(sockets[socketIndex]);
 }
 
-bool NnNetwork::tryReadWithMaxAttempts(NnUint socketIndex, void *data, NnSize size, unsigned long maxAttempts) {
+bool NnNetwork::tryReadWithTimeout(NnUint socketIndex, void *data, NnSize size, unsigned long idleTimeoutMs) {
     assert(socketIndex >= 0 && socketIndex < nSockets);
-    if (tryReadSocket(sockets[socketIndex], data, size, maxAttempts)) {
+    bool isRead = channels[socketIndex] != nullptr
+        ? tryReadChannel(channels[socketIndex], data, size, idleTimeoutMs)
+        : tryReadSocket(sockets[socketIndex], data, size, idleTimeoutMs);
+    if (isRead) {
         recvBytes[socketIndex] += size;
         return true;
     }
@@ -718,7 +1173,7 @@ void NnNetwork::writeMany(NnUint n, NnSocketIo *ios) {
 
     for (NnUint i = 0; i < n; i++) {
         NnSocketIo *io = &ios[i];
-        assert(io->socketIndex < nSockets);
+        assert(io->socketIndex < nSockets * nStreams);
         sentBytes[io->socketIndex] += io->size;
     }
     do {
@@ -730,9 +1185,17 @@ void NnNetwork::writeMany(NnUint n, NnSocketIo *ios) {
             if (io->size > 0) {
                 isWriting = true;
                 pendingBytes += io->size;
-                int socket = sockets[io->socketIndex];
-                ssize_t chunkSize = io->size > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : io->size;
-                ssize_t s = send(socket, (const char*)io->data, chunkSize, NN_SEND_FLAGS);
+                ssize_t s;
+                NnSharedMemoryChannel *channel = channels[io->socketIndex];
+                if (channel != nullptr) {
+                    s = (ssize_t)channel->trySend(io->data, io->size);
+                    if (s == 0)
+                        continue;
+                } else {
+                    int socket = sockets[io->socketIndex];
+                    ssize_t chunkSize = io->size > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : io->size;
+                    s = send(socket, (const char*)io->data, chunkSize, NN_SEND_FLAGS);
+                }
                 if (s < 0) {
                     if (isEagainError()) {
                         continue;
@@ -771,13 +1234,38 @@ void NnNetwork::writeMany(NnUint n, NnSocketIo *ios) {
                 fflush(stdout);
                 lastLogTime = now;
             }
-            sleepOnSocketRetry();
+            waitForIos(n, ios, true, lastProgressTime);
         } else if (hasProgress) {
             lastProgressTime = std::chrono::steady_clock::now();
         }
     } while (isWriting);
 }
 
+// Sockets are waited in poll. A shared memory channel has no descriptor, so the wait sleeps on the first
+// pending channel and returns soon when other transfers are pending too.
+void NnNetwork::waitForIos(NnUint n, const NnSocketIo *ios, bool isWriting, std::chrono::steady_clock::time_point lastProgressTime) {
+    NnSharedMemoryChannel *channel = nullptr;
+    NnUint nPending = 0;
+    for (NnUint i = 0; i < n; i++) {
+        if (ios[i].size == 0)
+            continue;
+        nPending++;
+        if (channel == nullptr)
+            channel = channels[ios[i].socketIndex];
+    }
+    if (channel == nullptr) {
+        ::waitForIos(sockets, n, ios, isWriting ? POLLOUT : POLLIN, lastProgressTime);
+        return;
+    }
+    if (spinAfterProgress(lastProgressTime))
+        return;
+    const int timeoutMs = nPending > 1 ? 1 : SOCKET_POLL_TIMEOUT_MS;
+    if (isWriting)
+        channel->waitForSpace(timeoutMs);
+    else
+        channel->waitForData(timeoutMs);
+}
+
 void NnNetwork::writeAll(void *data, NnSize size) {
     std::vector<NnSocketIo> ios(nSockets);
     for (NnUint i = 0; i < nSockets; i++) {
@@ -800,7 +1288,7 @@ void NnNetwork::readMany(NnUint n, NnSocketIo *ios) {
     NnSize nBytes = 0;
     for (NnUint i = 0; i < n; i++) {
         NnSocketIo *io = &ios[i];
-        assert(io->socketIndex < nSockets);
+        assert(io->socketIndex < nSockets * nStreams);
         recvBytes[io->socketIndex] += io->size;
         nBytes += io->size;
     }
@@ -813,8 +1301,16 @@ void NnNetwork::readMany(NnUint n, NnSocketIo *ios) {
             if (io->size > 0) {
                 isReading = true;
                 pendingBytes += io->size;
-                int socket = sockets[io->socketIndex];
-                ssize_t r = recv(socket, (char*)io->data, io->size, 0);
+                ssize_t r;
+                NnSharedMemoryChannel *channel = channels[io->socketIndex];
+                if (channel != nullptr) {
+                    r = (ssize_t)channel->tryRecv((char*)io->data, io->size);
+                    if (r == 0)
+                        continue;
+                } else {
+                    int socket = sockets[io->socketIndex];
+                    r = recv(socket, (char*)io->data, io->size, 0);
+                }
                 if (r < 0) {
                     if (isEagainError()) {
                         continue;
@@ -853,7 +1349,7 @@ void NnNetwork::readMany(NnUint n, NnSocketIo *ios) {
                 fflush(stdout);
                 lastLogTime = now;
             }
-            sleepOnSocketRetry();
+            waitForIos(n, ios, false, lastProgressTime);
         } else if (hasProgress) {
             lastProgressTime = std::chrono::steady_clock::now();
         }
@@ -866,7 +1362,7 @@ void NnNetwork::readMany(NnUint n, NnSocketIo *ios) {
 void NnNetwork::getStats(NnSize *sentBytes, NnSize *recvBytes) {
     *sentBytes = 0;
     *recvBytes = 0;
-    for (NnUint i = 0; i < nSockets; i++) {
+    for (NnUint i = 0; i < nSockets * nStreams; i++) {
         *sentBytes += this->sentBytes[i];
         *recvBytes += this->recvBytes[i];
     }
@@ -874,7 +1370,7 @@ void NnNetwork::getStats(NnSize *sentBytes, NnSize *recvBytes) {
 }
 
 void NnNetwork::resetStats() {
-    for (NnUint i = 0; i < nSockets; i++) {
+    for (NnUint i = 0; i < nSockets * nStreams; i++) {
         sentBytes[i] = 0;
         recvBytes[i] = 0;
     }
@@ -907,7 +1403,7 @@ void NnNetwork::recordOperation(const std::string& operationType, NnUint socketI
     updateSocketStats(socketIndex, latencyMs, bytes);
     
     // Store recent metrics for analysis (thread-safe with size limit)
-    if (socketIndex < nSockets) {  // Safety check
+    if (socketIndex < nSockets * nStreams) {  // Safety check
         NnNetworkMetrics metric;
         metric.startTime = start;
         metric.endTime = end;
@@ -923,7 +1419,7 @@ void NnNetwork::recordOperation(const std::string& operationType, NnUint socketI
 }
 
 void NnNetwork::updateSocketStats(NnUint socketIndex, double latencyMs, NnSize bytes) {
-    if (socketIndex >= nSockets || !socketStats) return;
+    if (socketIndex >= nSockets * nStreams || !socketStats) return;
     
     NnSocketPerformanceStats& stats = socketStats[socketIndex];
     
@@ -1052,11 +1548,12 @@ NnSocketPerformanceStats* NnNetwork::getSocketStats(NnUint socketIndex) {
     return &socketStats[socketIndex];
 }
 
-static void syncWithRoot(NnNetwork *network, NnByte nodeIndex, NnByte *buffer, NnSize nBytes, NnUint nThreads, NnUint threadIndex) {
+static void syncWithRoot(NnNetwork *network, NnByte nodeIndex, NnUint tpGroupEnd, NnByte *buffer, NnSize nBytes, NnUint nThreads, NnUint threadIndex) {
     if (nodeIndex == 0) {
-        // root
+        // root, sends only to the workers of its tensor parallel group
 
-        NnUint nSocketsPerThread = network->nSockets / nThreads + (network->nSockets % nThreads > threadIndex ? 1 : 0);
+        NnUint nSockets = tpGroupEnd - 1;
+        NnUint nSocketsPerThread = nSockets / nThreads + (nSockets % nThreads > threadIndex ? 1 : 0);
         if (nSocketsPerThread == 0) return;
 
         std::vector<NnSocketIo> ios(nSocketsPerThread);
@@ -1114,28 +1611,6 @@ static void syncNodeSlices_alltoall(bool onlyFromWorkerToRoot, NnNetwork *networ
     }
 }
 
-static inline NnUint getSocketIndexForNode(NnUint myNodeIndex, NnUint peerNode) {
-    // Root (node 0): sockets map directly to workers
-    // socket[0] -> worker 1, socket[1] -> worker 2, etc.
-    if (myNodeIndex == 0) {
-        return peerNode - 1;
-    }
-    
-    // Workers: socket[0] is root, socket[1..n-2] are other workers
-    // When communicating with other workers, skip self
-    if (peerNode == 0) {
-        return 0;  // Root is always socket[0] for workers
-    }
-    
-    // Worker to worker: map peer node to socket index
-    // Socket indices for workers: 0=root, 1=node1, 2=node2, ..., but skip self
-    if (peerNode < myNodeIndex) {
-        return peerNode;  // Peer comes before us in socket array
-    } else {
-        return peerNode - 1;  // Peer comes after us, but we skip ourselves
-    }
-}
-
 static void ringAllGather(NnNetwork *network, NnUint nodeIndex, NnUint nNodes, NnByte *buffer, NnSize sliceBytes, NnUint nThreads, NnUint threadIndex) {
     if (threadIndex != 0) return;
 
@@ -1169,40 +1644,41 @@ static void ringAllGather(NnNetwork *network, NnUint nodeIndex, NnUint nNodes, N
     }
 }
 
-static void binaryTreeBroadcast(NnNetwork *network, NnUint nodeIndex, NnUint nNodes, NnByte *buffer, NnSize nBytes, NnUint nThreads, NnUint threadIndex) {
-    if (threadIndex != 0) return;
-
+// Binomial tree over the nodes of the TP group, the first node of the group is the root of the tree.
+// At the level `l` a node with the local index `i % 2^(l+1) == 2^l` is a child of the node `i - 2^l`.
+static inline NnUint getTreeDepth(NnUint nNodes) {
     NnUint treeDepth = 0;
     NnUint temp = nNodes - 1;
     while (temp > 0) {
         treeDepth++;
         temp >>= 1;
     }
+    return treeDepth;
+}
 
-    for (NnUint level = 0; level < treeDepth; level++) {
+static void binaryTreeBroadcast(NnNetwork *network, NnUint nodeIndex, NnUint tpGroupStart, NnUint nNodes, NnByte *buffer, NnSize nBytes, NnUint nThreads, NnUint threadIndex) {
+    if (threadIndex != 0) return;
+
+    NnUint localNodeIndex = nodeIndex - tpGroupStart;
+    NnUint treeDepth = getTreeDepth(nNodes);
+
+    // The root sends to the farthest child first, so a child has the buffer before it sends it to its own children
+    for (NnUint level = treeDepth; level-- > 0;) {
         NnUint step = 1 << level;
         NnUint stride = step << 1;
 
-        if (nodeIndex % stride == step && nodeIndex < nNodes) {
-            NnUint parentNode = nodeIndex - step;
-            if (parentNode < nNodes) {
-                NnUint socketIndex = getSocketIndexForNode(nodeIndex, parentNode);
-                NnSocketIo io;
-                io.socketIndex = socketIndex;
-                io.data = buffer;
-                io.size = nBytes;
-                network->readMany(1, &io);
-            }
-        } else if (nodeIndex % stride == 0 && nodeIndex + step < nNodes) {
-            NnUint childNode = nodeIndex + step;
-            if (childNode < nNodes) {
-                NnUint socketIndex = getSocketIndexForNode(nodeIndex, childNode);
-                NnSocketIo io;
-                io.socketIndex = socketIndex;
-                io.data = buffer;
-                io.size = nBytes;
-                network->writeMany(1, &io);
-            }
+        if (localNodeIndex % stride == step) {
+            NnSocketIo io;
+            io.socketIndex = getSocketIndexForNode(nodeIndex, tpGroupStart + localNodeIndex - step);
+            io.data = buffer;
+            io.size = nBytes;
+            network->readMany(1, &io);
+        } else if (localNodeIndex % stride == 0 && localNodeIndex + step < nNodes) {
+            NnSocketIo io;
+            io.socketIndex = getSocketIndexForNode(nodeIndex, tpGroupStart + localNodeIndex + step);
+            io.data = buffer;
+            io.size = nBytes;
+            network->writeMany(1, &io);
         }
     }
 }
@@ -1289,61 +1765,78 @@ static void reduceSum(NnByte *result, const NnByte *input, NnSize nBytes, NnFloa
     }
 }
 
-static void syncNodeSlices_ringAllReduce(bool onlyFromWorkerToRoot,
-                                         NnNetwork *network,
-                                         NnUint nodeIndex,
-                                         NnUint tpGroupStart,
-                                         NnUint tpGroupEnd,
-                                         NnByte *buffer,
-                                         NnSize nBytes,
-                                         NnFloatType floatType,
-                                         NnUint nThreads,
-                                         NnUint threadIndex) {
-    if (threadIndex != 0) return;  // Only thread 0 handles ring communication
-
-    NnUint nNodes = tpGroupEnd - tpGroupStart;
-    if (nNodes <= 1) return;
+static inline NnSize getRingElementBytes(NnFloatType floatType) {
+    if (floatType == F_32) return sizeof(float);
+    if (floatType == F_16) return sizeof(NnFp16);
+    return 1;
+}
+
+// Splits `nBytes` into `nSlices` contiguous chunks whose boundaries never cut an element.
+// The first `nElements % nSlices` chunks get one extra element, so the whole buffer is covered.
+static inline void getRingSlice(NnSize nBytes, NnUint nSlices, NnUint sliceIndex, NnSize elementBytes, NnSize *offset, NnSize *size) {
+    NnSize nElements = nBytes / elementBytes;
+    NnSize base = nElements / nSlices;
+    NnSize rest = nElements % nSlices;
+    NnSize start = sliceIndex * base + (sliceIndex < rest ? sliceIndex : rest);
+    NnSize count = base + (sliceIndex < rest ? 1 : 0);
+    *offset = start * elementBytes;
+    *size = count * elementBytes;
+    if (sliceIndex == nSlices - 1)
+        *size = nBytes - *offset;
+}
+
+// Runs the ring over the nodes of the TP group in the order of positions, a reversed ring sends to the previous node.
+static void ringAllReduce(bool onlyReduceScatter,
+                          NnNetwork *network,
+                          NnUint nodeIndex,
+                          NnUint tpGroupStart,
+                          NnUint nNodes,
+                          NnByte *buffer,
+                          NnSize nBytes,
+                          NnFloatType floatType,
+                          NnUint streamIndex,
+                          bool isReversed) {
     NnUint localNodeIndex = nodeIndex - tpGroupStart;
-    NnSize sliceBytes = nBytes / nNodes;
-
-    // Ring topology: each node sends to next and receives from previous
-    NnUint sendToNode = tpGroupStart + ((localNodeIndex + 1) % nNodes);
-    NnUint recvFromNode = tpGroupStart + ((localNodeIndex + nNodes - 1) % nNodes);
+    NnUint position = isReversed ? (nNodes - localNodeIndex) % nNodes : localNodeIndex;
+    NnUint nextPosition = (position + 1) % nNodes;
+    NnUint prevPosition = (position + nNodes - 1) % nNodes;
+    NnUint sendToNode = tpGroupStart + (isReversed ? (nNodes - nextPosition) % nNodes : nextPosition);
+    NnUint recvFromNode = tpGroupStart + (isReversed ? (nNodes - prevPosition) % nNodes : prevPosition);
 
-    NnUint sendSocketIndex = getSocketIndexForNode(nodeIndex, sendToNode);
-    NnUint recvSocketIndex = getSocketIndexForNode(nodeIndex, recvFromNode);
+    NnUint sendSocketIndex = streamIndex * network->nSockets + getSocketIndexForNode(nodeIndex, sendToNode);
+    NnUint recvSocketIndex = streamIndex * network->nSockets + getSocketIndexForNode(nodeIndex, recvFromNode);
+    NnSize elementBytes = getRingElementBytes(floatType);
+    NnSize maxSliceBytes = (nBytes / elementBytes / nNodes + 1) * elementBytes;
 
     // ========== PHASE 1: REDUCE-SCATTER ==========
-    // Use thread_local vector for safe automatic memory management
-    // This avoids stack overflow and manual memory management issues
+    // Every sub-ring runs on its own thread, so the receive buffer is per thread
     static thread_local std::vector<NnByte> tempBuffer;
-    if (tempBuffer.size() < sliceBytes) {
-        tempBuffer.reserve(sliceBytes);
-        tempBuffer.resize(sliceBytes, 0);
+    if (tempBuffer.size() < maxSliceBytes) {
+        tempBuffer.resize(maxSliceBytes, 0);
     }
     NnByte* tempBuffer_ptr = tempBuffer.data();
     
     // In n-1 steps, each node accumulates one chunk through reduction
     for (NnUint step = 0; step < nNodes - 1; step++) {
         // Determine which chunk to send and where to receive
-        NnUint sendChunkIndex = (localNodeIndex - step + nNodes) % nNodes;
-        NnUint recvChunkIndex = (localNodeIndex - step - 1 + nNodes) % nNodes;
+        NnUint sendChunkIndex = (position - step + nNodes) % nNodes;
+        NnUint recvChunkIndex = (position - step - 1 + nNodes) % nNodes;
+        NnSize sendOffset, sendSize, recvOffset, recvSize;
+        getRingSlice(nBytes, nNodes, sendChunkIndex, elementBytes, &sendOffset, &sendSize);
+        getRingSlice(nBytes, nNodes, recvChunkIndex, elementBytes, &recvOffset, &recvSize);
 
         NnSocketIo sendIo, recvIo;
         
-        // Use pre-allocated buffer
-        NnByte* alignedBuffer = tempBuffer_ptr;
-        
         sendIo.socketIndex = sendSocketIndex;
-        sendIo.data = &buffer[sliceBytes * sendChunkIndex];
-        sendIo.size = sliceBytes;
+        sendIo.data = &buffer[sendOffset];
+        sendIo.size = sendSize;
         
         recvIo.socketIndex = recvSocketIndex;
-        recvIo.data = alignedBuffer;
-        recvIo.size = sliceBytes;
+        recvIo.data = tempBuffer_ptr;
+        recvIo.size = recvSize;
         
         // Even nodes send first, odd nodes receive first (avoid deadlock)
-        if (localNodeIndex % 2 == 0) {
+        if (position % 2 == 0) {
             network->writeMany(1, &sendIo);
             network->readMany(1, &recvIo);
         } else {
@@ -1352,36 +1845,36 @@ static void syncNodeSlices_ringAllReduce(bool onlyFromWorkerToRoot,
         }
         
         // Reduce: add received chunk to corresponding local chunk
-        // Ensure we don't write beyond buffer bounds
-        if (sliceBytes * recvChunkIndex + sliceBytes <= nBytes) {
-            reduceSum(&buffer[sliceBytes * recvChunkIndex], alignedBuffer, sliceBytes, floatType);
-        }
+        reduceSum(&buffer[recvOffset], tempBuffer_ptr, recvSize, floatType);
     }
     
-    // At this point, each node has one fully reduced chunk
+    // At this point, the node at position `p` has the fully reduced chunk `p + 1`
     
-    if (onlyFromWorkerToRoot) {
-        return;  // If only reduce-scatter needed, we're done
+    if (onlyReduceScatter) {
+        return;
     }
     
     // ========== PHASE 2: ALL-GATHER ==========
-    // In n-1 steps, collect all reduced chunks
+    // In n-1 steps, collect all reduced chunks, every node starts from its reduced chunk
     for (NnUint step = 0; step < nNodes - 1; step++) {
-        NnUint sendChunkIndex = (localNodeIndex - step + nNodes) % nNodes;
-        NnUint recvChunkIndex = (localNodeIndex - step - 1 + nNodes) % nNodes;
+        NnUint sendChunkIndex = (position - step + 1 + nNodes) % nNodes;
+        NnUint recvChunkIndex = (position - step + nNodes) % nNodes;
+        NnSize sendOffset, sendSize, recvOffset, recvSize;
+        getRingSlice(nBytes, nNodes, sendChunkIndex, elementBytes, &sendOffset, &sendSize);
+        getRingSlice(nBytes, nNodes, recvChunkIndex, elementBytes, &recvOffset, &recvSize);
 
         NnSocketIo sendIo, recvIo;
         
         sendIo.socketIndex = sendSocketIndex;
-        sendIo.data = &buffer[sliceBytes * sendChunkIndex];
-        sendIo.size = sliceBytes;
+        sendIo.data = &buffer[sendOffset];
+        sendIo.size = sendSize;
         
         recvIo.socketIndex = recvSocketIndex;
-        recvIo.data = &buffer[sliceBytes * recvChunkIndex];
-        recvIo.size = sliceBytes;
+        recvIo.data = &buffer[recvOffset];
+        recvIo.size = recvSize;
         
         // Even nodes send first, odd nodes receive first
-        if (localNodeIndex % 2 == 0) {
+        if (position % 2 == 0) {
             network->writeMany(1, &sendIo);
             network->readMany(1, &recvIo);
         } else {
@@ -1393,6 +1886,35 @@ static void syncNodeSlices_ringAllReduce(bool onlyFromWorkerToRoot,
     // Now all nodes have the fully reduced result in all chunks
 }
 
+// The buffer is split into independent sub-rings, one per stream, so reductions and socket I/O of sub-rings run
+// in parallel on executor threads. The split does not depend on the number of threads, nodes may run different
+// numbers of threads. A thread runs its sub-rings in order of streams, thus nodes never wait for each other in a cycle.
+// With more than two nodes every odd sub-ring goes in the reversed direction, so both directions of links are used.
+static void syncNodeSlices_ringAllReduce(bool onlyFromWorkerToRoot,
+                                         NnNetwork *network,
+                                         NnUint nodeIndex,
+                                         NnUint tpGroupStart,
+                                         NnUint tpGroupEnd,
+                                         NnByte *buffer,
+                                         NnSize nBytes,
+                                         NnFloatType floatType,
+                                         NnUint nThreads,
+                                         NnUint threadIndex) {
+    NnUint nNodes = tpGroupEnd - tpGroupStart;
+    if (nNodes <= 1) return;
+    const NnUint nRings = network->nStreams;
+    const NnSize elementBytes = getRingElementBytes(floatType);
+
+    for (NnUint ringIndex = threadIndex; ringIndex < nRings; ringIndex += nThreads) {
+        NnSize ringOffset;
+        NnSize ringBytes;
+        getRingSlice(nBytes, nRings, ringIndex, elementBytes, &ringOffset, &ringBytes);
+        if (ringBytes == 0) continue;
+        ringAllReduce(onlyFromWorkerToRoot, network, nodeIndex, tpGroupStart, nNodes, &buffer[ringOffset], ringBytes, floatType,
+            ringIndex, nNodes > 2 && ringIndex % 2 == 1);
+    }
+}
+
 static void syncNodeSlices_starAllReduce(bool onlyFromWorkerToRoot,
                                          NnNetwork *network,
                                          NnUint nodeIndex,
@@ -1462,6 +1984,184 @@ static void syncNodeSlices_starAllReduce(bool onlyFromWorkerToRoot,
     }
 }
 
+// Reduces the buffers up the binomial tree of `binaryTreeBroadcast` and broadcasts the sum down the same tree.
+// Both phases take ceil(log2 n) hops, every hop carries the whole buffer.
+static void syncNodeSlices_treeAllReduce(bool onlyFromWorkerToRoot,
+                                         NnNetwork *network,
+                                         NnUint nodeIndex,
+                                         NnUint tpGroupStart,
+                                         NnUint tpGroupEnd,
+                                         NnByte *buffer,
+                                         NnSize nBytes,
+                                         NnFloatType floatType,
+                                         NnUint nThreads,
+                                         NnUint threadIndex) {
+    if (threadIndex != 0) return;
+
+    NnUint nNodes = tpGroupEnd - tpGroupStart;
+    if (nNodes <= 1) return;
+    NnUint localNodeIndex = nodeIndex - tpGroupStart;
+    NnUint treeDepth = getTreeDepth(nNodes);
+
+    static thread_local std::vector<NnByte> childBuffer;
+    if (childBuffer.size() < nBytes)
+        childBuffer.resize(nBytes);
+
+    for (NnUint level = 0; level < treeDepth; level++) {
+        NnUint step = 1 << level;
+        NnUint stride = step << 1;
+
+        if (localNodeIndex % stride == step) {
+            // The subtree of this node is reduced, it goes to the parent and the node is done
+            NnSocketIo io;
+            io.socketIndex = getSocketIndexForNode(nodeIndex, tpGroupStart + localNodeIndex - step);
+            io.data = buffer;
+            io.size = nBytes;
+            network->writeMany(1, &io);
+            break;
+        }
+        if (localNodeIndex + step < nNodes) {
+            NnSocketIo io;
+            io.socketIndex = getSocketIndexForNode(nodeIndex, tpGroupStart + localNodeIndex + step);
+            io.data = childBuffer.data();
+            io.size = nBytes;
+            network->readMany(1, &io);
+            reduceSum(buffer, childBuffer.data(), nBytes, floatType);
+        }
+    }
+
+    if (onlyFromWorkerToRoot)
+        return;
+    binaryTreeBroadcast(network, nodeIndex, tpGroupStart, nNodes, buffer, nBytes, nThreads, threadIndex);
+}
+
+// Sends `sendSize` bytes to the peer and receives `recvSize` bytes from it, the lower node sends first
+static inline void exchangeWithPeer(NnNetwork *network, NnUint nodeIndex, NnUint peerNodeIndex,
+                                    const NnByte *sendData, NnSize sendSize, NnByte *recvData, NnSize recvSize) {
+    NnSocketIo sendIo, recvIo;
+    sendIo.socketIndex = getSocketIndexForNode(nodeIndex, peerNodeIndex);
+    sendIo.data = sendData;
+    sendIo.size = sendSize;
+    recvIo.socketIndex = sendIo.socketIndex;
+    recvIo.data = recvData;
+    recvIo.size = recvSize;
+    if (nodeIndex < peerNodeIndex) {
+        network->writeMany(1, &sendIo);
+        network->readMany(1, &recvIo);
+    } else {
+        network->readMany(1, &recvIo);
+        network->writeMany(1, &sendIo);
+    }
+}
+
+// Rabenseifner's all-reduce: reduce-scatter by recursive halving, then all-gather by recursive doubling.
+// Both phases take log2 n hops and the payload halves with every hop of the reduce-scatter.
+// With n not a power of two, the first `2 * (n - 2^k)` nodes fold in pairs before and unfold after.
+static void syncNodeSlices_halvingDoublingAllReduce(NnNetwork *network,
+                                                    NnUint nodeIndex,
+                                                    NnUint tpGroupStart,
+                                                    NnUint tpGroupEnd,
+                                                    NnByte *buffer,
+                                                    NnSize nBytes,
+                                                    NnFloatType floatType,
+                                                    NnUint nThreads,
+                                                    NnUint threadIndex) {
+    if (threadIndex != 0) return;
+
+    NnUint nNodes = tpGroupEnd - tpGroupStart;
+    if (nNodes <= 1) return;
+    NnUint localNodeIndex = nodeIndex - tpGroupStart;
+    NnUint nPow2 = 1;
+    while (nPow2 * 2 <= nNodes)
+        nPow2 *= 2;
+    NnUint nRest = nNodes - nPow2;
+    NnSize elementBytes = getRingElementBytes(floatType);
+
+    static thread_local std::vector<NnByte> recvBuffer;
+    if (recvBuffer.size() < nBytes)
+        recvBuffer.resize(nBytes);
+
+    // Fold: an even node of the first pairs gives its buffer to the odd one and waits for the result
+    if (localNodeIndex < 2 * nRest) {
+        NnUint peerNodeIndex = tpGroupStart + (localNodeIndex ^ 1u);
+        NnSocketIo io;
+        io.socketIndex = getSocketIndexForNode(nodeIndex, peerNodeIndex);
+        if (localNodeIndex % 2 == 0) {
+            io.data = buffer;
+            io.size = nBytes;
+            network->writeMany(1, &io);
+            io.data = buffer;
+            io.size = nBytes;
+            network->readMany(1, &io);
+            return;
+        }
+        io.data = recvBuffer.data();
+        io.size = nBytes;
+        network->readMany(1, &io);
+        reduceSum(buffer, recvBuffer.data(), nBytes, floatType);
+    }
+
+    NnUint rank = localNodeIndex < 2 * nRest ? localNodeIndex / 2 : localNodeIndex - nRest;
+    auto getNodeIndex = [tpGroupStart, nRest](NnUint r) {
+        return tpGroupStart + (r < nRest ? r * 2 + 1 : r + nRest);
+    };
+
+    // The slices [sliceStart, sliceEnd) of `nPow2` slices are owned by this node
+    NnUint sliceStart = 0;
+    NnUint sliceEnd = nPow2;
+    NnSize offset, size;
+
+    for (NnUint mask = nPow2 / 2; mask > 0; mask /= 2) {
+        NnUint peerNodeIndex = getNodeIndex(rank ^ mask);
+        NnUint sliceMiddle = sliceStart + (sliceEnd - sliceStart) / 2;
+        NnSize lowOffset, lowSize, highOffset, highSize, unused;
+        getRingSlice(nBytes, nPow2, sliceStart, elementBytes, &lowOffset, &unused);
+        getRingSlice(nBytes, nPow2, sliceMiddle, elementBytes, &highOffset, &unused);
+        getRingSlice(nBytes, nPow2, sliceEnd - 1, elementBytes, &offset, &size);
+        lowSize = highOffset - lowOffset;
+        highSize = offset + size - highOffset;
+
+        if ((rank & mask) == 0) {
+            exchangeWithPeer(network, nodeIndex, peerNodeIndex, &buffer[highOffset], highSize, recvBuffer.data(), lowSize);
+            reduceSum(&buffer[lowOffset], recvBuffer.data(), lowSize, floatType);
+            sliceEnd = sliceMiddle;
+        } else {
+            exchangeWithPeer(network, nodeIndex, peerNodeIndex, &buffer[lowOffset], lowSize, recvBuffer.data(), highSize);
+            reduceSum(&buffer[highOffset], recvBuffer.data(), highSize, floatType);
+            sliceStart = sliceMiddle;
+        }
+    }
+
+    // Now the node owns the reduced slice `rank`, the peers exchange their reduced ranges
+    for (NnUint mask = 1; mask < nPow2; mask *= 2) {
+        NnUint peerNodeIndex = getNodeIndex(rank ^ mask);
+        NnUint nSlices = sliceEnd - sliceStart;
+        NnUint peerSliceStart = (rank & mask) == 0 ? sliceEnd : sliceStart - nSlices;
+        NnSize myOffset, myEnd, peerOffset, peerEnd;
+        getRingSlice(nBytes, nPow2, sliceStart, elementBytes, &myOffset, &size);
+        getRingSlice(nBytes, nPow2, sliceEnd - 1, elementBytes, &myEnd, &size);
+        myEnd += size;
+        getRingSlice(nBytes, nPow2, peerSliceStart, elementBytes, &peerOffset, &size);
+        getRingSlice(nBytes, nPow2, peerSliceStart + nSlices - 1, elementBytes, &peerEnd, &size);
+        peerEnd += size;
+
+        exchangeWithPeer(network, nodeIndex, peerNodeIndex, &buffer[myOffset], myEnd - myOffset, &buffer[peerOffset], peerEnd - peerOffset);
+        if ((rank & mask) == 0)
+            sliceEnd += nSlices;
+        else
+            sliceStart -= nSlices;
+    }
+
+    // Unfold: the odd node of a pair returns the result to the even one
+    if (localNodeIndex < 2 * nRest) {
+        NnSocketIo io;
+        io.socketIndex = getSocketIndexForNode(nodeIndex, tpGroupStart + localNodeIndex - 1);
+        io.data = buffer;
+        io.size = nBytes;
+        network->writeMany(1, &io);
+    }
+}
+
 static void syncNodeSlices_starGatherBroadcast(bool onlyFromWorkerToRoot, NnNetwork *network, NnUint nodeIndex, NnUint nNodes, NnByte *buffer, NnSize nBytes, NnUint nThreads, NnUint threadIndex) {
     NnSize sliceBytes = nBytes / nNodes;
     
@@ -1534,6 +2234,85 @@ static void syncNodeSlices_starGatherBroadcast(bool onlyFromWorkerToRoot, NnNetw
     // All threads reach here together - synchronized!
 }
 
+typedef struct {
+    NnUint index;
+    float value;
+} NnSyncCandidate;
+
+// Rows of a pipe are strided, so every worker packs its slices of all rows into a single message.
+// With `topK` > 0 a worker sends only its `topK` largest values of each row, root fills the rest
+// of the worker slice with -inf. That preserves the argmax of the row.
+static void syncGatherToRoot(NnNetwork *network, NnUint nodeIndex, NnUint nNodes, NnByte *pipe, NnUint nRows, NnSize rowBytes, NnFloatType floatType, NnUint topK, NnUint nThreads, NnUint threadIndex) {
+    const NnSize sliceBytes = rowBytes / nNodes;
+    const NnUint sliceLength = (NnUint)(sliceBytes / sizeof(float));
+    if (topK > 0) {
+        if (floatType != F_32)
+            throw std::invalid_argument("Top-k gather supports only F32 pipes");
+        if (topK > sliceLength)
+            topK = sliceLength;
+    }
+    const NnSize rowMessageBytes = topK > 0 ? topK * sizeof(NnSyncCandidate) : sliceBytes;
+    static thread_local std::vector<NnByte> message;
+    if (message.size() < rowMessageBytes * nRows)
+        message.resize(rowMessageBytes * nRows);
+
+    if (nodeIndex == 0) {
+        NnUint nWorkers = nNodes - 1;
+        NnUint workersPerThread = nWorkers / nThreads + (nWorkers % nThreads > threadIndex ? 1 : 0);
+
+        for (NnUint i = 0; i < workersPerThread; i++) {
+            NnUint workerIdx = threadIndex + i * nThreads + 1;
+            NnSocketIo io;
+            io.socketIndex = workerIdx - 1;
+            io.data = message.data();
+            io.size = rowMessageBytes * nRows;
+            network->readMany(1, &io);
+
+            for (NnUint row = 0; row < nRows; row++) {
+                NnByte *slice = &pipe[row * rowBytes + workerIdx * sliceBytes];
+                NnByte *rowMessage = &message[row * rowMessageBytes];
+                if (topK == 0) {
+                    std::memcpy(slice, rowMessage, sliceBytes);
+                    continue;
+                }
+                float *values = (float *)slice;
+                std::fill(values, values + sliceLength, -INFINITY);
+                NnSyncCandidate *candidates = (NnSyncCandidate *)rowMessage;
+                for (NnUint k = 0; k < topK; k++)
+                    values[candidates[k].index] = candidates[k].value;
+            }
+        }
+    } else {
+        if (threadIndex != 0)
+            return;
+
+        static thread_local std::vector<NnUint> order;
+        for (NnUint row = 0; row < nRows; row++) {
+            NnByte *slice = &pipe[row * rowBytes + nodeIndex * sliceBytes];
+            NnByte *rowMessage = &message[row * rowMessageBytes];
+            if (topK == 0) {
+                std::memcpy(rowMessage, slice, sliceBytes);
+                continue;
+            }
+            const float *values = (float *)slice;
+            order.resize(sliceLength);
+            std::iota(order.begin(), order.end(), 0u);
+            std::partial_sort(order.begin(), order.begin() + topK, order.end(), [values](NnUint a, NnUint b) {
+                return values[a] > values[b];
+            });
+            NnSyncCandidate *candidates = (NnSyncCandidate *)rowMessage;
+            for (NnUint k = 0; k < topK; k++)
+                candidates[k] = { order[k], values[order[k]] };
+        }
+
+        NnSocketIo io;
+        io.socketIndex = 0;
+        io.data = message.data();
+        io.size = rowMessageBytes * nRows;
+        network->writeMany(1, &io);
+    }
+}
+
 static void syncNodeSlices(bool onlyFromWorkerToRoot,
                            NnNetwork *network,
                            NnUint nodeIndex,
@@ -1551,76 +2330,211 @@ static void syncNodeSlices(bool onlyFromWorkerToRoot,
     NnUint nNodes = tpGroupEnd - tpGroupStart;
     if (nNodes <= 1 || nBytes == 0) return;
 
+    // Every node picks the same algorithm, the choice depends only on the TP group and the size of the buffer
     CollectiveType effective = collectiveType;
     if (effective == COLLECTIVE_AUTO) {
-        if (!onlyFromWorkerToRoot && nNodes >= 4) {
-            effective = COLLECTIVE_RING;
-        } else {
+        if (onlyFromWorkerToRoot || nNodes < 4) {
             effective = COLLECTIVE_STAR;
+        } else if (nBytes <= COLLECTIVE_LATENCY_BOUND_BYTES) {
+            effective = COLLECTIVE_HALVING_DOUBLING;
+        } else {
+            effective = COLLECTIVE_RING;
         }
     }
 
-    if (onlyFromWorkerToRoot && effective == COLLECTIVE_RING) {
+    if (onlyFromWorkerToRoot && (effective == COLLECTIVE_RING || effective == COLLECTIVE_HALVING_DOUBLING)) {
         effective = COLLECTIVE_STAR;
     }
 
     if (effective == COLLECTIVE_RING) {
         syncNodeSlices_ringAllReduce(onlyFromWorkerToRoot, network, nodeIndex, tpGroupStart, tpGroupEnd, buffer, nBytes, floatType, nThreads, threadIndex);
+    } else if (effective == COLLECTIVE_HALVING_DOUBLING) {
+        syncNodeSlices_halvingDoublingAllReduce(network, nodeIndex, tpGroupStart, tpGroupEnd, buffer, nBytes, floatType, nThreads, threadIndex);
+    } else if (effective == COLLECTIVE_TREE) {
+        syncNodeSlices_treeAllReduce(onlyFromWorkerToRoot, network, nodeIndex, tpGroupStart, tpGroupEnd, buffer, nBytes, floatType, nThreads, threadIndex);
     } else {
         syncNodeSlices_starAllReduce(onlyFromWorkerToRoot, network, nodeIndex, tpGroupStart, tpGroupEnd, buffer, nBytes, floatType, nThreads, threadIndex);
     }
 }
 
-NnNetworkNodeSynchronizer::NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, CollectiveType collectiveType) {
+NnNetworkNodeSynchronizer::NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, CollectiveType collectiveType, NnBatchSyncMode batchSyncMode) {
     this->network = network;
     this->execution = execution;
     this->netConfig = netConfig;
     this->nodeConfig = nodeConfig;
     this->collectiveType = collectiveType;
+    this->batchSyncMode = batchSyncMode;
+    this->chunkSegmentIndex = 0;
+    this->nStartedChunks = 0;
+    this->nDoneChunks = 0;
+    this->isChunkThreadStopped = false;
+}
+
+NnNetworkNodeSynchronizer::~NnNetworkNodeSynchronizer() {
+    if (!chunkThread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(chunkMutex);
+        isChunkThreadStopped = true;
+    }
+    chunkCv.notify_all();
+    chunkThread.join();
+}
+
+void NnNetworkNodeSynchronizer::syncChunk(NnUint segmentIndex, NnUint chunkIndex, NnUint nThreads, NnUint threadIndex) {
+    if (threadIndex != 0)
+        return;
+    if (!chunkThread.joinable())
+        chunkThread = std::thread(&NnNetworkNodeSynchronizer::runChunks, this);
+    {
+        std::lock_guard<std::mutex> lock(chunkMutex);
+        assert(chunkIndex == nStartedChunks);
+        chunkSegmentIndex = segmentIndex;
+        nStartedChunks = chunkIndex + 1;
+    }
+    chunkCv.notify_all();
+}
+
+void NnNetworkNodeSynchronizer::runChunks() {
+    std::unique_lock<std::mutex> lock(chunkMutex);
+    while (true) {
+        chunkCv.wait(lock, [this]() { return isChunkThreadStopped || nDoneChunks < nStartedChunks; });
+        if (isChunkThreadStopped)
+            break;
+        const NnUint segmentIndex = chunkSegmentIndex;
+        const NnUint chunkIndex = nDoneChunks;
+        const bool hasError = !chunkError.empty();
+        lock.unlock();
+
+        std::string error;
+        if (!hasError) {
+            try {
+                syncChunkColumns(segmentIndex, chunkIndex);
+            } catch (const std::exception &e) {
+                error = e.what();
+            }
+        }
+
+        lock.lock();
+        if (!error.empty())
+            chunkError = error;
+        nDoneChunks++;
+        chunkCv.notify_all();
+    }
+}
+
+void NnNetworkNodeSynchronizer::syncChunkColumns(NnUint segmentIndex, NnUint chunkIndex) {
+    NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+    NnSyncConfig *syncConfig = getChunkedSync(netConfig, segmentConfig);
+    assert(syncConfig != nullptr);
+    const NnUint nRows = segmentConfig->onlyOutputRows ? execution->nOutputRows : execution->batchSize;
+    NnByte *pipe = execution->pipes[syncConfig->pipeIndex];
+    NnPipeConfig *pipeConfig = &netConfig->pipes[syncConfig->pipeIndex];
+
+    NnUint tpGroupStart;
+    NnUint tpGroupEnd;
+    resolveTpGroup(netConfig, nodeConfig, &tpGroupStart, &tpGroupEnd);
+    if (tpGroupEnd - tpGroupStart < 2 || nRows == 0)
+        return;
+    NnUint xStart;
+    NnUint xEnd;
+    splitSyncChunk(pipeConfig->size.x, syncConfig->nChunks, chunkIndex, &xStart, &xEnd);
+    const NnSize rowBytes = getBytes(F_32, pipeConfig->size.x);
+    const NnSize offset = getBytes(F_32, xStart);
+    const NnSize nBytes = getBytes(F_32, xEnd - xStart);
+
+    auto syncStartTime = std::chrono::high_resolution_clock::now();
+    if (nRows == 1 || batchSyncMode == BATCH_SYNC_ROWS) {
+        for (NnUint row = 0; row < nRows; row++)
+            syncNodeSlices(false, network, nodeConfig->nodeIndex, tpGroupStart, tpGroupEnd, &pipe[row * rowBytes + offset], nBytes, F_32, collectiveType, 1u, 0u);
+    } else {
+        // The columns of the rows are strided in the pipe, all rows of the chunk go in a single collective
+        if (chunkBuffer.size() < nBytes * nRows)
+            chunkBuffer.resize(nBytes * nRows);
+        for (NnUint row = 0; row < nRows; row++)
+            std::memcpy(&chunkBuffer[row * nBytes], &pipe[row * rowBytes + offset], nBytes);
+        syncNodeSlices(false, network, nodeConfig->nodeIndex, tpGroupStart, tpGroupEnd, chunkBuffer.data(), nBytes * nRows, F_32, collectiveType, 1u, 0u);
+        for (NnUint row = 0; row < nRows; row++)
+            std::memcpy(&pipe[row * rowBytes + offset], &chunkBuffer[row * nBytes], nBytes);
+    }
+    if (network->isPerformanceMonitoringEnabled())
+        network->recordOperation("SYNC_NODE_SLICES", 0, nBytes * nRows, syncStartTime, std::chrono::high_resolution_clock::now());
+}
+
+void NnNetworkNodeSynchronizer::finishChunks(NnUint segmentIndex) {
+    NnUint nStarted;
+    {
+        std::unique_lock<std::mutex> lock(chunkMutex);
+        chunkCv.wait(lock, [this]() { return nDoneChunks == nStartedChunks; });
+        assert(nStartedChunks == 0 || chunkSegmentIndex == segmentIndex);
+        nStarted = nStartedChunks;
+        nStartedChunks = 0;
+        nDoneChunks = 0;
+        if (!chunkError.empty()) {
+            std::string error = chunkError;
+            chunkError.clear();
+            throw std::runtime_error(error);
+        }
+    }
+
+    // The chunks that the executor did not start are synced now, in the same order on every node
+    NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+    NnSyncConfig *syncConfig = getChunkedSync(netConfig, segmentConfig);
+    for (NnUint chunkIndex = nStarted; chunkIndex < syncConfig->nChunks; chunkIndex++)
+        syncChunkColumns(segmentIndex, chunkIndex);
 }
 
 void NnNetworkNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) {
     NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+    const NnUint nRows = segmentConfig->onlyOutputRows ? execution->nOutputRows : execution->batchSize;
+    if (nRows == 0)
+        return;
+
+    NnUint tpGroupStart;
+    NnUint tpGroupEnd;
+    resolveTpGroup(netConfig, nodeConfig, &tpGroupStart, &tpGroupEnd);
+    NnSyncConfig *chunkedSync = getChunkedSync(netConfig, segmentConfig);
 
     for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
         NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
+        if (syncConfig == chunkedSync) {
+            if (threadIndex == 0)
+                finishChunks(segmentIndex);
+            continue;
+        }
         NnByte *pipe = execution->pipes[syncConfig->pipeIndex];
         NnPipeConfig *pipeConfig = &netConfig->pipes[syncConfig->pipeIndex];
         NnSize batchBytes = getBytes(pipeConfig->size.floatType, pipeConfig->size.x);
 
-        for (NnUint batchIndex = 0; batchIndex < execution->batchSize; batchIndex++) {
-            NnByte *pipeBatch = &pipe[batchIndex * batchBytes];
+        if (syncConfig->syncType == SYNC_GATHER_TO_ROOT) {
+            auto syncStartTime = std::chrono::high_resolution_clock::now();
+            syncGatherToRoot(network, nodeConfig->nodeIndex, netConfig->nNodes, pipe, nRows, batchBytes, pipeConfig->size.floatType, execution->outputTopK, nThreads, threadIndex);
+            if (network->isPerformanceMonitoringEnabled())
+                network->recordOperation("SYNC_GATHER_TO_ROOT", 0, batchBytes * nRows, syncStartTime, std::chrono::high_resolution_clock::now());
+            continue;
+        }
+
+        // Rows of a pipe are contiguous, so in the fused mode the whole [batchSize, x] region
+        // goes through a single collective. The reduction is elementwise, thus the result is the same.
+        const bool fused = batchSyncMode == BATCH_SYNC_FUSED;
+        const NnUint nRegions = fused ? 1 : nRows;
+        const NnSize regionBytes = fused ? batchBytes * nRows : batchBytes;
+
+        for (NnUint regionIndex = 0; regionIndex < nRegions; regionIndex++) {
+            NnByte *region = &pipe[regionIndex * regionBytes];
             
             auto syncStartTime = std::chrono::high_resolution_clock::now();
             std::string syncTypeName;
 
             if (syncConfig->syncType == SYNC_WITH_ROOT) {
                 syncTypeName = "SYNC_WITH_ROOT";
-                syncWithRoot(network, nodeConfig->nodeIndex, pipeBatch, batchBytes, nThreads, threadIndex);
+                syncWithRoot(network, nodeConfig->nodeIndex, tpGroupEnd, region, regionBytes, nThreads, threadIndex);
             } else if (syncConfig->syncType == SYNC_NODE_SLICES) {
                 syncTypeName = "SYNC_NODE_SLICES";
-                NnUint tpGroupStart = nodeConfig->tpGroupStart;
-                NnUint tpGroupEnd = nodeConfig->tpGroupEnd;
-                if (tpGroupEnd <= tpGroupStart ||
-                    tpGroupEnd > netConfig->nNodes ||
-                    nodeConfig->nodeIndex < tpGroupStart ||
-                    nodeConfig->nodeIndex >= tpGroupEnd) {
-                    tpGroupStart = 0;
-                    tpGroupEnd = netConfig->nNodes;
-                }
-                syncNodeSlices(false, network, nodeConfig->nodeIndex, tpGroupStart, tpGroupEnd, pipeBatch, batchBytes, pipeConfig->size.floatType, collectiveType, nThreads, threadIndex);
+                syncNodeSlices(false, network, nodeConfig->nodeIndex, tpGroupStart, tpGroupEnd, region, regionBytes, pipeConfig->size.floatType, collectiveType, nThreads, threadIndex);
             } else if (syncConfig->syncType == SYNC_NODE_SLICES_EXCEPT_ROOT) {
                 syncTypeName = "SYNC_NODE_SLICES_EXCEPT_ROOT";
-                NnUint tpGroupStart = nodeConfig->tpGroupStart;
-                NnUint tpGroupEnd = nodeConfig->tpGroupEnd;
-                if (tpGroupEnd <= tpGroupStart ||
-                    tpGroupEnd > netConfig->nNodes ||
-                    nodeConfig->nodeIndex < tpGroupStart ||
-                    nodeConfig->nodeIndex >= tpGroupEnd) {
-                    tpGroupStart = 0;
-                    tpGroupEnd = netConfig->nNodes;
-                }
-                syncNodeSlices(true, network, nodeConfig->nodeIndex, tpGroupStart, tpGroupEnd, pipeBatch, batchBytes, pipeConfig->size.floatType, collectiveType, nThreads, threadIndex);
+                syncNodeSlices(true, network, nodeConfig->nodeIndex, tpGroupStart, tpGroupEnd, region, regionBytes, pipeConfig->size.floatType, collectiveType, nThreads, threadIndex);
             } else {
                 throw std::invalid_argument("Unknown sync type");
             }
@@ -1629,8 +2543,7 @@ void NnNetworkNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUin
             
             // Record sync operation for monitoring
             if (network->isPerformanceMonitoringEnabled()) {
-                NnSize totalBytes = batchBytes * execution->batchSize;
-                network->recordOperation(syncTypeName, 0, totalBytes, syncStartTime, syncEndTime);
+                network->recordOperation(syncTypeName, 0, regionBytes, syncStartTime, syncEndTime);
             }
         }
     }
@@ -1680,8 +2593,11 @@ void NnRootConfigWriter::writeNode(NnUint socketIndex, NnNodeConfig *config) {
     network->write(socketIndex, &config->tpGroupStart, sizeof(config->tpGroupStart));
     network->write(socketIndex, &config->tpGroupEnd, sizeof(config->tpGroupEnd));
     network->write(socketIndex, &config->positionPipeIndex, sizeof(config->positionPipeIndex));
+    network->write(socketIndex, &config->kvIndexPipeIndex, sizeof(config->kvIndexPipeIndex));
+    network->write(socketIndex, &config->kvBlockTablePipeIndex, sizeof(config->kvBlockTablePipeIndex));
     network->write(socketIndex, &config->tokenPipeIndex, sizeof(config->tokenPipeIndex));
     network->write(socketIndex, &config->xPipeIndex, sizeof(config->xPipeIndex));
+    network->write(socketIndex, &config->xTransferType, sizeof(config->xTransferType));
     network->write(socketIndex, &config->logitsPipeIndex, sizeof(config->logitsPipeIndex));
     network->write(socketIndex, &config->nBuffers, sizeof(config->nBuffers));
     network->write(socketIndex, &config->nSegments, sizeof(config->nSegments));
@@ -1696,11 +2612,13 @@ void NnRootConfigWriter::writeNode(NnUint socketIndex, NnNodeConfig *config) {
         NnSegmentConfig *segmentConfig = &config->segments[segmentIndex];
         network->write(socketIndex, &segmentConfig->nSyncs, sizeof(segmentConfig->nSyncs));
         network->write(socketIndex, &segmentConfig->nOps, sizeof(segmentConfig->nOps));
+        network->write(socketIndex, &segmentConfig->onlyOutputRows, sizeof(segmentConfig->onlyOutputRows));
 
         for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
             NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
             network->write(socketIndex, &syncConfig->pipeIndex, sizeof(syncConfig->pipeIndex));
             network->write(socketIndex, &syncConfig->syncType, sizeof(syncConfig->syncType));
+            network->write(socketIndex, &syncConfig->nChunks, sizeof(syncConfig->nChunks));
         }
         for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
             NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
@@ -1762,8 +2680,11 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
     network->read(ROOT_SOCKET_INDEX, &config.tpGroupStart, sizeof(config.tpGroupStart));
     network->read(ROOT_SOCKET_INDEX, &config.tpGroupEnd, sizeof(config.tpGroupEnd));
     network->read(ROOT_SOCKET_INDEX, &config.positionPipeIndex, sizeof(config.positionPipeIndex));
+    network->read(ROOT_SOCKET_INDEX, &config.kvIndexPipeIndex, sizeof(config.kvIndexPipeIndex));
+    network->read(ROOT_SOCKET_INDEX, &config.kvBlockTablePipeIndex, sizeof(config.kvBlockTablePipeIndex));
     network->read(ROOT_SOCKET_INDEX, &config.tokenPipeIndex, sizeof(config.tokenPipeIndex));
     network->read(ROOT_SOCKET_INDEX, &config.xPipeIndex, sizeof(config.xPipeIndex));
+    network->read(ROOT_SOCKET_INDEX, &config.xTransferType, sizeof(config.xTransferType));
     network->read(ROOT_SOCKET_INDEX, &config.logitsPipeIndex, sizeof(config.logitsPipeIndex));
     network->read(ROOT_SOCKET_INDEX, &config.nBuffers, sizeof(config.nBuffers));
     network->read(ROOT_SOCKET_INDEX, &config.nSegments, sizeof(config.nSegments));
@@ -1781,6 +2702,7 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
         NnSegmentConfig *segmentConfig = &config.segments[segmentIndex];
         network->read(ROOT_SOCKET_INDEX, &segmentConfig->nSyncs, sizeof(segmentConfig->nSyncs));
         network->read(ROOT_SOCKET_INDEX, &segmentConfig->nOps, sizeof(segmentConfig->nOps));
+        network->read(ROOT_SOCKET_INDEX, &segmentConfig->onlyOutputRows, sizeof(segmentConfig->onlyOutputRows));
 
         if (segmentConfig->nSyncs > 0) {
             segmentConfig->syncs = new NnSyncConfig[segmentConfig->nSyncs];
@@ -1789,6 +2711,7 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
                 NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
                 network->read(ROOT_SOCKET_INDEX, &syncConfig->pipeIndex, sizeof(syncConfig->pipeIndex));
                 network->read(ROOT_SOCKET_INDEX, &syncConfig->syncType, sizeof(syncConfig->syncType));
+                network->read(ROOT_SOCKET_INDEX, &syncConfig->nChunks, sizeof(syncConfig->nChunks));
             }
         }
 
@@ -1815,11 +2738,25 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
     return config;
 }
 
-NnRootWeightLoader::NnRootWeightLoader(NnExecutor *executor, NnNetwork *network, NnUint nNodes) {
+NnRootWeightLoader::NnRootWeightLoader(NnExecutor *executor, NnNetwork *network, NnUint nNodes, NnNodeConfig *nodeConfigs) {
     this->executor = executor;
     this->network = network;
     this->nNodes = nNodes;
+    this->nodeConfigs = nodeConfigs;
     this->tempSize = 0;
+
+    nodeOps.resize(nNodes);
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        NnNodeConfig *nodeConfig = &nodeConfigs[nodeIndex];
+        for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+            NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+            for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
+                NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
+                if (opConfig->weightSize.nBytes > 0)
+                    nodeOps[nodeIndex].insert(std::make_pair(std::string(opConfig->name), opConfig->index));
+            }
+        }
+    }
 }
 
 NnRootWeightLoader::~NnRootWeightLoader() {
@@ -1827,8 +2764,9 @@ NnRootWeightLoader::~NnRootWeightLoader() {
         delete[] temp;
 }
 
-static inline bool isMissingOpByName(const std::invalid_argument &e) {
-    return std::strncmp(e.what(), "Cannot locate op by name:", 24) == 0;
+void NnRootWeightLoader::skipNode(NnUint nodeIndex) {
+    // the node loads its weights by itself
+    nodeOps[nodeIndex].clear();
 }
 
 void NnRootWeightLoader::finish() {
@@ -1852,92 +2790,89 @@ void NnRootWeightLoader::allocate(NnSize size) {
     }
 }
 
+bool NnRootWeightLoader::hasOp(NnUint nodeIndex, const char *opName, NnUint opIndex) {
+    return nodeOps[nodeIndex].count(std::make_pair(std::string(opName), opIndex)) > 0;
+}
+
+bool NnRootWeightLoader::hasOpInTpRank(NnUint tpRank, const char *opName, NnUint opIndex) {
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        if (nodeConfigs[nodeIndex].tpRank == tpRank && hasOp(nodeIndex, opName, opIndex))
+            return true;
+    }
+    return false;
+}
+
+void NnRootWeightLoader::loadToNode(NnUint nodeIndex, const char *opName, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) {
+    if (nodeIndex == 0)
+        executor->loadWeight(opName, opIndex, offset, nBytes, weight);
+    else
+        writeWeight(nodeIndex, opName, opIndex, offset, nBytes, weight);
+}
+
+void NnRootWeightLoader::loadToTpRank(NnUint tpRank, const char *opName, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) {
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        if (nodeConfigs[nodeIndex].tpRank == tpRank && hasOp(nodeIndex, opName, opIndex))
+            loadToNode(nodeIndex, opName, opIndex, offset, nBytes, weight);
+    }
+}
+
 void NnRootWeightLoader::writeWeight(NnUint nodeIndex, const char *opName, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight) {
     NnUint nameSize = std::strlen(opName) + 1;
     NnUint socketIndex = nodeIndex - 1;
-    network->write(socketIndex, &nameSize, sizeof(nameSize));
-    network->write(socketIndex, opName, nameSize);
-    network->write(socketIndex, &opIndex, sizeof(opIndex));
-    network->write(socketIndex, &offset, sizeof(offset));
-    network->write(socketIndex, &nBytes, sizeof(nBytes));
-    network->write(socketIndex, weight, nBytes);
+    NnSocketBuffer buffers[] = {
+        { &nameSize, sizeof(nameSize) },
+        { opName, nameSize },
+        { &opIndex, sizeof(opIndex) },
+        { &offset, sizeof(offset) },
+        { &nBytes, sizeof(nBytes) },
+        { weight, nBytes },
+    };
+    network->writeVector(socketIndex, sizeof(buffers) / sizeof(buffers[0]), buffers);
 }
 
 NnSize NnRootWeightLoader::loadRoot(const char *opName, NnUint opIndex, NnSize nBytes, NnByte *weight) {
-    try {
+    if (hasOp(0, opName, opIndex))
         executor->loadWeight(opName, opIndex, 0u, nBytes, weight);
-    } catch (const std::invalid_argument &e) {
-        if (!isMissingOpByName(e))
-            throw;
-    }
     return nBytes;
 }
 
 NnSize NnRootWeightLoader::loadAll(const char *opName, NnUint opIndex, NnSize nBytes, NnByte *weight) {
-    try {
-        executor->loadWeight(opName, opIndex, 0u, nBytes, weight);
-    } catch (const std::invalid_argument &e) {
-        if (!isMissingOpByName(e))
-            throw;
-    }
-
-    if (nNodes > 1u) {
-        for (NnUint nodeIndex = 1u; nodeIndex < nNodes; nodeIndex++)
-            writeWeight(nodeIndex, opName, opIndex, 0u, nBytes, weight);
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        if (hasOp(nodeIndex, opName, opIndex))
+            loadToNode(nodeIndex, opName, opIndex, 0u, nBytes, weight);
     }
     return nBytes;
 }
 
 NnSize NnRootWeightLoader::loadRowMatmulSlices(const char *opName, const NnUint opIndex, const NnUint expertIndex, NnRowMatmulSlice *slice, NnByte *weight) {
     const NnUint offset = expertIndex * slice->sliceSize.nBytes;
-    if (nNodes == 1u) {
-        try {
-            executor->loadWeight(opName, opIndex, offset, slice->sliceSize.nBytes, weight);
-        } catch (const std::invalid_argument &e) {
-            if (!isMissingOpByName(e))
-                throw;
-        }
-    } else {
-        allocate(slice->sliceSize.nBytes);
-        for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
-            splitRowMatmulWeight(slice, nodeIndex, weight, temp);
-            if (nodeIndex == 0u) {
-                try {
-                    executor->loadWeight(opName, opIndex, offset, slice->sliceSize.nBytes, temp);
-                } catch (const std::invalid_argument &e) {
-                    if (!isMissingOpByName(e))
-                        throw;
-                }
-            } else
-                writeWeight(nodeIndex, opName, opIndex, offset, slice->sliceSize.nBytes, temp);
+    // the slices are split between the nodes of a stage, nodes of other stages with the same rank share the split
+    for (NnUint tpRank = 0; tpRank < slice->nNodes; tpRank++) {
+        if (!hasOpInTpRank(tpRank, opName, opIndex))
+            continue;
+        NnByte *split = weight;
+        if (slice->nNodes > 1u) {
+            allocate(slice->sliceSize.nBytes);
+            splitRowMatmulWeight(slice, tpRank, weight, temp);
+            split = temp;
         }
+        loadToTpRank(tpRank, opName, opIndex, offset, slice->sliceSize.nBytes, split);
     }
     return slice->size.nBytes;
 }
 
 NnSize NnRootWeightLoader::loadColMatmulSlices(const char *opName, const NnUint opIndex, const NnUint expertIndex, NnColMatmulSlice *slice, NnByte *weight) {
     const NnUint offset = expertIndex * slice->sliceSize.nBytes;
-    if (nNodes == 1) {
-        try {
-            executor->loadWeight(opName, opIndex, offset, slice->sliceSize.nBytes, weight);
-        } catch (const std::invalid_argument &e) {
-            if (!isMissingOpByName(e))
-                throw;
-        }
-    } else {
-        allocate(slice->sliceSize.nBytes);
-        for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
-            splitColMatmulWeight(slice, nodeIndex, weight, temp);
-            if (nodeIndex == 0) {
-                try {
-                    executor->loadWeight(opName, opIndex, offset, slice->sliceSize.nBytes, temp);
-                } catch (const std::invalid_argument &e) {
-                    if (!isMissingOpByName(e))
-                        throw;
-                }
-            } else
-                writeWeight(nodeIndex, opName, opIndex, offset, slice->sliceSize.nBytes, temp);
+    for (NnUint tpRank = 0; tpRank < slice->nNodes; tpRank++) {
+        if (!hasOpInTpRank(tpRank, opName, opIndex))
+            continue;
+        NnByte *split = weight;
+        if (slice->nNodes > 1u) {
+            allocate(slice->sliceSize.nBytes);
+            splitColMatmulWeight(slice, tpRank, weight, temp);
+            split = temp;
         }
+        loadToTpRank(tpRank, opName, opIndex, offset, slice->sliceSize.nBytes, split);
     }
     return slice->size.nBytes;
 }
@@ -6,13 +6,24 @@
 #include <vector>
 #include <string>
 #include <mutex>
+#include <set>
 
 #define ROOT_SOCKET_INDEX 0
 
+// Below this size an all-reduce is bound by the latency of hops, the auto collective picks the halving-doubling then
+#define COLLECTIVE_LATENCY_BOUND_BYTES 65536
+
 enum CollectiveType {
     COLLECTIVE_AUTO,
     COLLECTIVE_STAR,
     COLLECTIVE_RING,
+    COLLECTIVE_HALVING_DOUBLING,
+    COLLECTIVE_TREE,
+};
+
+enum NnBatchSyncMode {
+    BATCH_SYNC_FUSED, // one collective per sync for all rows of the batch
+    BATCH_SYNC_ROWS, // one collective per sync for every row of the batch
 };
 
 // Network performance monitoring structures
@@ -76,9 +87,19 @@ struct NnSocketIo {
     NnSize size;
 };
 
+struct NnSocketBuffer {
+    const void *data;
+    NnSize size;
+};
+
+class NnSharedMemoryChannel;
+
 class NnNetwork {
 private:
     int *sockets;
+    // A link to a peer on the same host goes through shared memory, the channel is null for a TCP link
+    NnSharedMemoryChannel **channels;
+    bool isZeroCopy;
     NnSize *sentBytes;
     NnSize *recvBytes;
     NnSocketPerformanceStats *socketStats;
@@ -86,22 +107,31 @@ private:
     std::mutex metricsMutex;
 
     void updateSocketStats(NnUint socketIndex, double latencyMs, NnSize bytes);
+    void attachSharedMemory(NnUint nodeIndex, const std::vector<bool> &isLocalSocket);
+    void waitForIos(NnUint n, const NnSocketIo *ios, bool isWriting, std::chrono::steady_clock::time_point lastProgressTime);
 
 public:
     static std::unique_ptr<NnNetwork> serve(int port);
-    static std::unique_ptr<NnNetwork> connect(NnUint nSockets, char **hosts, NnUint *ports);
+    static std::unique_ptr<NnNetwork> connect(NnUint nSockets, char **hosts, NnUint *ports, NnUint nStreams = 1);
 
     NnUint nSockets;
+    // Every peer is connected by `nStreams` connections, the socket of the stream `s` is `s * nSockets + socketIndex`
+    NnUint nStreams;
 
-    NnNetwork(std::vector<NnSocket> *sockets);
+    NnNetwork(std::vector<NnSocket> *sockets, NnUint nStreams = 1);
     ~NnNetwork();
 
     void setTurbo(bool enabled);
+    // Large vectored writes are sent with MSG_ZEROCOPY, the call returns when the kernel has released the buffers
+    void setZeroCopy(bool enabled);
     void write(const NnUint socketIndex, const void *data, const NnSize size);
+    // Writes the buffers as one message, a header and its payload take a single syscall
+    void writeVector(const NnUint socketIndex, NnUint n, const NnSocketBuffer *buffers);
     void read(const NnUint socketIndex, void *data, const NnSize size);
     void writeAck(const NnUint socketIndex);
     void readAck(const NnUint socketIndex);
-    bool tryReadWithMaxAttempts(NnUint socketIndex, void *data, NnSize size, unsigned long maxAttempts);
+    // Returns false when no byte has arrived within `idleTimeoutMs`, the wait blocks the thread
+    bool tryReadWithTimeout(NnUint socketIndex, void *data, NnSize size, unsigned long idleTimeoutMs);
     void writeMany(NnUint n, NnSocketIo *ios);
     void writeAll(void *data, NnSize size);
     void readMany(NnUint n, NnSocketIo *ios);
@@ -126,10 +156,27 @@ private:
     NnNetConfig *netConfig;
     NnNodeConfig *nodeConfig;
     CollectiveType collectiveType;
+    NnBatchSyncMode batchSyncMode;
+
+    // Chunks of a chunked sync are synced in order by a background thread, `sync` syncs the chunks that were not started
+    std::thread chunkThread;
+    std::mutex chunkMutex;
+    std::condition_variable chunkCv;
+    NnUint chunkSegmentIndex;
+    NnUint nStartedChunks;
+    NnUint nDoneChunks;
+    bool isChunkThreadStopped;
+    std::string chunkError;
+    std::vector<NnByte> chunkBuffer;
 public:
-    NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, CollectiveType collectiveType);
-    ~NnNetworkNodeSynchronizer() override {};
+    NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, CollectiveType collectiveType, NnBatchSyncMode batchSyncMode = BATCH_SYNC_FUSED);
+    ~NnNetworkNodeSynchronizer() override;
     void sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) override;
+    void syncChunk(NnUint segmentIndex, NnUint chunkIndex, NnUint nThreads, NnUint threadIndex) override;
+private:
+    void runChunks();
+    void syncChunkColumns(NnUint segmentIndex, NnUint chunkIndex);
+    void finishChunks(NnUint segmentIndex);
 };
 
 class NnRootConfigWriter {
@@ -151,24 +198,34 @@ public:
     NnNodeConfig readNode();
 };
 
+// Sends every weight only to the nodes that have its op, so a pipeline stage receives only its layers.
+// A sliced weight is split once per tensor parallel rank and the split is shared by the stages.
 class NnRootWeightLoader {
 private:
     NnExecutor *executor;
     NnNetwork *network;
     NnUint nNodes;
+    NnNodeConfig *nodeConfigs;
+    std::vector<std::set<std::pair<std::string, NnUint>>> nodeOps;
     NnByte *temp;
     NnSize tempSize;
 public:
-    NnRootWeightLoader(NnExecutor *executor, NnNetwork *network, NnUint nNodes);
+    NnRootWeightLoader(NnExecutor *executor, NnNetwork *network, NnUint nNodes, NnNodeConfig *nodeConfigs);
     ~NnRootWeightLoader();
     void writeWeight(NnUint nodeIndex, const char *opName, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight);
     NnSize loadRoot(const char *opName, NnUint opIndex, NnSize nBytes, NnByte *weight);
     NnSize loadAll(const char *opName, NnUint opIndex, NnSize nBytes, NnByte *weight);
     NnSize loadRowMatmulSlices(const char *opName, const NnUint opIndex, const NnUint expertIndex, NnRowMatmulSlice *slice, NnByte *weight);
     NnSize loadColMatmulSlices(const char *opName, const NnUint opIndex, const NnUint expertIndex, NnColMatmulSlice *slice, NnByte *weight);
+    void skipNode(NnUint nodeIndex);
     void finish();
 private:
-    void allocate(NnSize size);};
+    void allocate(NnSize size);
+    bool hasOp(NnUint nodeIndex, const char *opName, NnUint opIndex);
+    bool hasOpInTpRank(NnUint tpRank, const char *opName, NnUint opIndex);
+    void loadToNode(NnUint nodeIndex, const char *opName, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight);
+    void loadToTpRank(NnUint tpRank, const char *opName, NnUint opIndex, NnSize offset, NnSize nBytes, NnByte *weight);
+};
 
 class NnWorkerWeightReader {
 private:
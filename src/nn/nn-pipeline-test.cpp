@@ -1,7 +1,10 @@
 #include "nn-pipeline.hpp"
 #include "nn-topology.hpp"
 #include <cstdio>
+#include <cmath>
+#include <sys/socket.h>
 #include <cstring>
+#include <vector>
 
 static void assertTrue(bool condition, const char *message) {
     if (!condition) {
@@ -95,13 +98,81 @@ static void testChecksumCalculation() {
     printf("✅ testChecksumCalculation passed\n");
 }
 
+static void testActivationTransferTypes() {
+    const NnSize nValues = 64;
+    float input[nValues];
+    for (NnSize i = 0; i < nValues; i++)
+        input[i] = ((float)i - 32.0f) * 0.37f;
+
+    const NnFloatType types[] = { F_32, F_16, F_Q80 };
+    const float tolerances[] = { 0.0f, 0.01f, 0.1f };
+    for (int t = 0; t < 3; t++) {
+        assertTrue(canTransferActivationAs(types[t], nValues), "Activation type should be supported");
+        std::vector<NnByte> encoded(getBytes(types[t], nValues));
+        float output[nValues];
+        encodeActivation(input, nValues, types[t], encoded.data());
+        decodeActivation(encoded.data(), nValues, types[t], output);
+        for (NnSize i = 0; i < nValues; i++)
+            assertTrue(std::fabs(output[i] - input[i]) <= tolerances[t], "Decoded activation mismatch");
+    }
+    assertTrue(getBytes(F_Q80, nValues) * 3 < nValues * sizeof(float), "Q80 should be smaller than a third of F32");
+    assertTrue(!canTransferActivationAs(F_Q80, nValues + 1), "Q80 needs full blocks");
+    assertTrue(!canTransferActivationAs(F_Q40, nValues), "Q40 is not a transfer type");
+
+    printf("✅ testActivationTransferTypes passed\n");
+}
+
+static void testCreditFlowControl() {
+    // Two stages of one node, connected by a socket pair
+    int fds[2];
+    assertTrue(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "Cannot create socket pair");
+    std::vector<NnSocket> sockets0(1);
+    std::vector<NnSocket> sockets1(1);
+    sockets0[0].assign(fds[0]);
+    sockets1[0].assign(fds[1]);
+    NnNetwork network0(&sockets0);
+    NnNetwork network1(&sockets1);
+
+    NnParallelTopology topology = createPPxTPTopology(2, 2);
+    NnPipelineCommunicator sender(&network0, &topology, 0, F_Q80, 2);
+    NnPipelineCommunicator receiver(&network1, &topology, 1, F_Q80, 2);
+
+    const NnSize nValues = 64;
+    float input[nValues];
+    float output[nValues];
+    for (NnSize i = 0; i < nValues; i++)
+        input[i] = (float)i * 0.25f;
+
+    // Two activations go without a credit, the third one needs the credit of the first one
+    for (NnUint position = 0; position < 2; position++)
+        assertTrue(sender.sendActivation(1, position, 0, 0, (const NnByte *)input, sizeof(input), F_32), "Send failed");
+    NnPipelineActivationHeader header;
+    for (NnUint position = 0; position < 2; position++) {
+        assertTrue(receiver.recvActivation(0, &header, (NnByte *)output, sizeof(output)), "Receive failed");
+        assertTrue(header.seqPosition == position, "Activation order mismatch");
+        assertTrue(header.dtype == F_Q80, "Activation should be sent as Q80");
+        assertTrue(header.payloadBytes == getBytes(F_Q80, nValues), "Q80 payload size mismatch");
+    }
+    assertTrue(sender.sendActivation(1, 2, 0, 0, (const NnByte *)input, sizeof(input), F_32), "Send failed");
+    assertTrue(receiver.recvActivation(0, &header, (NnByte *)output, sizeof(output)), "Receive failed");
+    assertTrue(header.seqPosition == 2, "Activation order mismatch");
+    for (NnSize i = 0; i < nValues; i++)
+        assertTrue(std::fabs(output[i] - input[i]) < 0.1f, "Decoded activation mismatch");
+    sender.drainCredits();
+
+    printf("✅ testCreditFlowControl passed\n");
+}
+
 int main() {
+    initQuants();
     try {
         testHeaderSize();
         testTopologyQueries();
         testStageTransitions();
         testPP1Compatibility();
         testChecksumCalculation();
+        testActivationTransferTypes();
+        testCreditFlowControl();
         
         printf("\n🎉 All pipeline communication tests passed!\n");
         return 0;
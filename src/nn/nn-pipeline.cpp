@@ -2,8 +2,49 @@
 #include <cstring>
 #include <stdexcept>
 
-NnPipelineCommunicator::NnPipelineCommunicator(NnNetwork *network, const NnParallelTopology *topology, NnUint myNodeIndex) {
+bool canTransferActivationAs(NnFloatType type, NnSize nValues) {
+    if (type == F_32 || type == F_16)
+        return true;
+    if (type == F_Q80)
+        return nValues % Q80_BLOCK_SIZE == 0;
+    return false;
+}
+
+void encodeActivation(const float *input, NnSize nValues, NnFloatType type, NnByte *output) {
+    if (type == F_32) {
+        std::memcpy(output, input, nValues * sizeof(float));
+    } else if (type == F_16) {
+        NnFp16 *values = (NnFp16 *)output;
+        for (NnSize i = 0; i < nValues; i++)
+            values[i] = CONVERT_F32_TO_F16(input[i]);
+    } else if (type == F_Q80) {
+        quantizeF32toQ80(input, (NnBlockQ80 *)output, nValues, 1, 0);
+    } else {
+        throw std::invalid_argument("Unsupported activation transfer type: " + std::string(floatTypeToString(type)));
+    }
+}
+
+void decodeActivation(const NnByte *input, NnSize nValues, NnFloatType type, float *output) {
+    if (type == F_32) {
+        std::memcpy(output, input, nValues * sizeof(float));
+    } else if (type == F_16) {
+        const NnFp16 *values = (const NnFp16 *)input;
+        for (NnSize i = 0; i < nValues; i++)
+            output[i] = CONVERT_F16_TO_F32(values[i]);
+    } else if (type == F_Q80) {
+        dequantizeQ80toF32((const NnBlockQ80 *)input, output, nValues, 1, 0);
+    } else {
+        throw std::invalid_argument("Unsupported activation transfer type: " + std::string(floatTypeToString(type)));
+    }
+}
+
+NnPipelineCommunicator::NnPipelineCommunicator(NnNetwork *network, const NnParallelTopology *topology, NnUint myNodeIndex, NnFloatType transferType, NnUint nCredits) {
+    if (nCredits < 1)
+        throw std::invalid_argument("Pipeline needs at least one credit");
     this->network = network;
+    this->transferType = transferType;
+    this->nCredits = nCredits;
+    this->nInFlight = 0;
     this->topology = topology;
     this->myNodeIndex = myNodeIndex;
     
@@ -73,6 +114,17 @@ bool NnPipelineCommunicator::sendActivation(
     
     // Slice-preserving: send to same TP rank in target stage
     NnUint targetSocketIndex = getPipelineSocketIndex(targetPpRank, myTpRank);
+
+    const NnSize nValues = bytes / sizeof(float);
+    if (dtype == F_32 && transferType != F_32 && canTransferActivationAs(transferType, nValues)) {
+        const NnSize transferBytes = getBytes(transferType, nValues);
+        if (transferBuffer.size() < transferBytes)
+            transferBuffer.resize(transferBytes);
+        encodeActivation((const float *)data, nValues, transferType, transferBuffer.data());
+        data = transferBuffer.data();
+        bytes = transferBytes;
+        dtype = transferType;
+    }
     
     // Prepare header
     NnPipelineActivationHeader header;
@@ -84,15 +136,17 @@ bool NnPipelineCommunicator::sendActivation(
     header.checksum = calculateChecksum(data, bytes, dtype);
     
     try {
-        // Send header first
-        network->write(targetSocketIndex, &header, sizeof(header));
-        
-        // Send payload
-        network->write(targetSocketIndex, data, bytes);
-        
-        // Wait for ack
-        network->readAck(targetSocketIndex);
-        
+        // Without a credit the next stage is `nCredits` activations behind
+        for (; nInFlight >= nCredits; nInFlight--)
+            network->readAck(targetSocketIndex);
+
+        // The header and the payload go in a single vectored write
+        NnSocketBuffer buffers[] = {
+            { &header, sizeof(header) },
+            { data, bytes },
+        };
+        network->writeVector(targetSocketIndex, 2, buffers);
+        nInFlight++;
         return true;
     } catch (const std::exception &e) {
         printf("🚨 Pipeline send error (target PP=%u, socket=%u): %s\n", 
@@ -118,26 +172,48 @@ bool NnPipelineCommunicator::recvActivation(
         // Receive header
         network->read(sourceSocketIndex, header, sizeof(NnPipelineActivationHeader));
         
-        // Validate header
-        if (header->payloadBytes > bufferSize) {
+        // Validate header, an encoded payload takes the size of F_32 values in the buffer
+        const bool isEncoded = header->dtype != F_32;
+        NnSize nValues = 0;
+        NnSize decodedBytes = header->payloadBytes;
+        if (isEncoded) {
+            if (header->dtype != F_16 && header->dtype != F_Q80) {
+                printf("🚨 Pipeline recv error: unsupported payload type %d\n", header->dtype);
+                return false;
+            }
+            const NnSize blockSize = getBlockSize(header->dtype);
+            nValues = header->payloadBytes / getBytes(header->dtype, blockSize) * blockSize;
+            decodedBytes = nValues * sizeof(float);
+        }
+        if (decodedBytes > bufferSize) {
             printf("🚨 Pipeline recv error: payload too large (%zu > %zu)\n",
-                   header->payloadBytes, bufferSize);
+                   decodedBytes, bufferSize);
             return false;
         }
         
         // Receive payload
-        network->read(sourceSocketIndex, buffer, header->payloadBytes);
+        NnByte *payload = buffer;
+        if (isEncoded) {
+            if (transferBuffer.size() < header->payloadBytes)
+                transferBuffer.resize(header->payloadBytes);
+            payload = transferBuffer.data();
+        }
+        network->read(sourceSocketIndex, payload, header->payloadBytes);
         
         // Verify checksum
-        NnUint receivedChecksum = calculateChecksum(buffer, header->payloadBytes, header->dtype);
+        NnUint receivedChecksum = calculateChecksum(payload, header->payloadBytes, header->dtype);
         if (receivedChecksum != header->checksum) {
             printf("⚠️  Pipeline recv warning: checksum mismatch (expected=%u, got=%u)\n",
                    header->checksum, receivedChecksum);
             // Continue anyway - checksum is just a hint
         }
         
-        // Send ack
+        // Return the credit
         network->writeAck(sourceSocketIndex);
+
+        // The sender may go on while the payload is decoded
+        if (isEncoded)
+            decodeActivation(payload, nValues, header->dtype, (float *)buffer);
         
         return true;
     } catch (const std::exception &e) {
@@ -147,6 +223,14 @@ bool NnPipelineCommunicator::recvActivation(
     }
 }
 
+void NnPipelineCommunicator::drainCredits() {
+    if (nInFlight == 0)
+        return;
+    NnUint targetSocketIndex = getPipelineSocketIndex(getTargetPpRank(), myTpRank);
+    for (; nInFlight > 0; nInFlight--)
+        network->readAck(targetSocketIndex);
+}
+
 bool NnPipelineCommunicator::shouldSendActivations() const {
     // Send if not in the last stage
     return myPpRank < topology->ppSize - 1;
@@ -4,6 +4,10 @@
 #include "nn-core.hpp"
 #include "nn-network.hpp"
 #include "nn-topology.hpp"
+#include <vector>
+
+// Activations a stage may send before the next stage has read the first one
+#define PIPELINE_DEFAULT_CREDITS 4
 
 // Pipeline activation transfer packet header
 // Used for sending activations between pipeline stages
@@ -16,7 +20,15 @@ typedef struct {
     NnUint checksum;         // Simple checksum for data integrity (sum of first 4 floats)
 } NnPipelineActivationHeader;
 
-// Pipeline communicator for stage-to-stage activation transfer
+// An F_32 activation may travel as F_16 or F_Q80, the receiver converts it back to F_32
+bool canTransferActivationAs(NnFloatType type, NnSize nValues);
+void encodeActivation(const float *input, NnSize nValues, NnFloatType type, NnByte *output);
+void decodeActivation(const NnByte *input, NnSize nValues, NnFloatType type, float *output);
+
+// Pipeline communicator for stage-to-stage activation transfer.
+// The flow control is based on credits: the receiver returns a credit for every activation it has read,
+// the sender waits for a credit only when `nCredits` activations are in flight. So a stage starts the next
+// micro-batch while the next stage is still working on the previous one.
 class NnPipelineCommunicator {
 private:
     NnNetwork *network;
@@ -24,6 +36,10 @@ private:
     NnUint myNodeIndex;
     NnUint myPpRank;
     NnUint myTpRank;
+    NnFloatType transferType;
+    std::vector<NnByte> transferBuffer;
+    NnUint nCredits;
+    NnUint nInFlight; // sent activations whose credit has not been read yet
     
     // Timeout configuration (in milliseconds)
     static const NnUint DEFAULT_SEND_TIMEOUT_MS = 5000;
@@ -37,7 +53,8 @@ private:
     NnUint calculateChecksum(const NnByte *data, NnSize bytes, NnFloatType dtype) const;
 
 public:
-    NnPipelineCommunicator(NnNetwork *network, const NnParallelTopology *topology, NnUint myNodeIndex);
+    // An F_32 activation is sent as `transferType`
+    NnPipelineCommunicator(NnNetwork *network, const NnParallelTopology *topology, NnUint myNodeIndex, NnFloatType transferType = F_32, NnUint nCredits = PIPELINE_DEFAULT_CREDITS);
     ~NnPipelineCommunicator();
     
     // Send activation to the next pipeline stage
@@ -62,7 +79,7 @@ public:
     // Receive activation from the previous pipeline stage
     // - sourcePpRank: Pipeline rank of the source stage
     // - header: Output parameter for received header
-    // - buffer: Buffer to receive activation data (must be pre-allocated)
+    // - buffer: Buffer to receive activation data (must be pre-allocated), an encoded payload is decoded to F_32
     // - bufferSize: Size of the buffer
     // Returns: true on success, false on timeout/error
     bool recvActivation(
@@ -72,6 +89,9 @@ public:
         NnSize bufferSize
     );
     
+    // Reads the credits of all activations in flight, after it the socket to the next stage carries no credit
+    void drainCredits();
+
     // Check if this node should send activations (not in last stage)
     bool shouldSendActivations() const;
     
@@ -0,0 +1,176 @@
+#include "nn-shard.hpp"
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static NnSize alignShardOffset(NnSize offset) {
+    return (offset + SHARD_ALIGNMENT - 1) / SHARD_ALIGNMENT * SHARD_ALIGNMENT;
+}
+
+static unsigned long long getConfigChecksum(NnNodeConfig *nodeConfig) {
+    unsigned long long checksum = CHECKSUM_INIT;
+    const NnUint tpSize = nodeConfig->tpGroupEnd - nodeConfig->tpGroupStart;
+    checksum = updateChecksum(checksum, &nodeConfig->tpRank, sizeof(nodeConfig->tpRank));
+    checksum = updateChecksum(checksum, &tpSize, sizeof(tpSize));
+    for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+        for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
+            NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
+            if (opConfig->weightSize.nBytes == 0)
+                continue;
+            checksum = updateChecksum(checksum, opConfig->name, std::strlen(opConfig->name));
+            checksum = updateChecksum(checksum, &opConfig->index, sizeof(opConfig->index));
+            checksum = updateChecksum(checksum, &opConfig->weightSize.floatType, sizeof(opConfig->weightSize.floatType));
+            checksum = updateChecksum(checksum, &opConfig->weightSize.nBytes, sizeof(opConfig->weightSize.nBytes));
+        }
+    }
+    return checksum;
+}
+
+NnWeightShard::NnWeightShard(const char *path, NnNodeConfig *nodeConfig, unsigned long long modelChecksum) {
+    this->nodeConfig = nodeConfig;
+    this->data = nullptr;
+
+    NnSize offset = alignShardOffset(sizeof(NnShardHeader));
+    for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+        for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
+            NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
+            if (opConfig->weightSize.nBytes == 0)
+                continue;
+            weightOffsets.push_back(offset);
+            offset = alignShardOffset(offset + opConfig->weightSize.nBytes);
+        }
+    }
+    fileSize = offset;
+
+    NnShardHeader expected;
+    std::memset(&expected, 0, sizeof(NnShardHeader));
+    expected.magic = SHARD_MAGIC;
+    expected.version = SHARD_VERSION;
+    expected.isComplete = 1;
+    expected.nWeights = (NnUint)weightOffsets.size();
+    expected.modelChecksum = modelChecksum;
+    expected.configChecksum = getConfigChecksum(nodeConfig);
+    expected.fileSize = fileSize;
+
+    bool isValid = false;
+    FILE *file = fopen(path, "rb");
+    if (file != NULL) {
+        NnShardHeader header;
+        isValid = fread(&header, sizeof(NnShardHeader), 1, file) == 1 &&
+            std::memcmp(&header, &expected, sizeof(NnShardHeader)) == 0;
+        fclose(file);
+    }
+
+    isWritable = !isValid;
+    open(path, isWritable);
+    if (isWritable) {
+        expected.isComplete = 0;
+        std::memcpy(data, &expected, sizeof(NnShardHeader));
+        printf("💾 Writing weights to the shard %s\n", path);
+    } else {
+        printf("💾 Mapped weights from the shard %s\n", path);
+    }
+}
+
+NnWeightShard::~NnWeightShard() {
+    if (data == nullptr)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(hMapping);
+    CloseHandle(hFile);
+#else
+    munmap(data, fileSize);
+    close(fd);
+#endif
+}
+
+void NnWeightShard::open(const char *path, bool create) {
+#ifdef _WIN32
+    hFile = CreateFileA(path, create ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ, NULL,
+        create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Cannot open shard file: " + std::string(path));
+    hMapping = CreateFileMappingA(hFile, NULL, create ? PAGE_READWRITE : PAGE_READONLY,
+        (DWORD)((unsigned long long)fileSize >> 32), (DWORD)(fileSize & 0xFFFFFFFF), NULL);
+    if (hMapping == NULL) {
+        CloseHandle(hFile);
+        throw std::runtime_error("Cannot map shard file: " + std::string(path));
+    }
+    data = (NnByte *)MapViewOfFile(hMapping, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, fileSize);
+    if (data == NULL) {
+        CloseHandle(hMapping);
+        CloseHandle(hFile);
+        throw std::runtime_error("Cannot map shard file: " + std::string(path));
+    }
+#else
+    fd = create ? ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : ::open(path, O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("Cannot open shard file: " + std::string(path));
+    if (create && ftruncate(fd, (off_t)fileSize) != 0) {
+        close(fd);
+        throw std::runtime_error("Cannot resize shard file: " + std::string(path));
+    }
+    void *mapped = mmap(NULL, fileSize, create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Cannot map shard file: " + std::string(path));
+    }
+    data = (NnByte *)mapped;
+#endif
+}
+
+void NnWeightShard::flush(NnByte *from, NnSize nBytes) {
+#ifdef _WIN32
+    if (!FlushViewOfFile(from, nBytes) || !FlushFileBuffers(hFile))
+        throw std::runtime_error("Cannot flush shard file");
+#else
+    if (msync(from, nBytes, MS_SYNC) != 0)
+        throw std::runtime_error("Cannot flush shard file");
+#endif
+}
+
+bool NnWeightShard::isComplete() {
+    return ((NnShardHeader *)data)->isComplete == 1;
+}
+
+void NnWeightShard::attach(NnExecutor *executor) {
+    const bool hasWeights = isComplete();
+    NnUint weightIndex = 0;
+    for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+        for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++) {
+            NnOpConfig *opConfig = &segmentConfig->ops[opIndex];
+            if (opConfig->weightSize.nBytes == 0)
+                continue;
+            NnByte *weight = &data[weightOffsets[weightIndex++]];
+            if (executor->mapWeight(opConfig->name, opConfig->index, weight))
+                continue;
+            // the device cannot use the host memory, it gets a copy
+            if (hasWeights)
+                executor->loadWeight(opConfig->name, opConfig->index, 0, opConfig->weightSize.nBytes, weight);
+            else
+                isWritable = false;
+        }
+    }
+}
+
+void NnWeightShard::complete() {
+    if (isComplete())
+        return;
+    if (!isWritable) {
+        printf("⚠️ Some weights are not in the host memory, the shard is not written\n");
+        return;
+    }
+    const NnSize headerSize = alignShardOffset(sizeof(NnShardHeader));
+    flush(&data[headerSize], fileSize - headerSize);
+    ((NnShardHeader *)data)->isComplete = 1;
+    flush(data, headerSize);
+}
@@ -0,0 +1,52 @@
+#ifndef NN_SHARD_H
+#define NN_SHARD_H
+
+#include "nn-core.hpp"
+#include "nn-executor.hpp"
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define SHARD_MAGIC 0x5348444C
+#define SHARD_VERSION 1
+#define SHARD_ALIGNMENT 4096
+
+// The header is followed by the weights of the node in the order of its ops, every weight starts at a page
+typedef struct {
+    NnUint magic;
+    NnUint version;
+    NnUint isComplete; // set after all weights are written, a partially written shard is never used
+    NnUint nWeights;
+    unsigned long long modelChecksum;
+    unsigned long long configChecksum; // ops, weight sizes and the tensor parallel rank of the node
+    NnSize fileSize;
+} NnShardHeader;
+
+// A file with the weights of a single node. The ops use the mapped file as their weights without a copy,
+// so the memory is shared with the page cache and a restarted node does not need to receive them again.
+class NnWeightShard {
+private:
+    NnNodeConfig *nodeConfig;
+    std::vector<NnSize> weightOffsets;
+    NnSize fileSize;
+    NnByte *data;
+    bool isWritable;
+#ifdef _WIN32
+    HANDLE hFile;
+    HANDLE hMapping;
+#else
+    int fd;
+#endif
+public:
+    NnWeightShard(const char *path, NnNodeConfig *nodeConfig, unsigned long long modelChecksum);
+    ~NnWeightShard();
+    bool isComplete();
+    void attach(NnExecutor *executor);
+    void complete();
+private:
+    void open(const char *path, bool create);
+    void flush(NnByte *from, NnSize nBytes);
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "nn-shm.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+static void assertTrue(bool condition, const char *message) {
+    if (!condition) {
+        throw std::runtime_error(message);
+    }
+}
+
+static void transmit(NnSharedMemoryChannel *channel, const NnByte *data, NnSize size) {
+    while (size > 0) {
+        NnSize n = channel->trySend(data, size);
+        if (n == 0) {
+            channel->waitForSpace(10);
+            continue;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+static void receive(NnSharedMemoryChannel *channel, NnByte *data, NnSize size) {
+    while (size > 0) {
+        NnSize n = channel->tryRecv(data, size);
+        if (n == 0) {
+            channel->waitForData(10);
+            continue;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+static void testAddress() {
+    assertTrue(isSharedMemoryAddress("shm://127.0.0.1"), "shm address not detected");
+    assertTrue(!isSharedMemoryAddress("127.0.0.1"), "tcp address detected as shm");
+    assertTrue(std::strcmp(stripSharedMemoryScheme("shm://10.0.0.1"), "10.0.0.1") == 0, "scheme not stripped");
+    assertTrue(std::strcmp(stripSharedMemoryScheme("10.0.0.1"), "10.0.0.1") == 0, "tcp address changed");
+}
+
+static void testFullRing() {
+    std::unique_ptr<NnSharedMemoryChannel> a(NnSharedMemoryChannel::create());
+    std::unique_ptr<NnSharedMemoryChannel> b(NnSharedMemoryChannel::open(a->getName()));
+    a->unlink();
+
+    std::vector<NnByte> data(SHM_RING_BYTES + 1, 7);
+    assertTrue(a->trySend(data.data(), data.size()) == SHM_RING_BYTES, "ring should accept its capacity");
+    assertTrue(a->trySend(data.data(), 1) == 0, "full ring should not accept data");
+    NnByte byte;
+    assertTrue(a->tryRecv(&byte, 1) == 0, "the sender must not see its own data");
+    assertTrue(b->tryRecv(&byte, 1) == 1 && byte == 7, "peer should receive the data");
+    assertTrue(a->trySend(data.data(), 2) == 1, "ring should accept the freed byte");
+}
+
+static void testTransfer() {
+    std::unique_ptr<NnSharedMemoryChannel> a(NnSharedMemoryChannel::create());
+    std::unique_ptr<NnSharedMemoryChannel> b(NnSharedMemoryChannel::open(a->getName()));
+    a->unlink();
+
+    // More than the ring in odd parts, so both sides wait and the copies wrap around
+    const NnSize size = 3 * SHM_RING_BYTES + 12345;
+    std::vector<NnByte> input(size);
+    for (NnSize i = 0; i < size; i++)
+        input[i] = (NnByte)(i * 31 + 7);
+    std::vector<NnByte> echo(size);
+    std::vector<NnByte> output(size);
+
+    std::thread peer([&]() {
+        // Echoes whatever has arrived, in parts that are not aligned with the parts of the sender
+        for (NnSize offset = 0; offset < size;) {
+            NnSize n = b->tryRecv(&echo[offset], std::min((NnSize)777777, size - offset));
+            if (n == 0) {
+                b->waitForData(10);
+                continue;
+            }
+            transmit(b.get(), &echo[offset], n);
+            offset += n;
+        }
+    });
+    for (NnSize offset = 0; offset < size;) {
+        NnSize n = std::min((NnSize)1000003, size - offset);
+        transmit(a.get(), &input[offset], n);
+        receive(a.get(), &output[offset], n);
+        offset += n;
+    }
+    peer.join();
+    assertTrue(std::memcmp(input.data(), output.data(), size) == 0, "echo mismatch");
+}
+
+int main() {
+    testAddress();
+    printf("✅             testAddress passed\n");
+
+    testFullRing();
+    printf("✅            testFullRing passed\n");
+
+    testTransfer();
+    printf("✅            testTransfer passed\n");
+    return 0;
+}
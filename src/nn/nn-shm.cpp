@@ -0,0 +1,177 @@
+#include "nn-shm.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <chrono>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+#define SHM_SEGMENT_BYTES (2 * sizeof(NnShmRing))
+
+bool isSharedMemoryAddress(const char *host) {
+    return std::strncmp(host, SHM_SCHEME, std::strlen(SHM_SCHEME)) == 0;
+}
+
+const char *stripSharedMemoryScheme(const char *host) {
+    return isSharedMemoryAddress(host) ? host + std::strlen(SHM_SCHEME) : host;
+}
+
+// The futex is not private, so it works across processes that map the same segment
+static void waitForSeq(std::atomic<uint32_t> *seq, uint32_t value, int timeoutMs) {
+#ifdef __linux__
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (long)(timeoutMs % 1000) * 1000000L;
+    syscall(SYS_futex, (uint32_t *)seq, FUTEX_WAIT, value, &timeout, nullptr, 0);
+#else
+    (void)timeoutMs;
+    if (seq->load(std::memory_order_acquire) == value)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+}
+
+static void wakeSeq(std::atomic<uint32_t> *seq, std::atomic<uint32_t> *nWaiters) {
+    seq->fetch_add(1);
+#ifdef __linux__
+    if (nWaiters->load() > 0)
+        syscall(SYS_futex, (uint32_t *)seq, FUTEX_WAKE, 1 << 30, nullptr, nullptr, 0);
+#else
+    (void)nWaiters;
+#endif
+}
+
+static void waitForChange(std::atomic<uint32_t> *seq, std::atomic<uint32_t> *nWaiters, std::atomic<uint64_t> *position, uint64_t value, int timeoutMs) {
+    uint32_t seqValue = seq->load();
+    nWaiters->fetch_add(1);
+    // The peer may have moved between the check of the caller and the registration of the waiter
+    if (position->load() == value)
+        waitForSeq(seq, seqValue, timeoutMs);
+    nWaiters->fetch_sub(1);
+}
+
+NnSharedMemoryChannel::NnSharedMemoryChannel(const std::string &name, bool create) {
+#ifdef _WIN32
+    (void)create;
+    throw std::runtime_error("Shared memory transport is not supported on Windows: " + name);
+#else
+    this->name = name;
+    int fd = shm_open(name.c_str(), create ? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR, 0600);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open shared memory " + name + ": " + std::strerror(errno));
+    if (create && ftruncate(fd, SHM_SEGMENT_BYTES) != 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Cannot resize shared memory " + name + ": " + std::strerror(errno));
+    }
+    memory = mmap(nullptr, SHM_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        if (create)
+            shm_unlink(name.c_str());
+        throw std::runtime_error("Cannot map shared memory " + name + ": " + std::strerror(errno));
+    }
+    isLinked = create;
+
+    NnShmRing *rings = (NnShmRing *)memory;
+    if (create) {
+        // A new segment is zeroed, the atomics start from zero too
+        for (int i = 0; i < 2; i++) {
+            rings[i].head.store(0);
+            rings[i].tail.store(0);
+            rings[i].dataSeq.store(0);
+            rings[i].spaceSeq.store(0);
+            rings[i].nDataWaiters.store(0);
+            rings[i].nSpaceWaiters.store(0);
+        }
+    }
+    // The creator sends through the first ring, the peer through the second one
+    sendRing = create ? &rings[0] : &rings[1];
+    recvRing = create ? &rings[1] : &rings[0];
+#endif
+}
+
+NnSharedMemoryChannel *NnSharedMemoryChannel::create() {
+    static std::atomic<NnUint> nChannels(0);
+#ifdef _WIN32
+    const unsigned long pid = 0;
+#else
+    const unsigned long pid = (unsigned long)getpid();
+#endif
+    std::string name = "/dllama-" + std::to_string(pid) + "-" + std::to_string(nChannels.fetch_add(1));
+    return new NnSharedMemoryChannel(name, true);
+}
+
+NnSharedMemoryChannel *NnSharedMemoryChannel::open(const char *name) {
+    return new NnSharedMemoryChannel(std::string(name), false);
+}
+
+NnSharedMemoryChannel::~NnSharedMemoryChannel() {
+#ifndef _WIN32
+    unlink();
+    munmap(memory, SHM_SEGMENT_BYTES);
+#endif
+}
+
+const char *NnSharedMemoryChannel::getName() const {
+    return name.c_str();
+}
+
+void NnSharedMemoryChannel::unlink() {
+#ifndef _WIN32
+    if (isLinked) {
+        shm_unlink(name.c_str());
+        isLinked = false;
+    }
+#endif
+}
+
+NnSize NnSharedMemoryChannel::trySend(const void *data, NnSize size) {
+    const uint64_t head = sendRing->head.load(std::memory_order_relaxed);
+    const uint64_t tail = sendRing->tail.load(std::memory_order_acquire);
+    const NnSize free = SHM_RING_BYTES - (NnSize)(head - tail);
+    const NnSize n = size < free ? size : free;
+    if (n == 0)
+        return 0;
+    const NnSize offset = (NnSize)(head & (SHM_RING_BYTES - 1));
+    const NnSize first = n < SHM_RING_BYTES - offset ? n : SHM_RING_BYTES - offset;
+    std::memcpy(&sendRing->data[offset], data, first);
+    std::memcpy(&sendRing->data[0], (const NnByte *)data + first, n - first);
+    sendRing->head.store(head + n, std::memory_order_release);
+    wakeSeq(&sendRing->dataSeq, &sendRing->nDataWaiters);
+    return n;
+}
+
+NnSize NnSharedMemoryChannel::tryRecv(void *data, NnSize size) {
+    const uint64_t tail = recvRing->tail.load(std::memory_order_relaxed);
+    const uint64_t head = recvRing->head.load(std::memory_order_acquire);
+    const NnSize available = (NnSize)(head - tail);
+    const NnSize n = size < available ? size : available;
+    if (n == 0)
+        return 0;
+    const NnSize offset = (NnSize)(tail & (SHM_RING_BYTES - 1));
+    const NnSize first = n < SHM_RING_BYTES - offset ? n : SHM_RING_BYTES - offset;
+    std::memcpy(data, &recvRing->data[offset], first);
+    std::memcpy((NnByte *)data + first, &recvRing->data[0], n - first);
+    recvRing->tail.store(tail + n, std::memory_order_release);
+    wakeSeq(&recvRing->spaceSeq, &recvRing->nSpaceWaiters);
+    return n;
+}
+
+void NnSharedMemoryChannel::waitForData(int timeoutMs) {
+    const uint64_t tail = recvRing->tail.load(std::memory_order_relaxed);
+    waitForChange(&recvRing->dataSeq, &recvRing->nDataWaiters, &recvRing->head, tail, timeoutMs);
+}
+
+void NnSharedMemoryChannel::waitForSpace(int timeoutMs) {
+    const uint64_t head = sendRing->head.load(std::memory_order_relaxed);
+    waitForChange(&sendRing->spaceSeq, &sendRing->nSpaceWaiters, &sendRing->tail, head - SHM_RING_BYTES, timeoutMs);
+}
@@ -0,0 +1,54 @@
+#ifndef NN_SHM_H
+#define NN_SHM_H
+
+#include "nn-quants.hpp"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// A worker address with this scheme runs on the host of the root node, e.g. `shm://127.0.0.1:9999`
+#define SHM_SCHEME "shm://"
+#define SHM_RING_BYTES (4 * 1024 * 1024) // power of two
+
+// Single-producer single-consumer byte ring. The producer owns `head`, the consumer owns `tail`.
+// A side that waits sleeps on the sequence of the other side, so an idle peer does not spin.
+typedef struct {
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> dataSeq;
+    std::atomic<uint32_t> nDataWaiters;
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> spaceSeq;
+    std::atomic<uint32_t> nSpaceWaiters;
+    alignas(64) NnByte data[SHM_RING_BYTES];
+} NnShmRing;
+
+bool isSharedMemoryAddress(const char *host);
+// Returns the host without the shared memory scheme
+const char *stripSharedMemoryScheme(const char *host);
+
+// A link between two processes on the same host: a POSIX shared memory segment with one ring per direction.
+// The creator sends the name to the peer over the TCP connection of the link and unlinks it when the peer has opened it.
+class NnSharedMemoryChannel {
+private:
+    std::string name;
+    void *memory;
+    NnShmRing *sendRing;
+    NnShmRing *recvRing;
+    bool isLinked;
+    NnSharedMemoryChannel(const std::string &name, bool create);
+public:
+    static NnSharedMemoryChannel *create();
+    static NnSharedMemoryChannel *open(const char *name);
+    ~NnSharedMemoryChannel();
+    const char *getName() const;
+    void unlink();
+    // Copies as much as fits into the ring, returns the number of copied bytes
+    NnSize trySend(const void *data, NnSize size);
+    // Copies as much as is available, returns the number of copied bytes
+    NnSize tryRecv(void *data, NnSize size);
+    // Sleep until the peer has changed the ring or the timeout has passed
+    void waitForData(int timeoutMs);
+    void waitForSpace(int timeoutMs);
+};
+
+#endif
@@ -757,6 +757,7 @@ void testMultiheadAtt_F32_F32() {
 
             NnUint xPipeIndex = netBuilder->addPipe("X", size2D(F_32, N_BATCHES, MULTIHEAD_ATT_DIM));
             NnUint posPipeIndex = netBuilder->addPipe("POS", size2D(F_32, N_BATCHES, 1));
+            NnUint blockTablePipeIndex = netBuilder->addPipe("KVB", size2D(F_32, N_BATCHES, 1));
             NnUint qBufferIndex = nodeBuilder->addBuffer("POS", size2D(F_32, N_BATCHES, qSliceD0));
             NnUint kCacheBufferIndex = nodeBuilder->addBuffer("kCache", kvCacheSlice.keySize);
             NnUint vCacheBufferIndex = nodeBuilder->addBuffer("vCache", kvCacheSlice.valueSize);
@@ -768,7 +769,8 @@ void testMultiheadAtt_F32_F32() {
                 pointerBatchConfig(SRC_PIPE, xPipeIndex),
                 size0(),
                 NnMultiHeadAttOpConfig{nHeads, nHeads, nKvHeads, headDim, seqLen, qSliceD0, kvDim0,
-                    posPipeIndex, qBufferIndex, kCacheBufferIndex, vCacheBufferIndex, attCacheBufferIndex});
+                    posPipeIndex, qBufferIndex, kCacheBufferIndex, vCacheBufferIndex, attCacheBufferIndex,
+                    blockTablePipeIndex, seqLen, 1});
         },
         [](NnExecutor *executor, NnNetExecution *execution, NnVulkanDevice *device) {
             // TODO: for now this is a smoke test
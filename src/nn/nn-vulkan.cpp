@@ -441,8 +441,12 @@ NnUint NnVulkanDeviceData::resolveBufferBatchOffset(NnPointerConfig *config, NnU
     if (config->type == PNTR_BATCH)
         return offsetZ + sizeX * batchIndex;
     if (config->type == PNTR_BATCHED_SLICE) {
-        assert(sizeX % netConfig->nNodes == 0);
-        return offsetZ + sizeX * batchIndex + (sizeX / netConfig->nNodes) * nodeConfig->nodeIndex;
+        NnUint tpGroupStart;
+        NnUint tpGroupEnd;
+        resolveTpGroup(netConfig, nodeConfig, &tpGroupStart, &tpGroupEnd);
+        const NnUint tpSize = tpGroupEnd - tpGroupStart;
+        assert(sizeX % tpSize == 0);
+        return offsetZ + sizeX * batchIndex + (sizeX / tpSize) * (nodeConfig->nodeIndex - tpGroupStart);
     }
     throw std::runtime_error("Cannot determine buffer offset");
 }
@@ -458,8 +462,11 @@ NnUint NnVulkanDeviceData::resolveBufferBatchWidth(NnPointerConfig *config) {
     if (config->type == PNTR_BATCH)
         return sizeX;
     if (config->type == PNTR_BATCHED_SLICE) {
-        assert(sizeX % netConfig->nNodes == 0);
-        return sizeX / netConfig->nNodes;
+        NnUint tpGroupStart;
+        NnUint tpGroupEnd;
+        resolveTpGroup(netConfig, nodeConfig, &tpGroupStart, &tpGroupEnd);
+        assert(sizeX % (tpGroupEnd - tpGroupStart) == 0);
+        return sizeX / (tpGroupEnd - tpGroupStart);
     }
     throw std::runtime_error("Cannot determine buffer width");
 }
@@ -597,6 +604,7 @@ static void buildShaderLayout(std::vector<NnOpBufferAccess> &a, NnVulkanDeviceDa
             a.push_back({ACCESS_READONLY, data->resolveBufferByIndex(config->keyCacheBufferIndex)});
             a.push_back({ACCESS_READONLY, data->resolveBufferByIndex(config->valueCacheBufferIndex)});
             a.push_back({ACCESS_READ_WRITE, data->resolveBufferByIndex(config->attBufferIndex)});
+            a.push_back({ACCESS_READONLY, data->resolvePipeByIndex(config->kvBlockTablePipeIndex)});
         } break;
         case OP_MOE_GATE: {
             const NnMoeGateOpCodeConfig *config = (NnMoeGateOpCodeConfig *)opConfig->config;
@@ -10,6 +10,7 @@
 #include <stdexcept>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 #include "nn/nn-core.hpp"
 #include "nn/nn-cpu-ops.hpp"
 #include "tokenizer.hpp"
@@ -480,28 +481,42 @@ Sampler::~Sampler() {
 }
 
 int Sampler::sample(float* logits) {
+    SamplerParams params = nextParams();
+    return sample(logits, &params);
+}
+
+SamplerParams Sampler::nextParams() {
+    SamplerParams params;
+    params.temperature = temperature;
+    params.topp = topp;
+    // flip a (float) coin (this is our source of entropy for sampling), the greedy sampling does not need it
+    params.coin = temperature == 0.0f ? 0.0f : randomF32(&rngState);
+    params.vocabSize = vocab_size;
+    return params;
+}
+
+int Sampler::sample(float* logits, const SamplerParams *params) {
 #if DEBUG_SAMPLER_BENCHMARK
     Timer startTime;
 #endif
+    const int n = std::min(params->vocabSize, vocab_size);
     // sample the token given the logits and some hyperparameters
     int next;
-    if (temperature == 0.0f) {
+    if (params->temperature == 0.0f) {
         // greedy argmax sampling: take the token with the highest probability
-        next = sample_argmax(logits, vocab_size);
+        next = sample_argmax(logits, n);
     } else {
         // apply the temperature to the logits
-        for (int q=0; q < vocab_size; q++) { logits[q] /= temperature; }
+        for (int q=0; q < n; q++) { logits[q] /= params->temperature; }
         // apply softmax to the logits to get the probabilities for next token
-        softmax_F32(logits, vocab_size);
-        // flip a (float) coin (this is our source of entropy for sampling)
-        float coin = randomF32(&rngState);
+        softmax_F32(logits, n);
         // we sample from this distribution to get the next token
-        if (topp <= 0 || topp >= 1) {
+        if (params->topp <= 0 || params->topp >= 1) {
             // simply sample from the predicted probability distribution
-            next = sample_mult(logits, vocab_size, coin);
+            next = sample_mult(logits, n, params->coin);
         } else {
             // top-p (nucleus) sampling, clamping the least likely tokens to zero
-            next = sample_topp(logits, vocab_size, topp, probindex, coin);
+            next = sample_topp(logits, n, params->topp, probindex, params->coin);
         }
     }
 #if DEBUG_SAMPLER_BENCHMARK
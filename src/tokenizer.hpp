@@ -74,6 +74,15 @@ typedef struct {
     int index;
 } ProbIndex;
 
+// Everything a sampling needs besides the logits. The coin is drawn in advance,
+// so another node samples the same token as the sampler would.
+typedef struct {
+    float temperature;
+    float topp;
+    float coin;
+    int vocabSize;
+} SamplerParams;
+
 class Sampler {
 private:
     int vocab_size;
@@ -86,6 +95,9 @@ public:
     Sampler(int vocab_size, float temperature, float topp, unsigned long long rngSeed);
     ~Sampler();
     int sample(float *logits);
+    // Draws the coin of the next sampling
+    SamplerParams nextParams();
+    int sample(float *logits, const SamplerParams *params);
     void setTemp(float temp);
     void setSeed(unsigned long long rngSeed);
 };